@@ -32,6 +32,104 @@
 //
 #include "cs.h"                 // this interpreter is also a C++ script
 
+// Compiled scripts are cached in $CS_CACHE_DIR, else $XDG_CACHE_HOME/cs, else ~/.cache/cs, 
+// so a script that hasn't changed is exec()'d without running the compiler.  
+//
+// A script's binary is named <config>-<content> where config hashes the compiler version, 
+// CFLAGS, working directory and script path, and content hashes the script and every header 
+// it includes, as listed by g++ -MMD on the last compile.  <config>.deps holds that list.
+// Set CS_CACHE_DIR to "" to always compile into the script's directory as before.
+//
+
+// FNV-1a - unlike std::hash, the same in every build, because it names files that outlive this process
+static uint64_t hash_bytes( uint64_t h, const char * data, uint64_t len )
+{
+    for( uint64_t i = 0; i < len; i++ ) h = (h ^ uint8_t( data[i] )) * 0x100000001b3ULL;
+    return h;
+}
+
+static uint64_t hash_str( uint64_t h, const std::string& s )
+{
+    return hash_bytes( h, s.c_str(), s.length()+1 );    // NUL keeps "ab"+"c" apart from "a"+"bc"
+}
+
+static std::string hex( uint64_t h )
+{
+    std::string s( 16, '0' );
+    for( int i = 15; i >= 0; i--, h >>= 4 ) s[size_t( i )] = "0123456789abcdef"[h & 0xf];
+    return s;
+}
+
+// returns cache directory, creating it if needed, or "" if there is none
+static std::string cache_dir( void )
+{
+    const char * env = getenv( "CS_CACHE_DIR" );
+    std::string dir;
+    if ( env != nullptr ) {
+        dir = env;
+    } else if ( getenv( "XDG_CACHE_HOME" ) != nullptr && *getenv( "XDG_CACHE_HOME" ) != '\0' ) {
+        dir = std::string( getenv( "XDG_CACHE_HOME" ) ) + "/cs";
+    } else if ( getenv( "HOME" ) != nullptr && *getenv( "HOME" ) != '\0' ) {
+        dir = std::string( getenv( "HOME" ) ) + "/.cache/cs";
+    }
+    if ( dir == "" ) return dir;
+    for( size_t i = 1; i <= dir.length(); i++ )
+    {
+        if ( i == dir.length() || dir[i] == '/' ) mkdir( dir.substr( 0, i ).c_str(), 0755 );
+    }
+    return val( dir ).path_is_dir() ? dir : "";
+}
+
+static const uint64_t HASH_START = 0xcbf29ce484222325ULL;
+
+// hash of the contents of every path in deps, or false if one of them can't be read; each, if given, 
+// gets the hash of each path's contents on its own
+static bool hash_deps( uint64_t& h, const val& deps, std::unordered_map<std::string,uint64_t> * each=nullptr )
+{
+    for( uint64_t i = 0; i < deps.size(); i++ )
+    {
+        const val& path = deps.get( i );
+        if ( !path.path_is_file() ) return false;
+        val blob = val::file_map( path );
+        h = hash_bytes( hash_str( h, path ), blob.data(), blob.size() );
+        if ( each != nullptr ) (*each)[path] = hash_bytes( HASH_START, blob.data(), blob.size() );
+    }
+    return true;
+}
+
+// paths in a make rule written by g++ -MMD: "target: dep dep \<newline> dep", with spaces in names escaped
+static val read_deps( const std::string& dep_name )
+{
+    val deps = val::list();
+    std::string text = std::string( val::file_map( dep_name ) );
+    size_t i = text.find( ": " );
+    if ( i == std::string::npos ) return deps;
+    std::string path;
+    for( i += 2; i <= text.length(); i++ )
+    {
+        char c = (i < text.length()) ? text[i] : ' ';
+        if ( c == '\\' && i+1 < text.length() && text[i+1] != '\n' ) {
+            path += text[++i];
+        } else if ( c == ' ' || c == '\n' || c == '\\' ) {
+            if ( path != "" ) deps.push( path );
+            path = "";
+        } else {
+            path += c;
+        }
+    }
+    return deps;
+}
+
+static void exec( const std::string& exe, const val& exe_name, const val& args )
+{
+    std::vector<std::string> strs{ exe_name };
+    for( uint64_t i = 0; i < args.size(); i++ ) strs.push_back( args.get( i ) );
+    std::vector<char *> argv;
+    for( std::string& s : strs ) argv.push_back( &s[0] );
+    argv.push_back( nullptr );
+    execv( exe.c_str(), argv.data() );
+}
+
 int main( int argc, const char * argv[] )
 {
     csassert( argc > 1, "usage: cs <basename>" );
@@ -43,13 +141,85 @@ int main( int argc, const char * argv[] )
     val CFLAGS   = val( " -std=c++17 -O0 -Werror -Wextra -Wstrict-aliasing -pedantic" ) +
                         " -Wcast-qual -Wctor-dtor-privacy -Wdisabled-optimization" +
                         " -Wformat=2 -Winit-self -Wmissing-include-dirs  -Woverloaded-virtual -Wredundant-decls -Wsign-promo" +
-                        " -Wstrict-overflow=5 -Wswitch-default -Wundef -g" + 
+                        " -Wstrict-overflow=5 -Wswitch-default -Wundef -pthread -g" + 
                         " -I" + cs_path;
-    val cmd = val("g++ ") + CFLAGS + " -o " + exe_name + " " + cpp_name;
-    if ( cmd.run() != 0 ) csdie( "build failed" );
-    if ( exe_name != "cs" ) {
-        cmd = val("./") + exe_name + " " + args;
-        if ( cmd.run() != 0 ) csdie( "run failed" );
+    std::string dir = (exe_name != "cs") ? cache_dir() : "";   // cs itself is always rebuilt in place
+    if ( dir == "" ) {
+        val cmd = val("g++ ") + CFLAGS + " -o " + exe_name + " " + cpp_name;
+        if ( cmd.run() != 0 ) csdie( "build failed" );
+        if ( exe_name != "cs" ) {
+            cmd = val("./") + exe_name + " " + args;
+            if ( cmd.run() != 0 ) csdie( "run failed" );
+        }
+        return 0;
     }
-    return 0;
+
+    char cwd[4096];
+    csassert( getcwd( cwd, sizeof( cwd ) ) != nullptr, std::string( "getcwd() error: " ) + strerror( errno ) );
+    uint64_t config = HASH_START;
+    config = hash_str( config, val( "g++ --version" ).run( "so+se" ) );
+    config = hash_str( config, CFLAGS );
+    config = hash_str( config, cwd );
+    config = hash_str( config, cpp_name );
+    std::string prefix = dir + "/" + hex( config );
+
+    // hit: deps from the last compile are unchanged
+    val deps = val::list();
+    uint64_t content = config;
+    if ( val( prefix + ".deps" ).path_exists() ) {
+        for( std::string_view line : val::file( prefix + ".deps", "r" ).lines() ) deps.push( std::string( line ) );
+        if ( deps.size() != 0 && hash_deps( content, deps ) ) {
+            exec( prefix + "-" + hex( content ), exe_name, args );  // returns only if there's no such binary
+        }
+    }
+
+    // miss: compile to a temporary name, then rename() so that concurrent runs never see a partial binary;
+    // the binary is named for what it was compiled from, so if the script or a header changed during the 
+    // compile, it's compiled again: headers hashed before compiling (the script and those the last compile 
+    // used) must hash the same after it, and headers it newly includes must be older than the compile
+    std::string tmp_name = prefix + "." + std::to_string( getpid() );
+    for( bool stable = false; !stable; )
+    {
+        std::unordered_map<std::string,uint64_t> before;
+        uint64_t ignored = HASH_START;
+        if ( deps.size() == 0 ) deps.push( cpp_name );
+        hash_deps( ignored, deps, &before );
+        time_t start = time( nullptr );
+
+        val cmd = val("g++ ") + CFLAGS + " -MMD -MF " + tmp_name + ".d -o " + tmp_name + " " + cpp_name;
+        if ( cmd.run() != 0 ) {
+            unlink( (tmp_name + ".d").c_str() );
+            csdie( "build failed" );
+        }
+        deps = read_deps( tmp_name + ".d" );
+        unlink( (tmp_name + ".d").c_str() );
+
+        std::unordered_map<std::string,uint64_t> after;
+        content = config;
+        csassert( hash_deps( content, deps, &after ), "could not read headers of " + std::string( cpp_name ) );
+        stable = true;
+        for( const auto& it : after )
+        {
+            auto b = before.find( it.first );
+            stable = stable && ((b != before.end()) ? (b->second == it.second) : (val( it.first ).path_time_modified() < start));
+        }
+    }
+    std::string exe = prefix + "-" + hex( content );
+    csassert( rename( tmp_name.c_str(), exe.c_str() ) == 0, "could not rename " + tmp_name + " - rename() error: " + strerror( errno ) );
+    val f = val::file( tmp_name, "c" );
+    f.write( deps.join( "\n" ) );
+    f.close();
+    csassert( rename( tmp_name.c_str(), (prefix + ".deps").c_str() ) == 0, "could not rename " + tmp_name + " - rename() error: " + strerror( errno ) );
+
+    // drop binaries built from earlier versions of the script
+    val old = val::walk( dir, 1, "f" );
+    for( uint64_t i = 0; i < old.size(); i++ )
+    {
+        std::string path = old.get( i );
+        if ( path.compare( 0, prefix.length()+1, prefix + "-" ) == 0 && path != exe ) unlink( path.c_str() );
+    }
+
+    exec( exe, exe_name, args );
+    csdie( "could not exec " + exe + " - execv() error: " + strerror( errno ) );
+    return 1;
 }
@@ -26,7 +26,6 @@
 //
 // Future features:
 // - better string hashing scheme where we store keys as ints rather than strings
-// - binary file format (BJSON is not very good), even though JSON is pretty fast
 // - XML file format
 // - PLIST file format
 // 
@@ -34,6 +33,7 @@
 #define __cs_h
 
 #include <string>
+#include <string_view>
 #include <cmath>
 #include <initializer_list>
 #include <vector>
@@ -42,6 +42,17 @@
 #include <iomanip>
 #include <algorithm>
 #include <regex>
+#include <type_traits>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <bitset>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,6 +63,22 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined( __linux__ ) && !defined( CS_NO_IO_URING ) && __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#define CS_IO_URING
+#endif
+
+#ifdef __APPLE__
+extern char ** environ;
+#endif
  
 // Proxy used by the [] operator to distinguish get() vs. set()
 // It roughly follows this example: https://stackoverflow.com/questions/3581981/overloading-the-c-indexing-subscript-operator-in-a-manner-that-allows-for-r
@@ -92,6 +119,28 @@ private:
     const char *key;
 };
 
+// Field descriptions for decoding JSON directly into plain C++ structs and encoding them back out.
+// Fields may be bool, integers, floating-point, std::string, val, std::vector of any of these, or 
+// other described structs; a value that doesn't fit its integer field is an error, never truncated:
+//
+//     struct Point { double x; double y; std::vector<int64_t> ids; };
+//
+//     csjson_begin( Point )
+//         csjson_field( x )
+//         csjson_field( y )
+//         csjson_field( ids )
+//     csjson_end
+//
+//     std::vector<Point> points;
+//     val::json_decode_into( buffer, buffer_len, points );
+//     std::string json = val::json_encode_from( points );
+//
+template<typename T> struct json_schema;
+
+#define csjson_begin( T )    template<> struct json_schema<T> { template<typename O, typename F> static void fields( O& o, F&& f ) { (void)o; (void)f;
+#define csjson_field( name ) f( #name, o.name );
+#define csjson_end           } };
+
 // dynamically-typed value
 //
 class CustomVal;
@@ -123,14 +172,34 @@ public:
     static val map( void );
     static val map( val& key_val_list );                        // flattened list of: key0, val0, key1, val1, ...
 
-    static val file( const val& name, const val& options );     // creates or opens named file or pipe; option characters: rwcp
-    static val file( const val& options );                      // creates temporary file or pipe
+    static val blob( uint64_t len );                            // BLOB of len zero bytes, filled in through data_rw()
+    static val blob( const void * data, uint64_t len );         // BLOB holding a copy of data
+
+    static val cmap( uint64_t shard_cnt=64 );                   // concurrent MAP that many threads may use at once; keys are spread
+                                                                // over shard_cnt independently-locked shards
+
+    static val file( const val& name, const val& options );     // creates or opens named file or pipe; option characters:
+                                                                //     r - read (the default), w - write, c - create or truncate, then write, 
+                                                                //     p - named pipe, made with mkfifo() if c is also given
+    static val file( const val& options );                      // creates unnamed temporary file for reading and writing, or pipe if options has p
+    static val file_map( const val& name, const val& options="" ); // returns entire file as read-only BLOB; option characters: r (random access)
+    static val read_files( const val& paths, const val& options="" ); // reads LIST of whole files at once, overlapping their latencies; returns 
+                                                                // LIST of BLOBs in the same order; option characters: s - STRs instead,
+                                                                // j - json_decode() each into a MAP; uses io_uring where the kernel has it,
+                                                                // else the thread pool; define CS_NO_IO_URING to always use the pool
+    static val grep( const val& paths, const val& re, const val& options="" ); // searches files line by line; paths is a path or LIST of paths, and
+                                                                // directories are searched recursively; returns LIST of { path, line number from 1, line }
+                                                                // for each matching line, in path order then line order; files are file_map()'d and
+                                                                // searched on the thread pool, large ones in pieces; only lines holding the longest 
+                                                                // literal that every match contains are run through the regex, and the rest are 
+                                                                // skipped at memchr()/memmem() speed; options are regex option characters, d implied
 
     static val func( val (*f)( const val& args ) );
     static val func( const val& code );
 
-    static val thread(  val (*f)( const val& args ), const val& args );
-    static val threads( const val& thr_cnt, val (*f)( const val& thr_index, const val& args ), const val& args );
+    static val thread(  val (*f)( const val& args ), const val& args );                                          // runs f on the thread pool
+    static val threads( const val& thr_cnt, val (*f)( const val& thr_index, const val& args ), const val& args ); // returns LIST of thr_cnt threads
+    static val channel( uint64_t capacity=1024 );               // bounded FIFO for passing vals between threads; capacity is rounded up to a power of 2
 
     ~val();
 
@@ -215,6 +284,8 @@ public:
     //     a  == awk
     //     g  == grep
     //     G  == egrep
+    //     d  == use the automaton (lazy DFA) engine rather than std::regex when the regex allows it; linear time and no
+    //           deep recursion, but no backreferences or lookahead, and only with j or P; ignored by regex()
     //
     // regex fmt special escape sequences:
     //     $n == n-th backreference (i.e., a copy of the n-th matched group specified with parentheses in the regex pattern).
@@ -224,16 +295,61 @@ public:
     //     $´ == the suffix (i.e., the part of the target sequence that follows the match)
     //     $$ == a single $ character
     //
+    // the overloads that take a regex val look up the compiled std::regex in a bounded LRU cache keyed on (regex, options)
+    //
     std::regex regex( const val& options="" ) const;                                         // returns compiled std::regex this regex string and options string
     val        match( const val& re, const val& options="" ) const;                          // returns LIST with entire match and submatches; else returns UNDEF
     val        match( const std::regex& regex ) const;                                       // same but uses precompiled std::regex
     val        replace( const val& regex, const val& fmt, const val& options="" ) const;     // returns substituted string using std regex fmt; else returns unmodified string
     val        replace( const std::regex& regex, const val& fmt ) const;                     // same but uses precompiled std::regex
-    val        replace_all( const val& regex, const val& fmt, const val& options="", uint64_t max=1000000000 ) const; // same as replace(), but replaces all occurances up to max count
+    val        replace_all( const val& regex, const val& fmt, const val& options="", uint64_t max=1000000000 ) const; // same as replace(), but makes up to max replacements in one left-to-right pass
     val        replace_all( const std::regex& regex, const val& fmt, uint64_t max=1000000000 ) const;                 // same but uses precompiled std::regex
+    static val regex_cache_stats( void );                                                    // returns MAP with hits, misses, size and capacity of the regex cache
+
+    // lazy searching - match groups are string_views into this STR or BLOB, so nothing is copied; 
+    // with the 'd' option a pass over any size of text uses constant extra memory
+    //     for( const val::match_view& m : text.match_all( "user=(\\w+)", "d" ) ) use( m[1] );
+    //
+    class match_view;
+    class match_range;
+    match_view  search( const val& re, const val& options="" ) const;                        // first match anywhere; false if none
+    match_range match_all( const val& re, const val& options="" ) const;                     // every match, left to right; the ones replace_all() replaces
+
+    // compile-time regexes - the pattern is a template argument that is parsed while compiling into matching code
+    // specialized for it; ECMAScript grammar with no options, and no backreferences or lookahead (those don't compile);
+    // long texts are matched by the 'd' automaton, whose captures can differ for groups repeated by a loop whose body 
+    // matches empty, like (c*?)*
+    //
+    //     static constexpr char kv[] = "([a-z]+)=([0-9]+)";
+    //     val m = s.match<kv>();                               // C++17
+    //     val m = s.match<"([a-z]+)=([0-9]+)">();              // C++20 also takes the literal itself
+    //
+#if __cplusplus >= 202002L
+    template<size_t N> struct fixed_string                                                   // string literal as a template argument
+    {
+        char s[N];
+        constexpr fixed_string( const char (&str)[N] )                                       { for( size_t i = 0; i < N; i++ ) s[i] = str[i]; }
+    };
+    template<fixed_string P> val match( void ) const;                                        // same as match( P ) 
+    template<fixed_string P> val replace( const val& fmt ) const;                            // same as replace( P, fmt )
+    template<fixed_string P> val replace_all( const val& fmt, uint64_t max=1000000000 ) const; // same as replace_all( P, fmt, "", max )
+#else
+    template<const char * P> val match( void ) const;                                        // same as match( P ) 
+    template<const char * P> val replace( const val& fmt ) const;                            // same as replace( P, fmt )
+    template<const char * P> val replace_all( const val& fmt, uint64_t max=1000000000 ) const; // same as replace_all( P, fmt, "", max )
+#endif
+
+    // blob-only; a BLOB is a ref-counted byte buffer that is malloc()'d or mmap()'d, so copying the val 
+    // never copies the bytes; a slice shares its parent's bytes and keeps them alive, so a multi-GB
+    // file_map()'d BLOB can be cut up, decoded, and written out without copying any of it
+    //     val hdr = blob.slice( 0, 16 ), body = blob.slice( 16 );
+    //
+    const char * data( void ) const;                                                         // pointer to first byte of BLOB
+    char *       data_rw( void );                                                            // writable pointer; BLOB must be unshared and not mmap()'d
+    val          slice( uint64_t pos, uint64_t len=uint64_t(-1) ) const;                     // bytes [pos, pos+len) without copying; len is clipped at the end
 
-    // list or map or string
-    uint64_t   size( void ) const;                              // number of entries in list or map, or number of characters in STR
+    // list or map or string or blob
+    uint64_t   size( void ) const;                              // number of entries in list or map, or number of characters in STR, or bytes in BLOB
 
     // list or map 
     bool       exists( const val& key ) const;                  // returns true if key has a legal value in list/map
@@ -272,26 +388,97 @@ public:
     val        shift( void );                                   // pop head
     val        split( const val delim = " " ) const;            // split using delimiter
     val        join( const val delim = " " ) const;             // join  using delimiter
+    val&       sort( void );                                    // stable in-place sort; all-INT, all-FLT and all-STR lists get radix sorts,
+                                                                // mixed lists order by kind (UNDEF, BOOL, numbers, STR, others) then value
+    val&       sort_by( val (*key)( const val& x ) );           // same, but orders by key( x ), which is called once per element
+    val&       psort( void );                                   // parallel versions for very large lists
+    val&       psort_by( val (*key)( const val& x ) );
 
     // map-only 
     std::vector<std::string> keys( void ) const;                // list of all keys
 
+    // cmap-only; set(), exists() and size() also work, but get() and [] die, because a reference into the map 
+    // could be overwritten by another thread's set() of the same key while it's being read; use lookup() instead
+    val        lookup( const val& key ) const;                  // returns copy of value, or UNDEF if key doesn't exist
+    val        upsert( const val& key, const val& x, val (*merge)( const val& old, const val& x ) ); // atomically sets key to x if it doesn't exist,
+                                                                                                   // else to merge( old, x ); returns new value; merge runs
+                                                                                                   // unlocked, so it may use this CMAP, and runs again if
+                                                                                                   // another thread changes key in the meantime
+    val        snapshot( void ) const;                          // returns ordinary MAP copy, locking one shard at a time
+
+    // list or map bulk operations - f gets each element of a LIST or each value of a MAP;
+    // map() and filter() return a fresh LIST, or a fresh MAP with the same keys; 
+    // the p versions split the work into chunks across the thread pool, so f must be thread-safe, 
+    // and preduce() also requires f to be associative because chunks are reduced separately
+    val        map( val (*f)( const val& x ) ) const;
+    val        filter( bool (*f)( const val& x ) ) const;
+    val        reduce( val (*f)( const val& acc, const val& x ), const val& init ) const;
+    void       for_each( void (*f)( const val& x ) ) const;
+    val        pmap( val (*f)( const val& x ) ) const;
+    val        pfilter( bool (*f)( const val& x ) ) const;
+    val        preduce( val (*f)( const val& acc, const val& x ), const val& init ) const;
+    void       pfor_each( void (*f)( const val& x ) ) const;
+
     // function-only 
     val  operator () ( ... );                                   // call function with variable list of arguments
 
     // thread-only 
-    val  join( void );                                          // join thread or threads; returns status or list of statuses
+    val  join( void );                                          // join thread or LIST of threads; returns status or list of statuses
+                                                                // (a LIST holding other vals is joined into a STR using " ")
+
+    // channel-only; any number of threads may send and recv at once; close() must be called only after all 
+    // sends have returned, after which sends fail and receivers drain what's left; size() is approximate 
+    bool       send( const val& x );                            // waits while full; returns false if closed
+    bool       try_send( const val& x );                        // returns false if full or closed
+    bool       recv( val& x );                                  // waits while empty; returns false if closed and empty
+    bool       try_recv( val& x );                              // returns false if empty
+    uint64_t   send_many( const val& list );                    // sends LIST elements in order, in batches; returns count sent, less than size() only if closed
+    val        recv_many( uint64_t max_cnt );                   // waits while empty; returns LIST of 1..max_cnt vals, or empty LIST if closed and empty
+    void       close( void );                                   
+    bool       is_closed( void ) const;
+
+    // file-only; reads and writes go through large page-aligned buffers, and regular files are read with 
+    // sequential readahead hints; read_line() and lines() return views into the read buffer, so no line is 
+    // copied, but each view is valid only until the next read from the same FILE; close() flushes and ends 
+    // writing, so the reader of a pipe sees EOF; a FILE is used by one thread at a time
+    //     for( std::string_view line : val::file( "app.log", "r" ).lines() ) ...
+    //
+    class line_range;
+    val        read( uint64_t max_len=uint64_t(-1) );          // next bytes as STR, fewer than max_len only at EOF
+    val        read_blob( uint64_t max_len=uint64_t(-1) );     // same, but as BLOB; large reads go straight into it, skipping the read buffer
+    bool       read_line( std::string_view& line );            // next line without its '\n'; false at EOF
+    line_range lines( void );                                  // remaining lines
+    bool       write( const val& x );                          // buffers STR or BLOB bytes, else x as a STR; false if the reader has gone away;
+                                                               // bytes are always copied, even from a file_map()'d BLOB (only PROCESS send() vmsplice()s)
+    bool       flush( void );                                  // write()s out buffered bytes; false if the reader has gone away
+    void       seek( uint64_t pos );                           // flushes, drops buffered input, and moves to byte pos
 
     // processes
-    val  run( val options="" ) const;                           // run this path (must be a STR)
+    val  run( val options="" ) const;                           // run this command line (sh syntax; sh itself is started only if needed)
                                                                 // options: ""                  - run sync;  return int status of run; process uses same stdin, stdout, stderr 
-                                                                //          "so+se"             - run async; return one string holding stdout+stderr output
-                                                                //          "lo+le"             - run async; return one list() holding separate lines for stdout+stderr output
-                                                                //          "so,se"             - run async; return list of 2 strings holding stdout vs. stderr outputs 
-                                                                //          "lo,le"             - run async; return list of 2 lists holding stdout vs. stderr lines
+                                                                //          "so+se"             - run sync;  return one string holding stdout+stderr output
+                                                                //          "lo+le"             - run sync;  return one list() holding separate lines for stdout+stderr output
+                                                                //          "so,se"             - run sync;  return list of 2 strings holding stdout vs. stderr outputs 
+                                                                //          "lo,le"             - run sync;  return list of 2 lists holding stdout vs. stderr lines
                                                                 //          "o+e"               - run async; return one read-only file() for combined stdout+stderr
                                                                 //          "o,e"               - run async; return list of 2 read-only file() for separate stdout and stderr
                                                                 //          "i,o,e"             - run async; return list of 3 file() for separate stdin, stdout and stderr
+                                                                //                                (the process is reaped once all of its FILEs are gone)
+    static val run_all( const val& cmds, uint64_t max_jobs=0, const val& options="" ); // run LIST of command lines, up to max_jobs at once (0 means one per core);
+                                                                // returns LIST of what run() would return for each, in the same order
+
+    // pipelines - each stage's stdout is a pipe straight into the next stage's stdin, so data between stages never
+    // passes through this process; stages start the same way run() starts a command
+    //     val p = val::pipeline( val{ "grep ERROR app.log", "sort", "uniq -c" }, "o" );
+    //     val chunk;
+    //     while( p.recv( chunk ) ) cout << chunk;
+    //     val statuses = p.join();                             // LIST of each stage's status
+    //
+    static val pipeline( const val& cmds, const val& options="" ); // returns PROCESS val; option characters:
+                                                                //     i - send() writes to first stage's stdin and close() ends it; else stdin is ours
+                                                                //     o - recv() reads last stage's stdout as STR chunks, false at EOF; else stdout is ours
+                                                                // join() closes our ends and returns LIST of statuses; file_map()'d BLOBs are 
+                                                                // send() with vmsplice() on Linux, so their pages go into the pipe uncopied
 
     // paths
     val         path_dir( void ) const;                         // parent directory of path
@@ -306,6 +493,14 @@ public:
     bool        path_is_dir( void ) const;                      // returns true if path is a directory
     time_t      path_time_modified( void ) const;               // returns time last modified (seconds since 1970)
     time_t      path_time_accessed( void ) const;               // returns time last accessed (seconds since 1970)
+    val         path_info( const val& options="" ) const;       // returns MAP from one statx() or lstat(), or UNDEF if path can't be stat'd; describes
+                                                                // a link itself unless options has f (follow); keys: type ("file", "dir", "link", "fifo", 
+                                                                // "socket", "char", "block"), size, mode, uid, gid, nlink, inode, time_modified, 
+                                                                // time_accessed, time_changed, and time_created where the file system records it
+    static val  walk( const val& root, uint64_t thr_cnt=0, const val& options="" ); // returns LIST of paths below directory root, in no particular order,
+                                                                // read by thr_cnt threads (0 means one per core); links aren't followed and unreadable 
+                                                                // directories are skipped; option characters: f - non-directories only, 
+                                                                // r - regular files only, d - directories only, s - sorted
 
     // list/map iterator
     class iterator: public std::iterator< std::input_iterator_tag,   // iterator_category
@@ -341,6 +536,55 @@ public:
     static val json_decode( void * buffer, size_t buffer_len );
     void       json_write( std::string file_name );
 
+    // typed JSON using csjson_begin() field descriptions (see top of file); no val tree is built
+    //     val::json_decode_into( buffer, buffer_len, my_struct_or_vector );
+    //     std::string json = val::json_encode_from( my_struct_or_vector );
+    //
+    template<typename T> static void        json_decode_into( const void * buffer, size_t buffer_len, T& out );
+    template<typename T> static std::string json_encode_from( const T& in );
+
+    // reading/writing compact binary files (much faster to load than JSON)
+    //     top_val = val::bin_read( "my_file.csb" );
+    //     top_val = val::bin_decode( buffer, buffer_len );
+    //     top_val.bin_write( "my_file.csb" ); 
+    //     std::string bytes = top_val.bin_encode();
+    //
+    // format: "csb" magic, version byte, then one tagged value; ints are zigzag varints, 
+    // doubles are raw little-endian, strings are varint length + bytes, and each map key 
+    // is written out once and then referenced by its index in a key dictionary
+    //
+    static val  bin_read( std::string file_name );
+    static val  bin_decode( const void * buffer, size_t buffer_len );
+    static val  bin_decode( const val& blob );                  // same, but BLOBs inside come back as slices of blob rather than copies
+    void        bin_write( std::string file_name ) const;
+    std::string bin_encode( void ) const;
+
+    // reading/writing MessagePack and CBOR; UNDEF is nil/null, BLOB is bin/byte string, 
+    // and decoded map keys that aren't strings are converted using std::string()
+    //     top_val = val::msgpack_decode( buffer, buffer_len );
+    //     std::string bytes = top_val.cbor_encode();
+    //
+    static val  msgpack_decode( const void * buffer, size_t buffer_len );
+    static val  msgpack_decode( const val& blob );              // same, but bin values come back as slices of blob
+    std::string msgpack_encode( void ) const;
+    static val  cbor_decode( const void * buffer, size_t buffer_len );
+    static val  cbor_decode( const val& blob );                 // same, but definite-length byte strings come back as slices of blob
+    std::string cbor_encode( void ) const;
+
+    // writing/mapping zero-copy images
+    //     top_val.image_write( "my_file.csi" );
+    //     val::image img = val::image_map( "my_file.csi" );
+    //     int64_t x = img["key"][3];
+    //
+    // an image is a tree of position-independent, 8-byte-aligned records linked by file offsets;
+    // image_map() mmap()s the file and val::image reads the records in place, so nothing is 
+    // deserialized and pages are faulted in only when touched; processes mapping the same
+    // image share it through the page cache; images use the host's byte order
+    //
+    class image;
+    void         image_write( std::string file_name ) const;
+    static image image_map( std::string file_name );
+
 //-----------------------------------------------------
 //-----------------------------------------------------
 //-----------------------------------------------------
@@ -376,6 +620,9 @@ private:
         FILE,
         THREAD,
         PROCESS,
+        BLOB,
+        CMAP,
+        CHANNEL,
         CUSTOM,
     };
 
@@ -383,24 +630,51 @@ private:
 
     enum kind                   k;
 
-    struct String
+    class  BlockCache;                                  // defined below val
+
+    struct Cached                                       // base of control blocks that come from the calling thread's BlockCache
+    {
+        static void * operator new( size_t size );
+        static void   operator delete( void * p );
+    };
+
+    struct String : Cached
     {
-        uint64_t                ref_cnt;
+        std::atomic<uint64_t>   ref_cnt;
         std::string             s;
     };
 
-    struct List
+    struct List : Cached
     {
-        uint64_t                ref_cnt;
+        std::atomic<uint64_t>   ref_cnt;
         std::vector<val>        l;
     };
 
-    struct Map
+    struct Map : Cached
     {
-        uint64_t                ref_cnt;
+        std::atomic<uint64_t>   ref_cnt;
         std::unordered_map<std::string,val> m;
     };
 
+    struct Thread;                                      // defined below val
+    struct CMap;
+    struct Channel;
+    struct Process;
+    struct File;
+    class  ThreadPool;
+
+    struct Blob : Cached
+    {
+        std::atomic<uint64_t>   ref_cnt;
+        const char *            data;                   // first byte
+        uint64_t                len;                    // number of bytes
+        void *                  map_addr;               // mmap()'d region, or nullptr if data was malloc()'d
+        size_t                  map_len;
+        Blob *                  owner;                  // BLOB whose bytes this slices, holding a ref on it; nullptr if this owns data
+
+        inline bool is_mapped( void ) const             { return (owner != nullptr ? owner : this)->map_addr != nullptr; }
+    };
+
     union
     {
         bool                    b;
@@ -409,13 +683,165 @@ private:
         String *                s;
         List *                  l;
         Map *                   m;
+        Blob *                  bl;
+        Thread *                t;
+        CMap *                  cm;
+        Channel *               ch;
+        Process *               pr;
+        File *                  fi;
         CustomVal *             c;
     } u;
 
     void free( void );
 
+    // regex cache
+    struct Regex;                                       // automaton engine, or std::regex
+    struct RegexCache;
+    static const uint64_t REGEX_CACHE_MAX = 128;
+    static std::shared_ptr<const Regex> regex_cached( const val& re, const val& options );
+
+    // compile-time regex
+    struct CtInst;
+    template<size_t N> struct CtProg;                   // constexpr program for a pattern
+    template<typename Pat> struct CtRegex;              // matcher specialized for Pat::str
+#if __cplusplus >= 202002L
+    template<fixed_string P> struct CtPattern           { static constexpr const char * str = P.s; };
+#else
+    template<const char * P> struct CtPattern           { static constexpr const char * str = P; };
+#endif
+    static const size_t   CT_TEXT_MAX  = 64*1024;       // longer texts use the automaton engine
+    static const uint32_t CT_DEPTH_MAX = 5000;          // deeper backtracking gives up and uses the automaton engine
+    static uint32_t * ct_stamps( size_t n, uint32_t& stamp );
+    template<typename Pat> val ct_match( void ) const;
+    template<typename Pat> val ct_replace( const val& fmt, uint64_t max ) const;
+
     // file utilities
-    static bool file_read( std::string file_name, const char *& start, const char *& end );             // sucks in entire file
+    static const size_t FILE_MAP_MIN = 64*1024;                                     // smaller files are read() rather than mmap()'d
+    static const uint32_t WALK_FD_DEPTH = 32;                                       // walk() directory fds a thread holds open at once
+    static bool file_read_fd( int fd, char *& buff, uint64_t& len, uint64_t size_hint=0 ); // read() until EOF into malloc()'d buff
+    static void blob_free( Blob * blob );
+    static const size_t FILE_BUF_SIZE  = 1 << 20;                                   // initial size of each FILE buffer
+    static const size_t FILE_BUF_ALIGN = 4096;
+    static val  file_fd( int rfd, int wfd, const std::string& name );               // returns FILE owning rfd and wfd
+    static char * file_buf( size_t size );                                          // posix_memalign()'d
+    static bool fd_write( int fd, const char * data, size_t len, bool can_splice ); // writes all of data with SIGPIPE blocked; false on error
+    static val  file_result( char * buff, uint64_t len, char as );                  // BLOB owning malloc()'d buff, or STR or MAP made from it
+#ifdef CS_IO_URING
+    struct Uring;                                                                   // ring for batches of opens and reads
+    static const uint32_t URING_FILES_MAX = 128;                                    // files read_files() keeps in flight at once
+    static bool read_files_uring( const val& paths, char as, std::vector<val>& results ); // false if io_uring is unavailable
+#endif
+    static val  blob_copy( const void * data, uint64_t len );                      // returns new malloc()'d BLOB
+    static val  blob_part( const val& src, const char * data, uint64_t len );       // slice of src holding data if src is a BLOB, else blob_copy()
+
+    // process utilities
+    struct Proc;                                                                    // a spawned child and its captured output
+    static const size_t PROC_READ_SIZE = 64*1024;
+    static bool cmd_words( const std::string& cmd, std::vector<std::string>& words ); // splits like sh; false if cmd needs sh for anything else
+    static void cmd_pipe( int fds[2] );                                             // close-on-exec pipe
+    static void proc_start( Proc& p, const std::string& cmd, char capture,          // capture: ' ' none, '+' stdout and stderr together, ',' separately;
+                            int in_fd=-1, int out_fd=-1 );                          // in_fd and out_fd replace stdin and stdout if not -1
+    static void proc_drain( Proc * procs[], size_t cnt );                           // waits until some pipe is readable or child exits, then reads or reaps
+    static void proc_finish( Proc& p );                                             // reads to EOF, then reaps
+    static bool proc_done( const Proc& p );                                         // at EOF and reaped
+    static char run_capture( const std::string& options );                          // proc_start() capture for run() options
+    static val  run_result( const Proc& p, const std::string& options );            // what run() returns
+    static val  lines_list( const std::string& s );                                 // LIST of lines without their '\n's
+    static val  run_files( const std::string& cmd, const std::string& options );    // run() for the async options that return FILEs
+
+    // grep utilities
+    struct GrepHit
+    {
+        uint64_t                line_num;               // from 0 at the start of the searched text
+        const char *            s;
+        size_t                  len;
+    };
+    static const size_t GREP_PIECE = 4 << 20;                                       // larger files are split into pieces about this big
+    static uint64_t grep_text( const Regex& regex, const char * s, size_t len, std::vector<GrepHit>& hits ); // appends matching lines; returns '\n' count
+    static void     grep_pieces( const Regex& regex, const char * s, size_t len, std::vector<GrepHit>& hits ); // same, in GREP_PIECE pieces on the thread pool
+    static uint64_t grep_lines( const char * s, const char * end );                 // '\n' count, 8 bytes at a time
+
+    // sorting utilities; sorts produce a permutation of (key, index) pairs that is then applied to the LIST
+    enum class sort_kind
+    {
+        GENERIC,
+        INT,
+        FLT,
+        STR,
+    };
+
+    struct SortKey
+    {
+        uint64_t                key;                    // order-preserving bits of INT or FLT, or first 8 bytes of STR
+        uint64_t                idx;
+    };
+
+    static const uint64_t PSORT_MIN = 1 << 16;          // smaller lists aren't worth splitting
+
+    static bool      sort_less( const val& a, const val& b );                                // generic ordering for mixed lists
+    static sort_kind sort_keys( const std::vector<val>& keys, std::vector<SortKey>& perm );
+    static void      sort_radix( SortKey * a, SortKey * tmp, uint64_t n );
+    static void      sort_chunk( sort_kind sk, const std::vector<val>& keys, SortKey * a, SortKey * tmp, uint64_t n );
+    static void      sort_perm( const std::vector<val>& keys, std::vector<SortKey>& perm, bool parallel );
+    void             sort_apply( const std::vector<SortKey>& perm );
+
+    // buffered writer for encoders; keeps everything in buff if fd < 0, else write()s it out in large chunks
+    struct Writer
+    {
+        static const size_t     FLUSH_LEN = 1 << 20;
+
+        std::string             buff;
+        int                     fd;
+        uint64_t                flushed_len;            // bytes already write()n out
+
+        Writer( int _fd=-1 )                                    { fd = _fd; flushed_len = 0; if ( fd >= 0 ) buff.reserve( FLUSH_LEN + 4096 ); }
+        ~Writer()                                               { flush(); }
+
+        inline void put( char ch )                              { buff.push_back( ch ); }
+        inline void put( const void * bytes, size_t len )       { buff.append( reinterpret_cast<const char *>( bytes ), len ); if ( len >= FLUSH_LEN ) maybe_flush(); }
+        inline void put_be( uint64_t x, uint32_t byte_cnt )     { for( uint32_t i = byte_cnt; i > 0; i-- ) buff.push_back( char( x >> (8*(i-1)) ) ); }
+        inline void put_le( uint64_t x, uint32_t byte_cnt )     { for( uint32_t i = 0; i < byte_cnt; i++ ) buff.push_back( char( x >> (8*i) ) ); }
+        inline void put_varint( uint64_t x )                    { while( x >= 0x80 ) { buff.push_back( char( x | 0x80 ) ); x >>= 7; } buff.push_back( char( x ) ); }
+        inline void maybe_flush( void )                         { if ( fd >= 0 && buff.size() >= FLUSH_LEN ) flush(); }
+        inline uint64_t pos( void ) const                       { return flushed_len + buff.size(); }
+        void        flush( void );
+    };
+
+    // binary encoding utilities; readers follow the same xxx/xxx_end convention as the parsing utilities and don't allocate
+    enum class bin_tag : uint8_t
+    {
+        UNDEF,
+        BOOL_FALSE,
+        BOOL_TRUE,
+        INT,
+        FLT,
+        STR,
+        LIST,
+        MAP,
+        BLOB,
+    };
+
+    static inline uint64_t f64_bits( double f )                 { uint64_t x; memcpy( &x, &f, 8 ); return x; }
+    static inline double   bits_f64( uint64_t x )               { double f; memcpy( &f, &x, 8 ); return f; }
+    static inline uint64_t zigzag( int64_t i )                  { return (uint64_t(i) << 1) ^ uint64_t(i >> 63); }
+    static inline int64_t  unzigzag( uint64_t x )               { return int64_t(x >> 1) ^ -int64_t(x & 1); }
+    static bool get_byte( uint8_t& b, const char *& xxx, const char * xxx_end );
+    static bool get_bytes( const char *& bytes, uint64_t len, const char *& xxx, const char * xxx_end );
+    static bool get_be( uint64_t& x, uint32_t byte_cnt, const char *& xxx, const char * xxx_end );
+    static bool get_le( uint64_t& x, uint32_t byte_cnt, const char *& xxx, const char * xxx_end );
+    static bool get_varint( uint64_t& x, const char *& xxx, const char * xxx_end );
+    void        bin_encode_expr( Writer& w, std::unordered_map<std::string,uint64_t>& keys ) const;
+    static val  bin_decode_buf( const char * xxx, const char * xxx_end, const val& src );
+    static bool bin_decode_expr( val& v, std::vector<std::string>& keys, const char *& xxx, const char * xxx_end, const val& src );
+    void        msgpack_encode_expr( Writer& w ) const;
+    static val  msgpack_decode_buf( const char * xxx, const char * xxx_end, const val& src );
+    static bool msgpack_decode_expr( val& v, const char *& xxx, const char * xxx_end, const val& src );
+    static void cbor_put_head( Writer& w, uint8_t major, uint64_t x );
+    void        cbor_encode_expr( Writer& w ) const;
+    static val  cbor_decode_buf( const char * xxx, const char * xxx_end, const val& src );
+    static bool cbor_decode_expr( val& v, const char *& xxx, const char * xxx_end, const val& src );
+    uint64_t    image_write_expr( Writer& w, std::unordered_map<std::string,uint64_t>& keys ) const;
+    static uint64_t image_write_str( Writer& w, bin_tag tag, const char * s, uint64_t len );
 
     // parsing utilities for files sucked into memory
     static uint32_t line_num;
@@ -437,6 +863,18 @@ private:
     static bool parse_json_expr( val& v, const char *& xxx, const char * xxx_end );
     static bool parse_json_map( val& map, const char *& xxx, const char * xxx_end );
     static bool parse_json_list( val& list, const char *& xxx, const char * xxx_end );
+    static bool parse_json_key( std::string_view& key, std::string& tmp, const char *& xxx, const char * xxx_end );
+    static bool parse_json_null( const char *& xxx, const char * xxx_end );
+    static bool skip_json_expr( const char *& xxx, const char * xxx_end );
+    template<typename T> static bool parse_json_typed( T& o, const char *& xxx, const char * xxx_end );
+
+    // JSON encoding utilities
+    template<typename T> struct is_vector                       : std::false_type {};
+    template<typename T> struct is_vector<std::vector<T>>       : std::true_type  {};
+    static void json_put_string( Writer& w, const char * s, size_t len );
+    static void json_put_real64( Writer& w, double f );
+    void        json_encode_expr( Writer& w ) const;
+    template<typename T> static void json_encode_typed( Writer& w, const T& o );
 };
 
 //---------------------------------------------------------------------
@@ -471,6 +909,7 @@ class CustomVal
 {
 public:
     CustomVal( void )                                           { ref_cnt = 1; }
+    CustomVal( const CustomVal& other )                         { (void)other; ref_cnt = 1; }     // copy starts out with its own ref_cnt
     virtual ~CustomVal()                                        { csassert( ref_cnt == 0, "trying to destroy a CustomVal val when ref_cnt is not 0" ); }
 
     virtual std::string kind( void ) const                      { return "CustomVal"; }
@@ -517,7 +956,7 @@ public:
     virtual void       set( const val& k, const val& x )        { csdie( "no override available for CustomVal set()" );           (void)k; (void)x;      }
 
 private:
-    uint64_t ref_cnt;
+    std::atomic<uint64_t> ref_cnt;
 
     friend class val;
 
@@ -530,11 +969,344 @@ private:
     inline uint64_t dec_ref_cnt( void )            
     { 
         csassert( ref_cnt != 0, "trying to decfrement a zero ref_cnt for a CustomVal val" );
-        ref_cnt--;
-        return ref_cnt;
+        return --ref_cnt;
     }
 };
 
+//---------------------------------------------------------------------
+// Per-thread caches of val control blocks.
+//
+// Each block has a header naming the cache of the thread that allocated it.  Blocks freed 
+// on their owner's thread go onto its free list for their size class.  Blocks freed on other 
+// threads are chained into a batch per owner and pushed onto the owner's remote stack with 
+// one CAS; the owner takes the whole stack with one exchange when a free list runs dry.
+// A cache outlives its thread and is adopted by the next thread to start.
+//
+// Define CS_NO_BLOCK_CACHE to use plain new/delete.
+//---------------------------------------------------------------------
+class val::BlockCache
+{
+public:
+    static void * alloc( size_t size );
+    static void   free( void * p );
+
+private:
+    static const uint32_t       CLASS_CNT  = 16;        // size classes of 16, 32, ... 256 bytes
+    static const uint32_t       CACHED_MAX = 4096;      // most free blocks kept per class
+    static const uint32_t       BATCH_MAX  = 64;        // most blocks batched for another thread
+
+    struct Header                                       // 16 bytes, so blocks stay 16-byte aligned
+    {
+        BlockCache *            owner;                  // nullptr if oversized or allocated after the thread's cache went away
+        uint32_t                cls;
+        uint32_t                unused;
+    };
+
+    Header *                    free_list[CLASS_CNT];   // chained through the first word of each block
+    uint32_t                    free_cnt[CLASS_CNT];
+    BlockCache *                batch_owner;            // blocks freed here that belong to another cache
+    Header *                    batch_first;
+    Header *                    batch_last;
+    uint32_t                    batch_cnt;
+    alignas(64) std::atomic<Header *> remote;           // blocks freed by other threads
+
+    static thread_local BlockCache * mine;
+    static thread_local bool    exited;
+
+    BlockCache( void );
+    static BlockCache * get( void );                    // calling thread's cache, or nullptr once the thread is exiting
+    static Header *&    next( Header * h )              { return *static_cast<Header **>( static_cast<void *>( h + 1 ) ); }
+    static void         push_remote( BlockCache * owner, Header * first, Header * last );
+    void                drain_remote( void );
+    void                flush_batch( void );
+};
+
+//---------------------------------------------------------------------
+// THREAD val state
+//---------------------------------------------------------------------
+struct val::Thread : val::Cached
+{
+    std::atomic<uint64_t>       ref_cnt;
+    std::atomic<bool>           started;                // claimed by a pool thread or by a joiner
+    std::atomic<bool>           done;
+    std::mutex                  mtx;
+    std::condition_variable     cv;
+    std::function<val()>        f;
+    val                         status;                 // return value of f, valid once done
+
+    static val start( std::function<val()> f );         // returns THREAD val with f queued on the pool
+    void       run( void );                             // runs f unless already started
+};
+
+//---------------------------------------------------------------------
+// CMAP val state; shards are cache-line aligned so that threads 
+// working on different shards don't contend for the same lines
+//---------------------------------------------------------------------
+struct val::CMap : val::Cached
+{
+    struct alignas(64) Shard
+    {
+        std::mutex                          mtx;
+        std::unordered_map<std::string,val> m;
+    };
+
+    std::atomic<uint64_t>       ref_cnt;
+    std::vector<Shard>          shards;
+
+    CMap( uint64_t shard_cnt ) : shards( shard_cnt )    { ref_cnt = 1; }
+    inline Shard& shard( const std::string& key )       { return shards[(std::hash<std::string>()( key ) >> 7) % shards.size()]; }
+};
+
+//---------------------------------------------------------------------
+// CHANNEL val state: bounded MPMC ring in the style of Vyukov's queue.
+//
+// Senders and receivers claim ranges of positions with one CAS on enq or deq, 
+// then wait for each cell's seq to say that the cell is theirs: seq == pos means empty 
+// and ready for the sender of pos, seq == pos+1 means full and ready for its receiver, 
+// who then sets seq to pos+capacity for the next lap.  The mutex and cv are touched only 
+// when some thread has run out of spins and is sleeping.
+//---------------------------------------------------------------------
+struct val::Channel
+{
+    struct Cell
+    {
+        std::atomic<uint64_t>   seq;
+        val                     x;
+    };
+
+    std::atomic<uint64_t>       ref_cnt;
+    uint64_t                    mask;
+    Cell *                      cells;
+    std::atomic<bool>           closed;
+    std::atomic<uint32_t>       sleeper_cnt;
+    std::mutex                  mtx;
+    std::condition_variable     cv;
+    alignas(64) std::atomic<uint64_t> enq;              // next position to send
+    alignas(64) std::atomic<uint64_t> deq;              // next position to recv
+
+    Channel( uint64_t capacity );
+    ~Channel()                                          { delete[] cells; }
+
+    uint64_t send_range( const val * xx, uint64_t cnt );        // returns count sent without waiting
+    uint64_t recv_range( val * xx, uint64_t max_cnt );          // returns count received without waiting
+    void     wake( void );                                      
+    template<typename Ready> void wait( const Ready& ready );   // returns once ready() is true
+};
+
+//---------------------------------------------------------------------
+// PROCESS val state: the stages of a pipeline() and our ends of the 
+// pipes into its first stage and out of its last
+//---------------------------------------------------------------------
+struct val::Proc
+{
+    pid_t                       pid    = -1;
+    int                         fds[2] = { -1, -1 };    // read ends of stdout and stderr pipes; -1 at EOF or if not captured
+    std::string                 outs[2];
+    int                         pidfd  = -1;            // readable once the child exits; -1 where pidfds aren't supported
+    int                         status = -1;            // wait status, same encoding as system()
+};
+
+struct val::Process : val::Cached
+{
+    std::atomic<uint64_t>       ref_cnt;
+    std::vector<Proc>           stages;
+    int                         in_fd  = -1;            // write end of first stage's stdin
+    int                         out_fd = -1;            // read end of last stage's stdout
+    std::mutex                  mtx;                    // held by join()
+    val                         statuses;               // LIST once joined
+
+    ~Process( void )                                    { join(); }
+    val  join( void );
+    bool send( const val& x );
+    bool recv( val& x );
+    void close( void );
+};
+
+//---------------------------------------------------------------------
+// FILE val state: an fd for each direction, each with one large 
+// page-aligned buffer; lines are handed out as views into the read buffer, 
+// which grows only for a line longer than the whole buffer
+//---------------------------------------------------------------------
+struct val::File : val::Cached
+{
+    std::atomic<uint64_t>       ref_cnt;
+    std::string                 name;                   // for error messages
+    int                         rfd       = -1;         // fd read from, or -1
+    int                         wfd       = -1;         // fd written to, or -1; same as rfd for a file opened "rw"
+    bool                        is_reg    = false;      // rfd is a regular file, so readahead hints apply
+    char *                      rbuf      = nullptr;
+    size_t                      rbuf_size = 0;
+    size_t                      rpos      = 0;          // next unread byte in rbuf
+    size_t                      rend      = 0;          // end of read bytes in rbuf
+    bool                        reof      = false;
+    uint64_t                    roff      = 0;          // file offset just past rend
+    char *                      wbuf      = nullptr;
+    size_t                      wlen      = 0;
+    std::shared_ptr<Proc>       child;                  // run() child whose pipe this is; reaped once its last FILE goes away
+
+    ~File( void );
+    bool fill( void );                                  // keeps [rpos, rend), reads more after it; false at EOF
+    bool read_line( std::string_view& line );
+    val  read( uint64_t max_len );
+    val  read_blob( uint64_t max_len );
+    bool write( const char * data, size_t len );
+    bool flush( void );
+    void seek( uint64_t pos );
+    void close( void );
+    void drop_input( void );                            // moves rfd back over read-ahead bytes before a write to the same fd
+};
+
+//---------------------------------------------------------------------
+// Range over the remaining lines of a FILE
+//---------------------------------------------------------------------
+class val::line_range
+{
+public:
+    class iterator
+    {
+    public:
+        inline iterator( line_range * _r )                              { r = _r;                                                }
+        inline iterator& operator ++ ( void )                           { if ( !r->f.u.fi->read_line( r->line ) ) r = nullptr; return *this; }
+        inline bool      operator != ( const iterator& other ) const    { return r != other.r;                                   }
+        inline std::string_view operator * ( void ) const               { return r->line;                                        }
+    private:
+        line_range *    r;
+    };
+
+    iterator begin( void )                                      { return iterator( f.u.fi->read_line( line ) ? this : nullptr ); }
+    iterator end( void )                                        { return iterator( nullptr );                                     }
+
+private:
+    friend class val;
+
+    val                         f;
+    std::string_view            line;
+
+    line_range( const val& _f ) : f( _f )                       {}
+};
+
+//---------------------------------------------------------------------
+// Work-stealing thread pool shared by all THREAD vals.
+//
+// Each worker has its own deque.  Workers push and pop their own tasks at the back and 
+// steal from the front of other workers' deques when they run out.  Tasks submitted from
+// outside the pool are dealt round-robin.  Any thread waiting on a task helps by running 
+// queued tasks, so tasks may wait on tasks they spawn.  Tasks that may block on other 
+// tasks, such as THREAD bodies using CHANNELs, are submitted with may_block and are never 
+// run by helpers, whose own callers would otherwise be stuck beneath them.
+//---------------------------------------------------------------------
+class val::ThreadPool
+{
+public:
+    static ThreadPool& get( void );                     // process-wide pool, created on first use with CS_THREADS or one worker per core
+
+    void     submit( std::function<void()> task, bool may_block=false );
+    bool     run_one( bool helping=true );              // runs one queued task on the calling thread; false if none
+
+    // brackets a wait on another task that may not have started, such as a CHANNEL recv; 
+    // if every pool thread is in such a wait while tasks are queued, a spare thread is started to run them
+    void     block_begin( void );
+    void     block_end( void );
+    uint32_t worker_cnt( void ) const                   { return uint32_t( queues.size() ); }
+
+    // calls f( first, last ) on chunks covering [0, cnt) and returns when all are done;
+    // chunk_len of 0 picks a few chunks per worker, and the calling thread runs chunks too
+    void     parallel_for( uint64_t cnt, const std::function<void( uint64_t first, uint64_t last )>& f, uint64_t chunk_len=0 );
+
+private:
+    struct Task
+    {
+        std::function<void()>               f;
+        bool                                may_block;
+    };
+
+    struct alignas(64) Queue
+    {
+        std::mutex                          mtx;
+        std::deque<Task>                    tasks;
+    };
+
+    std::vector<Queue *>        queues;
+    std::atomic<uint64_t>       next_queue;
+    std::atomic<uint64_t>       pending;                // tasks submitted but not yet started
+    std::mutex                  idle_mtx;
+    std::condition_variable     idle_cv;
+    std::atomic<uint64_t>       blocked_cnt;            // pool threads inside block_begin/end
+    std::atomic<uint64_t>       spare_cnt;              // spare threads currently running
+
+    static thread_local int64_t self;                   // worker index of calling thread, or -1
+    static thread_local bool    in_pool;                // calling thread is a worker or spare
+
+    ThreadPool( uint32_t thr_cnt );
+    void worker( uint32_t index );
+};
+
+//---------------------------------------------------------------------
+// Image - read-only view of one record in a mapped image file
+//---------------------------------------------------------------------
+class val::image
+{
+public:
+    image( void )                                               { base = nullptr; len = 0; off = 0; }
+
+    // introspection
+    bool             defined( void ) const                      { return tag() != bin_tag::UNDEF; }
+    std::string      kind( void ) const;
+
+    // conversions; str() is zero-copy and valid while any image from this file exists
+    operator bool( void ) const;
+    operator int64_t( void ) const;
+    operator double( void ) const;
+    operator std::string( void ) const                          { return std::string( str() ); }
+    std::string_view str( void ) const;
+    val              to_val( void ) const;                      // deserializes this record and everything below it
+
+    // list or map
+    uint64_t         size( void ) const;                        // number of entries in list or map, or bytes in STR or BLOB
+    image            at( uint64_t i ) const;                    // i-th entry of list, or i-th value of map (maps are sorted by key)
+    std::string_view key_at( uint64_t i ) const;                // i-th key of map
+    bool             exists( const val& key ) const;
+    image            get( const val& key ) const;
+    image            get( std::string_view key ) const;         // binary search of map
+
+    image operator [] ( const val& key ) const                  { return get( key ); }
+    image operator [] ( uint64_t key_u ) const                  { return at( key_u ); }
+    image operator [] ( int64_t key_i ) const                   { return at( key_i ); }
+    image operator [] ( int32_t key_i ) const                   { return at( key_i ); }
+    image operator [] ( const char * key_cs ) const             { return get( std::string_view( key_cs ) ); }
+    image operator [] ( std::string key_s ) const               { return get( std::string_view( key_s ) ); }
+
+    class iterator
+    {
+    public:
+        inline iterator( const image * _img, uint64_t _pos )           { img = _img; pos = _pos;               }
+        inline iterator& operator ++ ( void )                           { pos++; return *this;                  }
+        inline bool      operator != ( const iterator& other ) const    { return pos != other.pos;              }
+        inline image     operator *  ( void ) const                     { return img->at( pos );                }
+        inline std::string_view key( void ) const                       { return img->key_at( pos );            }
+    private:
+        const image *   img;
+        uint64_t        pos;
+    };
+
+    iterator begin( void ) const                                { return iterator( this, 0 );      }
+    iterator end( void ) const                                  { return iterator( this, size() ); }
+
+private:
+    friend class val;
+
+    val              file;                                      // BLOB holding the mapping
+    const char *     base;
+    uint64_t         len;
+    uint64_t         off;                                       // offset of this record
+
+    image( const image& parent, uint64_t _off );
+
+    inline uint64_t  word( uint64_t o ) const                   { csassert( o+8 <= len, "image offset out of range" ); uint64_t x; memcpy( &x, base+o, 8 ); return x; }
+    inline bin_tag   tag( void ) const                          { return (base == nullptr) ? bin_tag::UNDEF : bin_tag( word( off ) & 0xff ); }
+    inline uint64_t  payload( void ) const                      { return word( off ) >> 8; }
+};
+
 std::string val::kind_to_str( const enum kind& k )
 {
     #define kcase( _k ) case kind::_k: return #_k;
@@ -551,6 +1323,9 @@ std::string val::kind_to_str( const enum kind& k )
         kcase( FILE )
         kcase( THREAD )
         kcase( PROCESS )
+        kcase( BLOB )
+        kcase( CMAP )
+        kcase( CHANNEL )
         kcase( CUSTOM )
         default: return "<unknown kind>";
     }
@@ -653,6 +1428,28 @@ inline val val::list( void )
     return l;
 }
 
+inline val val::blob( uint64_t len )
+{
+    // calloc() of a large len gets fresh zero pages from the kernel, so nothing is touched until written
+    char * buff = reinterpret_cast<char *>( calloc( len != 0 ? len : 1, 1 ) );
+    csassert( buff != nullptr, "blob() out of memory" );
+    val v;
+    v.k = kind::BLOB;
+    v.u.bl = new Blob;
+    v.u.bl->ref_cnt  = 1;
+    v.u.bl->data     = buff;
+    v.u.bl->len      = len;
+    v.u.bl->map_addr = nullptr;
+    v.u.bl->map_len  = 0;
+    v.u.bl->owner    = nullptr;
+    return v;
+}
+
+inline val val::blob( const void * data, uint64_t len )
+{
+    return blob_copy( data, len );
+}
+
 inline val val::map( void )
 {
     val m;
@@ -662,6 +1459,15 @@ inline val val::map( void )
     return m;
 }
 
+inline val val::cmap( uint64_t shard_cnt )
+{
+    csassert( shard_cnt != 0, "cmap() needs at least one shard" );
+    val m;
+    m.k = kind::CMAP;
+    m.u.cm = new CMap( shard_cnt );
+    return m;
+}
+
 inline void val::free( void )
 {
     switch( k )
@@ -684,6 +1490,42 @@ inline void val::free( void )
             u.m = nullptr;
             break;
 
+        case kind::BLOB:
+            csassert( u.bl->ref_cnt > 0, "bad BLOB ref count" );
+            if ( --u.bl->ref_cnt == 0 ) blob_free( u.bl );
+            u.bl = nullptr;
+            break;
+
+        case kind::THREAD:
+            csassert( u.t->ref_cnt > 0, "bad THREAD ref count" );
+            if ( --u.t->ref_cnt == 0 ) delete u.t;
+            u.t = nullptr;
+            break;
+
+        case kind::CMAP:
+            csassert( u.cm->ref_cnt > 0, "bad CMAP ref count" );
+            if ( --u.cm->ref_cnt == 0 ) delete u.cm;
+            u.cm = nullptr;
+            break;
+
+        case kind::CHANNEL:
+            csassert( u.ch->ref_cnt > 0, "bad CHANNEL ref count" );
+            if ( --u.ch->ref_cnt == 0 ) delete u.ch;
+            u.ch = nullptr;
+            break;
+
+        case kind::PROCESS:
+            csassert( u.pr->ref_cnt > 0, "bad PROCESS ref count" );
+            if ( --u.pr->ref_cnt == 0 ) delete u.pr;
+            u.pr = nullptr;
+            break;
+
+        case kind::FILE:
+            csassert( u.fi->ref_cnt > 0, "bad FILE ref count" );
+            if ( --u.fi->ref_cnt == 0 ) delete u.fi;
+            u.fi = nullptr;
+            break;
+
         case kind::CUSTOM:
             if ( u.c->dec_ref_cnt() == 0 ) delete u.c;
             u.c = nullptr;
@@ -732,6 +1574,7 @@ inline val::operator bool( void ) const
         case kind::STR:                 return u.s->s == "true" || u.s->s == "1";
         case kind::LIST:                return size() != 0;
         case kind::MAP:                 return size() != 0;
+        case kind::CMAP:                return size() != 0;
         case kind::CUSTOM:              return *u.c;
         default:                        csdie( "can't convert " + kind_to_str(k) + " to bool" ); return false;
     }
@@ -775,6 +1618,7 @@ inline val::operator std::string( void ) const
         case kind::FLT:                 return std::to_string(u.f);
         case kind::STR:                 return u.s->s;
         case kind::LIST:                return join( " " );
+        case kind::BLOB:                return std::string( u.bl->data, u.bl->len );
         case kind::CUSTOM:              return *u.c;
         default:                        csdie( "can't convert " + kind_to_str(k) + " to std::string" ); return "";
     }
@@ -1223,17 +2067,26 @@ inline bool val::operator == ( const val& x ) const
 
 inline val& val::operator = ( const val& x )
 {
-    free();
-    k = x.k;
-    u = x.u;
-    switch( k ) 
+    // take the new reference before dropping the old one, in case x is this val or lives inside it
+    enum kind x_k = x.k;
+    auto      x_u = x.u;
+    switch( x_k ) 
     {
-        case kind::STR:         u.s->ref_cnt++; break;
-        case kind::LIST:        u.l->ref_cnt++; break;
-        case kind::MAP:         u.m->ref_cnt++; break;
-        case kind::CUSTOM:      *u.c = x;       break;
-        default:                                break;
+        case kind::STR:         x_u.s->ref_cnt++;  break;
+        case kind::LIST:        x_u.l->ref_cnt++;  break;
+        case kind::MAP:         x_u.m->ref_cnt++;  break;
+        case kind::BLOB:        x_u.bl->ref_cnt++; break;
+        case kind::THREAD:      x_u.t->ref_cnt++;  break;
+        case kind::CMAP:        x_u.cm->ref_cnt++; break;
+        case kind::CHANNEL:     x_u.ch->ref_cnt++; break;
+        case kind::PROCESS:     x_u.pr->ref_cnt++; break;
+        case kind::FILE:        x_u.fi->ref_cnt++; break;
+        default:                                   break;
     }
+    free();
+    k = x_k;
+    u = x_u;
+    if ( k == kind::CUSTOM ) *u.c = x;
     return *this;
 }
 
@@ -1364,377 +2217,6549 @@ inline val  val::join( const val delim ) const
     return val( s );
 }
 
-inline std::vector<std::string> val::keys( void ) const
+inline val val::thread( val (*f)( const val& args ), const val& args )
 {
-    csassert( k == kind::MAP, "can only get keys for a MAP" );
-    std::vector<std::string> list;
-    for( auto it : u.m->m )
+    return Thread::start( [f, args]( void ) { return f( args ); } );
+}
+
+inline val val::threads( const val& thr_cnt, val (*f)( const val& thr_index, const val& args ), const val& args )
+{
+    val l = list();
+    int64_t cnt = thr_cnt;
+    l.u.l->l.reserve( cnt );
+    for( int64_t i = 0; i < cnt; i++ )
     {
-        list.push_back( it.first );
+        l.push( Thread::start( [f, i, args]( void ) { return f( i, args ); } ) );
     }
-    return list;
+    return l;
 }
 
-inline char val::at( const val& i ) const
+inline val val::Thread::start( std::function<val()> f )
 {
-    csassert( k == kind::STR, "at() allowed only on STR" );    
-    return u.s->s.at( int64_t( i ) );
+    val t;
+    t.k = kind::THREAD;
+    t.u.t = new Thread;
+    t.u.t->ref_cnt = 1;
+    t.u.t->started = false;
+    t.u.t->done = false;
+    t.u.t->f = std::move( f );
+    ThreadPool::get().submit( [t]( void ) { t.u.t->run(); }, true );
+    return t;
 }
 
-inline std::regex val::regex( const val& options ) const
+inline void val::Thread::run( void )
 {
-    // validate options
-    std::string o_s = options;
-    std::regex::flag_type flags;
-    bool got_grammar = false;
-    for( size_t i = 0; i < o_s.length(); i++ )
+    if ( started.exchange( true ) ) return;
+    val s = f();
+    f = nullptr;                                        // drop captured args now rather than when the THREAD is freed
     {
-        char ch = o_s.at( i );
-        switch( ch )
-        {
-            case 'i': flags |= std::regex_constants::icase;                                    break;
-            case 'j': flags |= std::regex_constants::ECMAScript;       got_grammar = true;     break;
-            case 'p': flags |= std::regex_constants::basic;            got_grammar = true;     break;
-            case 'P': flags |= std::regex_constants::extended;         got_grammar = true;     break;
-            case 'a': flags |= std::regex_constants::awk;              got_grammar = true;     break;
-            case 'g': flags |= std::regex_constants::grep;             got_grammar = true;     break;
-            case 'G': flags |= std::regex_constants::egrep;            got_grammar = true;     break;
-            default: csdie( "unknown regex option character: " + std::to_string(ch) );           break;
-        }
+        std::lock_guard<std::mutex> lock( mtx );
+        status = s;
+        done = true;
     }
-    if ( !got_grammar ) flags |= std::regex_constants::ECMAScript;
-
-    return std::regex( std::string(*this), flags );
+    cv.notify_all();
 }
 
-inline val val::match( const std::regex& regex ) const
+inline val val::join( void )
 {
-    // convert to strings 
-    std::string s   = *this;
-    std::smatch sm;
-    if ( !std::regex_match( s, sm, regex ) ) return val();  // return UNDEF
+    switch( k )
+    {
+        case kind::THREAD:
+        {
+            // run it here if no pool thread has got to it yet, else wait for it
+            Thread * thr = u.t;
+            thr->run();
+            if ( !thr->done ) {
+                ThreadPool& pool = ThreadPool::get();
+                pool.block_begin();
+                {
+                    std::unique_lock<std::mutex> lock( thr->mtx );
+                    thr->cv.wait( lock, [thr]( void ) { return thr->done.load(); } );
+                }
+                pool.block_end();
+            }
+            std::lock_guard<std::mutex> lock( thr->mtx );
+            return thr->status;
+        }
 
-    // return matches as a list
-    val matches = list();
-    for( size_t i = 0; i < sm.size(); i++ ) matches += sm[i];
-    return matches;
-}
+        case kind::PROCESS:
+        {
+            return u.pr->join();
+        }
 
-inline val val::match( const val& re, const val& options ) const
-{
-    return match( re.regex( options ) );
-}
+        case kind::LIST:
+        {
+            for( const val& x : u.l->l )
+            {
+                if ( x.k != kind::THREAD ) return join( " " );
+            }
+            val statuses = list();
+            statuses.u.l->l.reserve( u.l->l.size() );
+            for( val& x : u.l->l ) statuses.push( x.join() );
+            return statuses;
+        }
+
+        default:
+            csdie( "join() allowed only on THREAD, PROCESS or LIST" );
+            return val();
+    }
+}
+
+thread_local val::BlockCache * val::BlockCache::mine = nullptr;
+thread_local bool              val::BlockCache::exited = false;
+
+inline val::BlockCache::BlockCache( void )
+{
+    for( uint32_t c = 0; c < CLASS_CNT; c++ ) 
+    {
+        free_list[c] = nullptr;
+        free_cnt[c]  = 0;
+    }
+    batch_owner = nullptr;
+    batch_first = nullptr;
+    batch_last  = nullptr;
+    batch_cnt   = 0;
+    remote      = nullptr;
+}
+
+inline val::BlockCache * val::BlockCache::get( void )
+{
+    if ( mine != nullptr || exited ) return mine;
+
+    // caches are never freed because other threads may still hold their blocks, so reuse those of exited threads
+    static std::mutex                   orphans_mtx;
+    static std::vector<BlockCache *> *  orphans = new std::vector<BlockCache *>;
+    struct Releaser
+    {
+        ~Releaser() 
+        { 
+            mine->flush_batch();
+            std::lock_guard<std::mutex> lock( orphans_mtx );
+            orphans->push_back( mine );
+            mine = nullptr;
+            exited = true;
+        }
+    };
+    {
+        std::lock_guard<std::mutex> lock( orphans_mtx );
+        if ( !orphans->empty() ) {
+            mine = orphans->back();
+            orphans->pop_back();
+        }
+    }
+    if ( mine == nullptr ) mine = new BlockCache;
+    static thread_local Releaser releaser;
+    (void)releaser;
+    return mine;
+}
+
+inline void * val::BlockCache::alloc( size_t size )
+{
+    uint32_t cls = uint32_t( (std::max( size, size_t( 16 ) ) + 15) / 16 - 1 );
+#ifndef CS_NO_BLOCK_CACHE
+    BlockCache * c = (cls < CLASS_CNT) ? get() : nullptr;
+    if ( c != nullptr ) {
+        if ( c->free_list[cls] == nullptr && c->remote.load( std::memory_order_relaxed ) != nullptr ) c->drain_remote();
+        Header * h = c->free_list[cls];
+        if ( h != nullptr ) {
+            c->free_list[cls] = next( h );
+            c->free_cnt[cls]--;
+            return h + 1;
+        }
+    }
+#else
+    BlockCache * c = nullptr;
+#endif
+    Header * h = static_cast<Header *>( ::operator new( sizeof( Header ) + (cls + 1) * 16 ) );
+    h->owner = c;
+    h->cls   = cls;
+    return h + 1;
+}
+
+inline void val::BlockCache::free( void * p )
+{
+    if ( p == nullptr ) return;
+    Header * h = static_cast<Header *>( p ) - 1;
+    BlockCache * owner = h->owner;
+    if ( owner == nullptr ) {
+        ::operator delete( h );
+        return;
+    }
+
+    BlockCache * c = get();
+    if ( owner == c ) {
+        if ( c->free_cnt[h->cls] >= CACHED_MAX ) {
+            ::operator delete( h );
+        } else {
+            next( h ) = c->free_list[h->cls];
+            c->free_list[h->cls] = h;
+            c->free_cnt[h->cls]++;
+        }
+    } else if ( c == nullptr ) {
+        push_remote( owner, h, h );
+    } else {
+        if ( c->batch_owner != owner ) c->flush_batch();
+        next( h ) = c->batch_first;
+        c->batch_first = h;
+        if ( c->batch_last == nullptr ) c->batch_last = h;
+        c->batch_owner = owner;
+        if ( ++c->batch_cnt == BATCH_MAX ) c->flush_batch();
+    }
+}
+
+inline void val::BlockCache::push_remote( BlockCache * owner, Header * first, Header * last )
+{
+    Header * head = owner->remote.load( std::memory_order_relaxed );
+    do 
+    {
+        next( last ) = head;
+    } while( !owner->remote.compare_exchange_weak( head, first, std::memory_order_release, std::memory_order_relaxed ) );
+}
+
+inline void val::BlockCache::drain_remote( void )
+{
+    Header * h = remote.exchange( nullptr, std::memory_order_acquire );
+    while( h != nullptr )
+    {
+        Header * h_next = next( h );
+        next( h ) = free_list[h->cls];
+        free_list[h->cls] = h;
+        free_cnt[h->cls]++;
+        h = h_next;
+    }
+}
+
+inline void val::BlockCache::flush_batch( void )
+{
+    if ( batch_cnt == 0 ) return;
+    push_remote( batch_owner, batch_first, batch_last );
+    batch_owner = nullptr;
+    batch_first = nullptr;
+    batch_last  = nullptr;
+    batch_cnt   = 0;
+}
+
+inline void * val::Cached::operator new( size_t size )
+{
+    return BlockCache::alloc( size );
+}
+
+inline void val::Cached::operator delete( void * p )
+{
+    BlockCache::free( p );
+}
+
+thread_local int64_t val::ThreadPool::self = -1;
+thread_local bool    val::ThreadPool::in_pool = false;
+
+inline val::ThreadPool& val::ThreadPool::get( void )
+{
+    // one worker per core unless CS_THREADS says otherwise;
+    // never destroyed, so workers can't be torn down underneath tasks still running at exit
+    static ThreadPool * pool = new ThreadPool( (getenv( "CS_THREADS" ) != nullptr) ? std::max( 1, std::atoi( getenv( "CS_THREADS" ) ) ) 
+                                                                                 : std::max( 1U, std::thread::hardware_concurrency() ) );
+    return *pool;
+}
+
+inline val::ThreadPool::ThreadPool( uint32_t thr_cnt )
+{
+    next_queue  = 0;
+    pending     = 0;
+    blocked_cnt = 0;
+    spare_cnt   = 0;
+    for( uint32_t i = 0; i < thr_cnt; i++ ) queues.push_back( new Queue );
+    for( uint32_t i = 0; i < thr_cnt; i++ ) std::thread( &ThreadPool::worker, this, i ).detach();
+}
+
+inline void val::ThreadPool::submit( std::function<void()> task, bool may_block )
+{
+    Queue * q = queues[(self >= 0) ? self : (next_queue++ % queues.size())];
+    {
+        std::lock_guard<std::mutex> lock( q->mtx );
+        q->tasks.push_back( Task{ std::move( task ), may_block } );
+    }
+    {
+        std::lock_guard<std::mutex> lock( idle_mtx );
+        pending++;
+    }
+    idle_cv.notify_one();
+}
+
+inline bool val::ThreadPool::run_one( bool helping )
+{
+    if ( pending == 0 ) return false;
+
+    // own deque first (newest task, still warm in cache), then steal oldest from the others;
+    // helpers pass over may_block tasks 
+    std::function<void()> task;
+    uint64_t n = queues.size();
+    uint64_t first = (self >= 0) ? self : (next_queue.load() % n);
+    for( uint64_t i = 0; i < n && !task; i++ )
+    {
+        Queue * q = queues[(first + i) % n];
+        std::lock_guard<std::mutex> lock( q->mtx );
+        uint64_t cnt = q->tasks.size();
+        bool newest = i == 0 && self >= 0;
+        for( uint64_t j = 0; j < cnt; j++ )
+        {
+            auto it = newest ? (q->tasks.end() - 1 - j) : (q->tasks.begin() + j);
+            if ( helping && it->may_block ) continue;
+            task = std::move( it->f );
+            q->tasks.erase( it );
+            break;
+        }
+    }
+    if ( !task ) return false;
+    pending--;
+    task();
+    return true;
+}
+
+inline void val::ThreadPool::parallel_for( uint64_t cnt, const std::function<void( uint64_t first, uint64_t last )>& f, uint64_t chunk_len )
+{
+    if ( chunk_len == 0 ) chunk_len = std::max( uint64_t( 1 ), cnt / (4 * uint64_t( worker_cnt() )) );
+    if ( cnt <= chunk_len ) {
+        if ( cnt != 0 ) f( 0, cnt );
+        return;
+    }
+
+    uint64_t chunk_cnt = (cnt + chunk_len - 1) / chunk_len;
+    std::atomic<uint64_t> remaining( chunk_cnt );
+    std::mutex mtx;
+    std::condition_variable cv;
+    for( uint64_t c = 1; c < chunk_cnt; c++ )
+    {
+        submit( [&, c]( void ) 
+        {
+            f( c*chunk_len, std::min( cnt, (c+1)*chunk_len ) );
+            std::lock_guard<std::mutex> lock( mtx );
+            if ( --remaining == 0 ) cv.notify_all();
+        } );
+    }
+    f( 0, chunk_len );
+    {
+        std::lock_guard<std::mutex> lock( mtx );
+        remaining--;
+    }
+
+    while( remaining != 0 )
+    {
+        if ( !run_one() ) {
+            std::unique_lock<std::mutex> lock( mtx );
+            cv.wait( lock, [&]( void ) { return remaining == 0; } );
+        }
+    }
+    std::lock_guard<std::mutex> lock( mtx );            // last chunk may still be unlocking mtx
+}
+
+inline void val::ThreadPool::block_begin( void )
+{
+    if ( !in_pool ) return;
+    uint64_t blocked = ++blocked_cnt;
+    if ( pending != 0 && blocked >= worker_cnt() + spare_cnt ) {
+        // spares steal until the queues are empty, then exit
+        spare_cnt++;
+        std::thread( [this]( void ) 
+        {
+            in_pool = true;
+            while( run_one( false ) ) {}
+            spare_cnt--;
+        } ).detach();
+    }
+}
+
+inline void val::ThreadPool::block_end( void )
+{
+    if ( in_pool ) blocked_cnt--;
+}
+
+inline void val::ThreadPool::worker( uint32_t index )
+{
+    self = index;
+    in_pool = true;
+    for( ;; )
+    {
+        if ( run_one( false ) ) continue;
+        std::unique_lock<std::mutex> lock( idle_mtx );
+        idle_cv.wait( lock, [this]( void ) { return pending != 0; } );
+    }
+}
+
+inline val val::channel( uint64_t capacity )
+{
+    csassert( capacity != 0, "channel() capacity must be at least 1" );
+    val ch;
+    ch.k = kind::CHANNEL;
+    ch.u.ch = new Channel( capacity );
+    return ch;
+}
+
+inline val::Channel::Channel( uint64_t capacity )
+{
+    uint64_t cap = 1;
+    while( cap < capacity ) cap <<= 1;
+    ref_cnt     = 1;
+    mask        = cap - 1;
+    cells       = new Cell[cap];
+    for( uint64_t i = 0; i < cap; i++ ) cells[i].seq = i;
+    closed      = false;
+    sleeper_cnt = 0;
+    enq         = 0;
+    deq         = 0;
+}
+
+inline uint64_t val::Channel::send_range( const val * xx, uint64_t cnt )
+{
+    uint64_t pos = enq.load( std::memory_order_relaxed );
+    uint64_t n;
+    do 
+    {
+        uint64_t room = mask + 1 - (pos - deq.load( std::memory_order_acquire ));
+        n = std::min( cnt, room );
+        if ( n == 0 ) return 0;
+    } while( !enq.compare_exchange_weak( pos, pos + n ) );
+
+    // a claimed cell is free as soon as its previous lap's receiver has finished copying out of it
+    for( uint64_t i = 0; i < n; i++ )
+    {
+        Cell& cell = cells[(pos + i) & mask];
+        for( uint32_t spin = 0; cell.seq.load( std::memory_order_acquire ) != pos + i; spin++ ) 
+        {
+            if ( spin >= 64 ) std::this_thread::yield();
+        }
+        cell.x = xx[i];
+        cell.seq.store( pos + i + 1, std::memory_order_release );
+    }
+    return n;
+}
+
+inline uint64_t val::Channel::recv_range( val * xx, uint64_t max_cnt )
+{
+    uint64_t pos = deq.load( std::memory_order_relaxed );
+    uint64_t n;
+    do 
+    {
+        uint64_t avail = enq.load( std::memory_order_acquire ) - pos;
+        if ( int64_t( avail ) <= 0 ) return 0;
+        n = std::min( max_cnt, avail );
+    } while( !deq.compare_exchange_weak( pos, pos + n ) );
+
+    for( uint64_t i = 0; i < n; i++ )
+    {
+        Cell& cell = cells[(pos + i) & mask];
+        for( uint32_t spin = 0; cell.seq.load( std::memory_order_acquire ) != pos + i + 1; spin++ ) 
+        {
+            if ( spin >= 64 ) std::this_thread::yield();
+        }
+        xx[i] = cell.x;
+        cell.x = val();
+        cell.seq.store( pos + i + mask + 1, std::memory_order_release );
+    }
+    return n;
+}
+
+inline void val::Channel::wake( void )
+{
+    // pairs with the increment in wait(): either the sleeper sees our update or we see the sleeper
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( sleeper_cnt.load() != 0 ) {
+        std::lock_guard<std::mutex> lock( mtx );
+        cv.notify_all();
+    }
+}
+
+template<typename Ready> 
+inline void val::Channel::wait( const Ready& ready )
+{
+    for( uint32_t spin = 0; spin < 128; spin++ )
+    {
+        if ( ready() ) return;
+        if ( spin >= 64 ) std::this_thread::yield();
+    }
+
+    ThreadPool& pool = ThreadPool::get();
+    pool.block_begin();
+    sleeper_cnt++;
+    {
+        std::unique_lock<std::mutex> lock( mtx );
+        while( !ready() ) cv.wait( lock );
+    }
+    sleeper_cnt--;
+    pool.block_end();
+}
+
+inline bool val::try_send( const val& x )
+{
+    csassert( k == kind::CHANNEL, "try_send() allowed only on CHANNEL" );
+    if ( u.ch->closed || u.ch->send_range( &x, 1 ) == 0 ) return false;
+    u.ch->wake();
+    return true;
+}
+
+inline bool val::send( const val& x )
+{
+    if ( k == kind::PROCESS ) return u.pr->send( x );
+    csassert( k == kind::CHANNEL, "send() allowed only on CHANNEL or PROCESS" );
+    Channel * ch = u.ch;
+    bool sent = false;
+    ch->wait( [&]( void ) { return ch->closed || (sent = ch->send_range( &x, 1 ) == 1); } );
+    if ( sent ) ch->wake();
+    return sent;
+}
+
+inline bool val::try_recv( val& x )
+{
+    csassert( k == kind::CHANNEL, "try_recv() allowed only on CHANNEL" );
+    if ( u.ch->recv_range( &x, 1 ) == 0 ) return false;
+    u.ch->wake();
+    return true;
+}
+
+inline bool val::recv( val& x )
+{
+    if ( k == kind::PROCESS ) return u.pr->recv( x );
+    csassert( k == kind::CHANNEL, "recv() allowed only on CHANNEL or PROCESS" );
+    Channel * ch = u.ch;
+    bool received = false;
+    ch->wait( [&]( void ) { return (received = ch->recv_range( &x, 1 ) == 1) || ch->closed; } );
+    if ( !received ) received = ch->recv_range( &x, 1 ) == 1;        // sends that completed just before close()
+    if ( received ) ch->wake();
+    return received;
+}
+
+inline uint64_t val::send_many( const val& list )
+{
+    csassert( k == kind::CHANNEL, "send_many() allowed only on CHANNEL" );
+    csassert( list.k == kind::LIST, "send_many() requires a LIST" );
+    Channel * ch = u.ch;
+    const val * xx = list.u.l->l.data();
+    uint64_t cnt = list.u.l->l.size();
+    uint64_t sent = 0;
+    while( sent < cnt )
+    {
+        uint64_t n = 0;
+        ch->wait( [&]( void ) { return ch->closed || (n = ch->send_range( xx + sent, cnt - sent )) != 0; } );
+        if ( n == 0 ) break;
+        sent += n;
+        ch->wake();
+    }
+    return sent;
+}
+
+inline val val::recv_many( uint64_t max_cnt )
+{
+    csassert( k == kind::CHANNEL, "recv_many() allowed only on CHANNEL" );
+    csassert( max_cnt != 0, "recv_many() max_cnt must be at least 1" );
+    Channel * ch = u.ch;
+    val l = list();
+    std::vector<val>& xx = l.u.l->l;
+    xx.resize( std::min( max_cnt, ch->mask + 1 ) );
+    uint64_t n = 0;
+    ch->wait( [&]( void ) { return (n = ch->recv_range( xx.data(), xx.size() )) != 0 || ch->closed; } );
+    if ( n == 0 ) n = ch->recv_range( xx.data(), xx.size() );
+    xx.resize( n );
+    if ( n != 0 ) ch->wake();
+    return l;
+}
+
+inline void val::close( void )
+{
+    if ( k == kind::PROCESS ) {
+        u.pr->close();
+        return;
+    }
+    if ( k == kind::FILE ) {
+        u.fi->close();
+        return;
+    }
+    csassert( k == kind::CHANNEL, "close() allowed only on CHANNEL, PROCESS or FILE" );
+    u.ch->closed = true;
+    u.ch->wake();
+}
+
+inline bool val::is_closed( void ) const
+{
+    csassert( k == kind::CHANNEL, "is_closed() allowed only on CHANNEL" );
+    return u.ch->closed;
+}
+
+inline val val::lookup( const val& key ) const
+{
+    csassert( k == kind::CMAP, "lookup() allowed only on CMAP" );
+    std::string key_s = key;
+    CMap::Shard& shard = u.cm->shard( key_s );
+    std::lock_guard<std::mutex> lock( shard.mtx );
+    auto it = shard.m.find( key_s );
+    return (it != shard.m.end()) ? it->second : val();
+}
+
+inline val val::upsert( const val& key, const val& x, val (*merge)( const val& old, const val& x ) )
+{
+    csassert( k == kind::CMAP, "upsert() allowed only on CMAP" );
+    std::string key_s = key;
+    CMap::Shard& shard = u.cm->shard( key_s );
+    for( ;; )
+    {
+        val old;
+        {
+            std::lock_guard<std::mutex> lock( shard.mtx );
+            auto it = shard.m.find( key_s );
+            if ( it == shard.m.end() ) {
+                shard.m.emplace( key_s, x );
+                return x;
+            } 
+            old = it->second;
+        }
+
+        // merge outside the lock, then store the result only if key still holds old; old keeps its 
+        // block alive, so an unchanged value is exactly the same bits
+        val merged = merge( old, x );
+        std::lock_guard<std::mutex> lock( shard.mtx );
+        auto it = shard.m.find( key_s );
+        if ( it != shard.m.end() && it->second.k == old.k && memcmp( &it->second.u, &old.u, sizeof( old.u ) ) == 0 ) {
+            it->second = merged;
+            return merged;
+        }
+    }
+}
+
+inline val val::snapshot( void ) const
+{
+    csassert( k == kind::CMAP, "snapshot() allowed only on CMAP" );
+    val m = map();
+    for( CMap::Shard& shard : u.cm->shards )
+    {
+        std::lock_guard<std::mutex> lock( shard.mtx );
+        m.u.m->m.insert( shard.m.begin(), shard.m.end() );
+    }
+    return m;
+}
+
+inline val& val::sort( void )
+{
+    csassert( k == kind::LIST, "can only sort a LIST" );
+    std::vector<SortKey> perm;
+    sort_perm( u.l->l, perm, false );
+    sort_apply( perm );
+    return *this;
+}
+
+inline val& val::sort_by( val (*key)( const val& x ) )
+{
+    csassert( k == kind::LIST, "can only sort_by a LIST" );
+    val keys = map( key );
+    std::vector<SortKey> perm;
+    sort_perm( keys.u.l->l, perm, false );
+    sort_apply( perm );
+    return *this;
+}
+
+inline val& val::psort( void )
+{
+    csassert( k == kind::LIST, "can only psort a LIST" );
+    std::vector<SortKey> perm;
+    sort_perm( u.l->l, perm, true );
+    sort_apply( perm );
+    return *this;
+}
+
+inline val& val::psort_by( val (*key)( const val& x ) )
+{
+    csassert( k == kind::LIST, "can only psort_by a LIST" );
+    val keys = pmap( key );
+    std::vector<SortKey> perm;
+    sort_perm( keys.u.l->l, perm, true );
+    sort_apply( perm );
+    return *this;
+}
+
+inline bool val::sort_less( const val& a, const val& b )
+{
+    auto rank = []( enum kind _k ) -> int
+    {
+        switch( _k )
+        {
+            case kind::UNDEF:           return 0;
+            case kind::BOOL:            return 1;
+            case kind::INT:             
+            case kind::FLT:             return 2;
+            case kind::STR:             return 3;
+            default:                    return 4 + int( _k );
+        }
+    };
+    int a_rank = rank( a.k );
+    int b_rank = rank( b.k );
+    if ( a_rank != b_rank ) return a_rank < b_rank;
+    switch( a.k )
+    {
+        case kind::BOOL:                return a.u.b < b.u.b;
+        case kind::INT:                 return (b.k == kind::INT) ? (a.u.i < b.u.i) : (double( a.u.i ) < b.u.f);
+        case kind::FLT:                 return (b.k == kind::FLT) ? (a.u.f < b.u.f) : (a.u.f < double( b.u.i ));
+        case kind::STR:                 return a.u.s->s < b.u.s->s;
+        case kind::CUSTOM:              return a < b;
+        default:                        return false;           // keep original order
+    }
+}
+
+inline val::sort_kind val::sort_keys( const std::vector<val>& keys, std::vector<SortKey>& perm )
+{
+    // homogeneous INT, FLT, or STR lists get integer keys whose unsigned order matches the val order
+    uint64_t n = keys.size();
+    perm.resize( n );
+    enum kind k0 = (n == 0) ? kind::UNDEF : keys[0].k;
+    bool same = true;
+    for( uint64_t i = 1; i < n && same; i++ ) same = keys[i].k == k0;
+    if ( !same || (k0 != kind::INT && k0 != kind::FLT && k0 != kind::STR) ) {
+        for( uint64_t i = 0; i < n; i++ ) perm[i] = SortKey{ 0, i };
+        return sort_kind::GENERIC;
+    }
+
+    for( uint64_t i = 0; i < n; i++ ) 
+    {
+        uint64_t key;
+        const val& x = keys[i];
+        if ( k0 == kind::INT ) {
+            key = uint64_t( x.u.i ) ^ (uint64_t( 1 ) << 63);
+        } else if ( k0 == kind::FLT ) {
+            key = f64_bits( x.u.f + 0.0 );                             // -0.0 + 0.0 is +0.0, so the two stay equal
+            key = (key >> 63) ? ~key : (key | (uint64_t( 1 ) << 63));
+        } else {
+            const std::string& str = x.u.s->s;
+            uint64_t len = std::min( str.length(), size_t( 8 ) );
+            key = 0;
+            for( uint64_t j = 0; j < 8; j++ ) key = (key << 8) | ((j < len) ? uint8_t( str[j] ) : 0);
+        }
+        perm[i] = SortKey{ key, i };
+    }
+    return (k0 == kind::INT) ? sort_kind::INT : (k0 == kind::FLT) ? sort_kind::FLT : sort_kind::STR;
+}
+
+inline void val::sort_radix( SortKey * a, SortKey * tmp, uint64_t n )
+{
+    // LSD radix sort on 8-bit digits, which is stable; digits that are the same for every key are skipped
+    SortKey * src = a;
+    SortKey * dst = tmp;
+    for( uint32_t shift = 0; shift < 64; shift += 8 )
+    {
+        uint64_t cnt[256] = { 0 };
+        for( uint64_t i = 0; i < n; i++ ) cnt[(src[i].key >> shift) & 0xff]++;
+        if ( cnt[(src[0].key >> shift) & 0xff] == n ) continue;
+
+        uint64_t pos = 0;
+        for( uint32_t d = 0; d < 256; d++ ) 
+        {
+            uint64_t c = cnt[d];
+            cnt[d] = pos;
+            pos += c;
+        }
+        for( uint64_t i = 0; i < n; i++ ) dst[cnt[(src[i].key >> shift) & 0xff]++] = src[i];
+        std::swap( src, dst );
+    }
+    if ( src != a ) std::copy( src, src+n, a );
+}
+
+inline void val::sort_chunk( sort_kind sk, const std::vector<val>& keys, SortKey * a, SortKey * tmp, uint64_t n )
+{
+    if ( n == 0 ) return;
+    if ( sk == sort_kind::GENERIC ) {
+        std::stable_sort( a, a+n, [&]( const SortKey& x, const SortKey& y ) { return sort_less( keys[x.idx], keys[y.idx] ); } );
+        return;
+    }
+
+    sort_radix( a, tmp, n );
+    if ( sk == sort_kind::STR ) {
+        // strings that share their first 8 bytes are still in original order, so finish them with full compares
+        for( uint64_t first = 0; first < n; )
+        {
+            uint64_t last = first + 1;
+            while( last < n && a[last].key == a[first].key ) last++;
+            if ( last - first > 1 ) {
+                std::stable_sort( a+first, a+last, [&]( const SortKey& x, const SortKey& y ) { return keys[x.idx].u.s->s < keys[y.idx].u.s->s; } );
+            }
+            first = last;
+        }
+    }
+}
+
+inline void val::sort_perm( const std::vector<val>& keys, std::vector<SortKey>& perm, bool parallel )
+{
+    sort_kind sk = sort_keys( keys, perm );
+    uint64_t n = perm.size();
+    std::vector<SortKey> tmp( n );
+    ThreadPool * pool = parallel ? &ThreadPool::get() : nullptr;
+    if ( pool == nullptr || n < PSORT_MIN || pool->worker_cnt() == 1 ) {
+        sort_chunk( sk, keys, perm.data(), tmp.data(), n );
+        return;
+    }
+
+    // sort one chunk per worker in parallel, then merge pairs of neighboring runs in parallel until one is left;
+    // merging the left run first on ties keeps the sort stable
+    uint64_t chunk_len = (n + pool->worker_cnt() - 1) / pool->worker_cnt();
+    pool->parallel_for( n, [&]( uint64_t first, uint64_t last )
+    {
+        sort_chunk( sk, keys, perm.data()+first, tmp.data()+first, last-first );
+    }, chunk_len );
+
+    auto less = [&]( const SortKey& x, const SortKey& y ) -> bool
+    {
+        switch( sk )
+        {
+            case sort_kind::GENERIC:    return sort_less( keys[x.idx], keys[y.idx] );
+            case sort_kind::STR:        return x.key < y.key || (x.key == y.key && keys[x.idx].u.s->s < keys[y.idx].u.s->s);
+            default:                    return x.key < y.key;
+        }
+    };
+
+    SortKey * src = perm.data();
+    SortKey * dst = tmp.data();
+    for( ; chunk_len < n; chunk_len *= 2 )
+    {
+        uint64_t pair_cnt = (n + 2*chunk_len - 1) / (2*chunk_len);
+        pool->parallel_for( pair_cnt, [&]( uint64_t first, uint64_t last )
+        {
+            for( uint64_t p = first; p < last; p++ )
+            {
+                uint64_t lo  = p * 2 * chunk_len;
+                uint64_t mid = std::min( n, lo + chunk_len );
+                uint64_t hi  = std::min( n, lo + 2*chunk_len );
+                std::merge( src+lo, src+mid, src+mid, src+hi, dst+lo, less );
+            }
+        }, 1 );
+        std::swap( src, dst );
+    }
+    if ( src != perm.data() ) std::copy( src, src+n, perm.data() );
+}
+
+inline void val::sort_apply( const std::vector<SortKey>& perm )
+{
+    std::vector<val>& l = u.l->l;
+    std::vector<val> sorted( l.size() );
+    for( uint64_t i = 0; i < perm.size(); i++ ) std::swap( sorted[i], l[perm[i].idx] );
+    std::swap( l, sorted );
+}
+
+inline std::vector<std::string> val::keys( void ) const
+{
+    csassert( k == kind::MAP, "can only get keys for a MAP" );
+    std::vector<std::string> list;
+    for( auto it : u.m->m )
+    {
+        list.push_back( it.first );
+    }
+    return list;
+}
+
+inline const char * val::data( void ) const
+{
+    csassert( k == kind::BLOB, "data() allowed only on BLOB" );
+    return u.bl->data;
+}
+
+inline char * val::data_rw( void )
+{
+    csassert( k == kind::BLOB, "data_rw() allowed only on BLOB" );
+    csassert( u.bl->ref_cnt == 1 && u.bl->owner == nullptr, "data_rw() BLOB is shared" );
+    csassert( u.bl->map_addr == nullptr, "data_rw() BLOB is mmap()'d read-only" );
+    return const_cast<char *>( u.bl->data );
+}
+
+inline val val::slice( uint64_t pos, uint64_t len ) const
+{
+    csassert( k == kind::BLOB, "slice() allowed only on BLOB" );
+    csassert( pos <= u.bl->len, "slice() pos is past the end of the BLOB" );
+    len = std::min( len, u.bl->len - pos );
+
+    // slices of slices refer to the BLOB that owns the bytes, so freeing never chains
+    Blob * owner = (u.bl->owner != nullptr) ? u.bl->owner : u.bl;
+    owner->ref_cnt++;
+    val v;
+    v.k = kind::BLOB;
+    v.u.bl = new Blob;
+    v.u.bl->ref_cnt  = 1;
+    v.u.bl->data     = u.bl->data + pos;
+    v.u.bl->len      = len;
+    v.u.bl->map_addr = nullptr;
+    v.u.bl->map_len  = 0;
+    v.u.bl->owner    = owner;
+    return v;
+}
+
+inline val val::map( val (*f)( const val& x ) ) const
+{
+    switch( k )
+    {
+        case kind::LIST:
+        {
+            val r = list();
+            r.u.l->l.reserve( u.l->l.size() );
+            for( const val& x : u.l->l ) r.u.l->l.push_back( f( x ) );
+            return r;
+        }
+
+        case kind::MAP:
+        {
+            val r = map();
+            r.u.m->m.reserve( u.m->m.size() );
+            for( const auto& it : u.m->m ) r.u.m->m.emplace( it.first, f( it.second ) );
+            return r;
+        }
+
+        default:
+            csdie( "map() allowed only on LIST or MAP" );
+            return val();
+    }
+}
+
+inline val val::filter( bool (*f)( const val& x ) ) const
+{
+    switch( k )
+    {
+        case kind::LIST:
+        {
+            val r = list();
+            for( const val& x : u.l->l ) 
+            {
+                if ( f( x ) ) r.u.l->l.push_back( x );
+            }
+            return r;
+        }
+
+        case kind::MAP:
+        {
+            val r = map();
+            for( const auto& it : u.m->m ) 
+            {
+                if ( f( it.second ) ) r.u.m->m.emplace( it.first, it.second );
+            }
+            return r;
+        }
+
+        default:
+            csdie( "filter() allowed only on LIST or MAP" );
+            return val();
+    }
+}
+
+inline val val::reduce( val (*f)( const val& acc, const val& x ), const val& init ) const
+{
+    val acc = init;
+    switch( k )
+    {
+        case kind::LIST:        for( const val& x : u.l->l )     acc = f( acc, x );             break;
+        case kind::MAP:         for( const auto& it : u.m->m )   acc = f( acc, it.second );     break;
+        default:                csdie( "reduce() allowed only on LIST or MAP" );                break;
+    }
+    return acc;
+}
+
+inline void val::for_each( void (*f)( const val& x ) ) const
+{
+    switch( k )
+    {
+        case kind::LIST:        for( const val& x : u.l->l )     f( x );                        break;
+        case kind::MAP:         for( const auto& it : u.m->m )   f( it.second );                break;
+        default:                csdie( "for_each() allowed only on LIST or MAP" );              break;
+    }
+}
+
+inline val val::pmap( val (*f)( const val& x ) ) const
+{
+    switch( k )
+    {
+        case kind::LIST:
+        {
+            const std::vector<val>& l = u.l->l;
+            val r = list();
+            std::vector<val>& rl = r.u.l->l;
+            rl.resize( l.size() );
+            ThreadPool::get().parallel_for( l.size(), [&]( uint64_t first, uint64_t last ) 
+            {
+                for( uint64_t i = first; i < last; i++ ) rl[i] = f( l[i] );
+            } );
+            return r;
+        }
+
+        case kind::MAP:
+        {
+            // unordered_map can't be split directly, so index its entries first
+            std::vector<const std::pair<const std::string,val> *> entries;
+            entries.reserve( u.m->m.size() );
+            for( const auto& it : u.m->m ) entries.push_back( &it );
+            std::vector<val> vals( entries.size() );
+            ThreadPool::get().parallel_for( entries.size(), [&]( uint64_t first, uint64_t last ) 
+            {
+                for( uint64_t i = first; i < last; i++ ) vals[i] = f( entries[i]->second );
+            } );
+
+            val r = map();
+            r.u.m->m.reserve( entries.size() );
+            for( uint64_t i = 0; i < entries.size(); i++ ) r.u.m->m.emplace( entries[i]->first, vals[i] );
+            return r;
+        }
+
+        default:
+            csdie( "pmap() allowed only on LIST or MAP" );
+            return val();
+    }
+}
+
+inline val val::pfilter( bool (*f)( const val& x ) ) const
+{
+    switch( k )
+    {
+        case kind::LIST:
+        {
+            const std::vector<val>& l = u.l->l;
+            std::vector<char> keep( l.size() );
+            ThreadPool::get().parallel_for( l.size(), [&]( uint64_t first, uint64_t last ) 
+            {
+                for( uint64_t i = first; i < last; i++ ) keep[i] = f( l[i] );
+            } );
+
+            val r = list();
+            for( uint64_t i = 0; i < l.size(); i++ ) 
+            {
+                if ( keep[i] ) r.u.l->l.push_back( l[i] );
+            }
+            return r;
+        }
+
+        case kind::MAP:
+        {
+            std::vector<const std::pair<const std::string,val> *> entries;
+            entries.reserve( u.m->m.size() );
+            for( const auto& it : u.m->m ) entries.push_back( &it );
+            std::vector<char> keep( entries.size() );
+            ThreadPool::get().parallel_for( entries.size(), [&]( uint64_t first, uint64_t last ) 
+            {
+                for( uint64_t i = first; i < last; i++ ) keep[i] = f( entries[i]->second );
+            } );
+
+            val r = map();
+            for( uint64_t i = 0; i < entries.size(); i++ ) 
+            {
+                if ( keep[i] ) r.u.m->m.emplace( entries[i]->first, entries[i]->second );
+            }
+            return r;
+        }
+
+        default:
+            csdie( "pfilter() allowed only on LIST or MAP" );
+            return val();
+    }
+}
+
+inline val val::preduce( val (*f)( const val& acc, const val& x ), const val& init ) const
+{
+    std::vector<const val *> xs;
+    switch( k )
+    {
+        case kind::LIST:        xs.reserve( u.l->l.size() ); for( const val& x : u.l->l )   xs.push_back( &x );          break;
+        case kind::MAP:         xs.reserve( u.m->m.size() ); for( const auto& it : u.m->m ) xs.push_back( &it.second );  break;
+        default:                csdie( "preduce() allowed only on LIST or MAP" );                                         break;
+    }
+
+    // reduce each chunk starting from its first element, then fold the chunk results into init in order
+    ThreadPool& pool = ThreadPool::get();
+    uint64_t chunk_len = std::max( uint64_t( 1 ), xs.size() / (4 * uint64_t( pool.worker_cnt() )) );
+    std::vector<val> partials( (xs.size() + chunk_len - 1) / chunk_len );
+    pool.parallel_for( xs.size(), [&]( uint64_t first, uint64_t last ) 
+    {
+        val acc = *xs[first];
+        for( uint64_t i = first+1; i < last; i++ ) acc = f( acc, *xs[i] );
+        partials[first / chunk_len] = acc;
+    }, chunk_len );
+
+    val acc = init;
+    for( const val& p : partials ) acc = f( acc, p );
+    return acc;
+}
+
+inline void val::pfor_each( void (*f)( const val& x ) ) const
+{
+    switch( k )
+    {
+        case kind::LIST:
+        {
+            const std::vector<val>& l = u.l->l;
+            ThreadPool::get().parallel_for( l.size(), [&]( uint64_t first, uint64_t last ) 
+            {
+                for( uint64_t i = first; i < last; i++ ) f( l[i] );
+            } );
+            break;
+        }
+
+        case kind::MAP:
+        {
+            std::vector<const val *> vals;
+            vals.reserve( u.m->m.size() );
+            for( const auto& it : u.m->m ) vals.push_back( &it.second );
+            ThreadPool::get().parallel_for( vals.size(), [&]( uint64_t first, uint64_t last ) 
+            {
+                for( uint64_t i = first; i < last; i++ ) f( *vals[i] );
+            } );
+            break;
+        }
+
+        default:
+            csdie( "pfor_each() allowed only on LIST or MAP" );
+            break;
+    }
+}
+
+inline char val::at( const val& i ) const
+{
+    csassert( k == kind::STR, "at() allowed only on STR" );    
+    return u.s->s.at( int64_t( i ) );
+}
+
+inline std::regex val::regex( const val& options ) const
+{
+    // validate options
+    std::string o_s = options;
+    std::regex::flag_type flags = std::regex::flag_type();
+    bool got_grammar = false;
+    for( size_t i = 0; i < o_s.length(); i++ )
+    {
+        char ch = o_s.at( i );
+        switch( ch )
+        {
+            case 'd':                                                                           break;  // engine choice, see below
+            case 'i': flags |= std::regex_constants::icase;                                    break;
+            case 'j': flags |= std::regex_constants::ECMAScript;       got_grammar = true;     break;
+            case 'p': flags |= std::regex_constants::basic;            got_grammar = true;     break;
+            case 'P': flags |= std::regex_constants::extended;         got_grammar = true;     break;
+            case 'a': flags |= std::regex_constants::awk;              got_grammar = true;     break;
+            case 'g': flags |= std::regex_constants::grep;             got_grammar = true;     break;
+            case 'G': flags |= std::regex_constants::egrep;            got_grammar = true;     break;
+            default: csdie( "unknown regex option character: " + std::to_string(ch) );           break;
+        }
+    }
+    if ( !got_grammar ) flags |= std::regex_constants::ECMAScript;
+
+    return std::regex( std::string(*this), flags );
+}
+
+inline val val::match( const std::regex& regex ) const
+{
+    // convert to strings 
+    std::string s   = *this;
+    std::smatch sm;
+    if ( !std::regex_match( s, sm, regex ) ) return val();  // return UNDEF
+
+    // return matches as a list
+    val matches = list();
+    for( size_t i = 0; i < sm.size(); i++ ) matches += sm[i];
+    return matches;
+}
 
 inline val val::replace( const std::regex& regex, const val& fmt ) const
 {
-    std::string s   = *this;
-    std::string f_s = fmt;
-    return std::regex_replace( s, regex, f_s );
+    std::string s   = *this;
+    std::string f_s = fmt;
+    return std::regex_replace( s, regex, f_s );
+}
+
+inline val val::replace_all( const std::regex& regex, const val& fmt, uint64_t max ) const
+{
+    // one left-to-right pass, so replacement text is never rescanned
+    std::string s_tmp;
+    const std::string& s = (k == kind::STR) ? u.s->s : (s_tmp = std::string( *this ));
+    std::string f_s = fmt;
+    std::string out;
+    out.reserve( s.size() + s.size() / 8 );
+    auto back_out = std::back_inserter( out );
+    const char * rest = s.data();
+    uint64_t cnt = 0;
+    for( std::cregex_iterator it( s.data(), s.data() + s.size(), regex ), end; it != end && cnt < max; ++it, cnt++ )
+    {
+        const std::cmatch& m = *it;
+        out.append( m.prefix().first, m.prefix().second );
+        m.format( back_out, f_s );
+        rest = m[0].second;
+    }
+    out.append( rest, s.data() + s.size() );
+    return out;
+}
+
+inline uint64_t val::size( void ) const
+{
+    switch( k ) 
+    {
+        case kind::STR:        
+        {
+            return u.s->s.length();
+        }
+
+        case kind::LIST:        
+        {
+            return u.l->l.size();
+        }
+
+        case kind::MAP:        
+        {
+            return u.m->m.size();
+        }
+
+        case kind::BLOB:        
+        {
+            return u.bl->len;
+        }
+
+        case kind::CMAP:        
+        {
+            uint64_t cnt = 0;
+            for( CMap::Shard& shard : u.cm->shards )
+            {
+                std::lock_guard<std::mutex> lock( shard.mtx );
+                cnt += shard.m.size();
+            }
+            return cnt;
+        }
+
+        case kind::CHANNEL:        
+        {
+            uint64_t deq = u.ch->deq.load();
+            uint64_t enq = u.ch->enq.load();
+            return (enq > deq) ? (enq - deq) : 0;
+        }
+
+        case kind::PROCESS:        
+        {
+            return u.pr->stages.size();
+        }
+
+        case kind::FILE:        
+        {
+            // bytes on disk for a regular file, else 0
+            struct stat file_stat;
+            int fd = (u.fi->rfd >= 0) ? u.fi->rfd : u.fi->wfd;
+            return (fd >= 0 && fstat( fd, &file_stat ) == 0 && S_ISREG( file_stat.st_mode )) ? uint64_t( file_stat.st_size ) : 0;
+        }
+
+        case kind::CUSTOM:      
+        {
+            return u.c->size();
+        }
+
+        default:
+        {
+            csdie( "can't call size() on a " + kind_to_str(k) + " val" );  
+            return false;
+        }
+    }
+}
+
+inline bool val::exists( const val& key ) const
+{
+    switch( k ) 
+    {
+        case kind::LIST:        
+        {
+            int64_t index = key;
+            return index >= 0 && index < int64_t(u.l->l.size());
+        }
+
+        case kind::MAP:        
+        {
+            auto it = u.m->m.find( std::string( key ) );
+            return it != u.m->m.end();
+        }
+
+        case kind::CMAP:        
+        {
+            std::string key_s = key;
+            CMap::Shard& shard = u.cm->shard( key_s );
+            std::lock_guard<std::mutex> lock( shard.mtx );
+            return shard.m.find( key_s ) != shard.m.end();
+        }
+
+        case kind::CUSTOM:      
+        {
+            return u.c->exists( key );
+        }
+
+        default:
+        {
+            csdie( "can't call exists() on a " + kind_to_str(k) + " val" );  
+            return false;
+        }
+    }
+}
+
+inline       ValProxy::operator val const&( void )              { return v.get( key );   }
+inline val&  ValProxy::operator = ( const val& other )          { v.set( key, other ); return v; }
+inline       ValProxyI::operator val const&( void )             { return v.get( key );   }
+inline val&  ValProxyI::operator = ( const val& other )         { v.set( key, other ); return v; }
+inline       ValProxyCS::operator val const&( void )            { return v.get( key );   }
+inline val&  ValProxyCS::operator = ( const val& other )        { v.set( key, other ); return v; }
+inline const val& val::operator [] ( const val& key ) const     { return get( key ); }
+
+inline const val& val::get( const val& key ) const
+{
+    switch( k ) 
+    {
+        case kind::LIST:        
+        {
+            int64_t index = key;
+            csassert( index >= 0 && index < int64_t(u.l->l.size()), "LIST index is out of range" );
+            return u.l->l[index];
+        }
+
+        case kind::MAP:        
+        {
+            auto it = u.m->m.find( std::string( key ) );
+            csassert( it != u.m->m.end(), "MAP key " + std::string(key) + " does not exist" );
+            return it->second;
+        }
+
+        case kind::CMAP:        
+        {
+            // another thread's set() could free the value while the caller reads through the reference
+            csdie( "can't call get() or [] on a CMAP val; use lookup(), which returns a copy" );
+            return undef;
+        }
+
+        case kind::CUSTOM:      
+        {
+            return u.c->get( key );
+        }
+
+        default:
+        {
+            csdie( "can't call get() on a " + kind_to_str(k) + " val" );  
+            return undef;
+        }
+    }
+}
+
+inline void val::set( const val& key, const val& v )
+{
+    switch( k ) 
+    {
+        case kind::LIST:        
+        {
+            u.l->l[int64_t(key)] = v;
+            break;
+        }
+
+        case kind::MAP:        
+        {
+            u.m->m[std::string(key)] = v;
+            break;
+        }
+
+        case kind::CMAP:        
+        {
+            std::string key_s = key;
+            CMap::Shard& shard = u.cm->shard( key_s );
+            std::lock_guard<std::mutex> lock( shard.mtx );
+            shard.m[key_s] = v;
+            break;
+        }
+
+        case kind::CUSTOM:      
+        {
+            u.c->set( key, v );
+            break;
+        }
+
+        default:
+        {
+            csdie( "can't call set() on a " + kind_to_str(k) + " val" );  
+            break;
+        }
+    }
+}
+
+inline val val::path_dir( void ) const
+{
+    csassert( k == kind::STR, "path_dir() must be called on a STR val" );
+    size_t pos = u.s->s.find_last_of( "/\\" );
+    return val( u.s->s.substr( 0, pos ) );
+}
+
+inline val val::path_no_dir( void ) const
+{
+    csassert( k == kind::STR, "path_no_dir() must be called on a STR val" );
+    size_t pos = u.s->s.find_last_of( "/\\" );
+    return val( u.s->s.substr( pos+1 ) );
+}
+
+inline val val::path_no_ext( void ) const
+{
+    csassert( k == kind::STR, "path_no_dir() must be called on a STR val" );
+    size_t pos = u.s->s.find_last_of( "/\\." );
+    char c = u.s->s.at( pos );
+    return (c == '.') ? val( u.s->s.substr( 0, pos-1 ) ) : *this;
+}
+
+inline int val::path_stat( struct stat& ss ) const
+{
+    csassert( k == kind::STR, "path_stat() must be called on a STR val" );
+    return stat( std::string( *this ).c_str(), &ss );
+}
+
+inline bool val::path_exists( void ) const
+{
+    struct stat ss;
+    return path_stat( ss ) == 0;
+}
+
+inline bool val::path_is_file( void ) const
+{
+    struct stat ss;
+    return path_stat( ss ) == 0 && S_ISREG( ss.st_mode );
+}
+
+inline bool val::path_is_link( void ) const
+{
+    // stat() follows the link, so only lstat() can see it
+    csassert( k == kind::STR, "path_is_link() must be called on a STR val" );
+    struct stat ss;
+    return lstat( std::string( *this ).c_str(), &ss ) == 0 && S_ISLNK( ss.st_mode );
+}
+
+inline bool val::path_is_fifo( void ) const
+{
+    struct stat ss;
+    return path_stat( ss ) == 0 && S_ISFIFO( ss.st_mode );
+}
+
+inline bool val::path_is_socket( void ) const
+{
+    struct stat ss;
+    return path_stat( ss ) == 0 && S_ISSOCK( ss.st_mode );
+}
+
+inline bool val::path_is_dir( void ) const
+{
+    struct stat ss;
+    return path_stat( ss ) == 0 && S_ISDIR( ss.st_mode );
+}
+
+inline time_t val::path_time_modified( void ) const
+{
+    struct stat ss;
+    int r = path_stat( ss );
+    csassert( r == 0, "can't ss " + std::string( *this ) );
+    return ss.st_mtime;
+}
+
+inline time_t val::path_time_accessed( void ) const
+{
+    struct stat ss;
+    int r = path_stat( ss );
+    csassert( r == 0, "can't ss " + std::string( *this ) );
+    return ss.st_atime;
+}
+
+inline val val::path_info( const val& options ) const
+{
+    csassert( k == kind::STR, "path_info() must be called on a STR val" );
+    std::string o_s = options;
+    bool follow = false;
+    for( char ch : o_s )
+    {
+        switch( ch )
+        {
+            case 'f': follow = true;                                                            break;
+            default:  csdie( "unknown path_info option character: " + std::string( 1, ch ) );  break;
+        }
+    }
+    std::string path = *this;
+
+    val info = map();
+#ifdef STATX_BASIC_STATS
+    struct statx sx;
+    if ( statx( AT_FDCWD, path.c_str(), follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS|STATX_BTIME, &sx ) != 0 ) return val();
+    mode_t  mode = sx.stx_mode;
+    info.set( "size",          uint64_t( sx.stx_size ) );
+    info.set( "uid",           uint64_t( sx.stx_uid ) );
+    info.set( "gid",           uint64_t( sx.stx_gid ) );
+    info.set( "nlink",         uint64_t( sx.stx_nlink ) );
+    info.set( "inode",         uint64_t( sx.stx_ino ) );
+    info.set( "time_modified", int64_t( sx.stx_mtime.tv_sec ) );
+    info.set( "time_accessed", int64_t( sx.stx_atime.tv_sec ) );
+    info.set( "time_changed",  int64_t( sx.stx_ctime.tv_sec ) );
+    if ( (sx.stx_mask & STATX_BTIME) != 0 ) info.set( "time_created", int64_t( sx.stx_btime.tv_sec ) );
+#else
+    struct stat ss;
+    if ( (follow ? stat( path.c_str(), &ss ) : lstat( path.c_str(), &ss )) != 0 ) return val();
+    mode_t  mode = ss.st_mode;
+    info.set( "size",          uint64_t( ss.st_size ) );
+    info.set( "uid",           uint64_t( ss.st_uid ) );
+    info.set( "gid",           uint64_t( ss.st_gid ) );
+    info.set( "nlink",         uint64_t( ss.st_nlink ) );
+    info.set( "inode",         uint64_t( ss.st_ino ) );
+    info.set( "time_modified", int64_t( ss.st_mtime ) );
+    info.set( "time_accessed", int64_t( ss.st_atime ) );
+    info.set( "time_changed",  int64_t( ss.st_ctime ) );
+#ifdef __APPLE__
+    info.set( "time_created",  int64_t( ss.st_birthtimespec.tv_sec ) );
+#endif
+#endif
+    const char * type = S_ISREG( mode )  ? "file"   : S_ISDIR( mode )  ? "dir"    : S_ISLNK( mode ) ? "link" :
+                        S_ISFIFO( mode ) ? "fifo"   : S_ISSOCK( mode ) ? "socket" : S_ISCHR( mode ) ? "char" : "block";
+    info.set( "type", type );
+    info.set( "mode", uint64_t( mode & 07777 ) );
+    return info;
+}
+
+inline val val::walk( const val& root, uint64_t thr_cnt, const val& options )
+{
+    bool want_files = true;
+    bool want_dirs  = true;
+    bool want_other = true;                             // links, pipes, sockets and devices
+    bool sorted     = false;
+    std::string o_s = options;
+    for( char ch : o_s )
+    {
+        switch( ch )
+        {
+            case 'f': want_dirs  = false;                                                       break;
+            case 'r': want_dirs  = false; want_other = false;                                   break;
+            case 'd': want_files = false; want_other = false;                                   break;
+            case 's': sorted     = true;                                                        break;
+            default:  csdie( "unknown walk option character: " + std::string( 1, ch ) );        break;
+        }
+    }
+    csassert( root.path_is_dir(), "walk() root " + std::string( root ) + " is not a directory" );
+    if ( thr_cnt == 0 ) thr_cnt = std::max( 1U, std::thread::hardware_concurrency() );
+
+    // each directory is listed in large getdents64() batches, and its subdirectories are opened with openat() 
+    // relative to it, so the kernel doesn't look up the whole path again; a thread keeps descending on its own 
+    // unless another thread is idle, in which case it hands the subdirectory over by full path; each level 
+    // holds its fd, so past WALK_FD_DEPTH levels, or when openat() runs out of fds, subdirectories are also 
+    // handed over by path, to be opened once this thread has backed out and closed its fds
+    struct Walk
+    {
+        bool                        want_files;
+        bool                        want_dirs;
+        bool                        want_other;
+        std::mutex                  mtx;
+        std::condition_variable     cv;
+        std::vector<std::string>    todo;               // handed-over directories
+        uint64_t                    busy_cnt = 0;       // threads reading a handed-over directory
+        std::atomic<uint64_t>       idle_cnt;
+        std::vector<val>            found;
+
+        void worker( void )
+        {
+            std::vector<val> out;
+            std::vector<char> buff( 64*1024 );
+            std::unique_lock<std::mutex> lock( mtx );
+            for( ;; )
+            {
+                if ( todo.empty() ) {
+                    if ( busy_cnt == 0 ) break;
+                    idle_cnt++;
+                    cv.wait( lock );
+                    idle_cnt--;
+                    continue;
+                }
+                std::string dir = std::move( todo.back() );
+                todo.pop_back();
+                busy_cnt++;
+                lock.unlock();
+                int fd = open( dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC );
+                bool gone = errno == EACCES || errno == ENOENT || errno == ENOTDIR || errno == ELOOP;   // unreadable, or removed since it was listed
+                csassert( fd >= 0 || gone, "walk() could not open directory " + dir + " - open() error: " + strerror( errno ) );
+                if ( fd >= 0 ) read_dir( fd, dir, 0, out, buff );
+                lock.lock();
+                if ( --busy_cnt == 0 && todo.empty() ) cv.notify_all();
+            }
+            found.insert( found.end(), std::make_move_iterator( out.begin() ), std::make_move_iterator( out.end() ) );
+        }
+
+        // lists all of fd before descending, so one buff serves every level; closes fd
+        void read_dir( int fd, const std::string& dir, uint32_t depth, std::vector<val>& out, std::vector<char>& buff )
+        {
+            std::string prefix = (dir.back() == '/') ? dir : (dir + "/");
+            std::vector<std::string> subdirs;
+            auto add = [&]( const char * name, unsigned char type )
+            {
+                if ( name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) ) return;
+                if ( type == DT_UNKNOWN ) {
+                    // some file systems don't fill in d_type
+                    struct stat ss;
+                    if ( fstatat( fd, name, &ss, AT_SYMLINK_NOFOLLOW ) == 0 ) type = S_ISDIR( ss.st_mode ) ? DT_DIR : S_ISREG( ss.st_mode ) ? DT_REG : DT_LNK;
+                }
+                bool is_dir = type == DT_DIR;
+                if ( is_dir ? want_dirs : (type == DT_REG) ? want_files : want_other ) out.push_back( prefix + name );
+                if ( is_dir ) subdirs.push_back( name );
+            };
+#if defined( __linux__ ) && defined( SYS_getdents64 )
+            for( ;; )
+            {
+                long n = syscall( SYS_getdents64, fd, buff.data(), buff.size() );
+                if ( n <= 0 ) break;
+                for( long off = 0; off < n; )
+                {
+                    const struct dirent64 * d = static_cast<const struct dirent64 *>( static_cast<const void *>( buff.data() + off ) );
+                    add( d->d_name, d->d_type );
+                    off += d->d_reclen;
+                }
+            }
+#else
+            DIR * dp = fdopendir( dup( fd ) );
+            if ( dp != nullptr ) {
+                while( const struct dirent * d = readdir( dp ) ) add( d->d_name, d->d_type );
+                closedir( dp );
+            }
+#endif
+            for( const std::string& name : subdirs )
+            {
+                int sub_fd = -1;
+                if ( idle_cnt.load( std::memory_order_relaxed ) == 0 && depth+1 < WALK_FD_DEPTH ) {
+                    sub_fd = openat( fd, name.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC );
+                    if ( sub_fd < 0 && errno != EMFILE && errno != ENFILE ) continue;   // unreadable
+                }
+                if ( sub_fd < 0 ) {
+                    std::lock_guard<std::mutex> lock( mtx );
+                    todo.push_back( prefix + name );
+                    cv.notify_one();
+                    continue;
+                }
+                read_dir( sub_fd, prefix + name, depth+1, out, buff );
+            }
+            ::close( fd );
+        }
+    };
+
+    Walk w;
+    w.want_files = want_files;
+    w.want_dirs  = want_dirs;
+    w.want_other = want_other;
+    w.idle_cnt   = 0;
+    w.todo.push_back( root );
+    val thrs = list();
+    for( uint64_t i = 1; i < thr_cnt; i++ ) thrs.push( Thread::start( [&w]( void ) { w.worker(); return val(); } ) );
+    w.worker();
+    thrs.join();
+
+    val paths = list();
+    paths.u.l->l = std::move( w.found );
+    if ( sorted ) paths.sort();
+    return paths;
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// FILE I/O
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+val val::json_read( std::string file_name )
+{
+    //------------------------------------------------------------
+    // Map in .json file
+    //------------------------------------------------------------
+    line_num = 1;
+    can_skip_comments = false; // no comments in .json files
+
+    val blob = file_map( file_name );                   // unmapped when blob goes away
+    const char * json     = blob.data();
+    const char * json_end = json + blob.size();
+
+    //------------------------------------------------------------
+    // Parse a map.
+    //------------------------------------------------------------
+    val map;
+    csassert( parse_json_map( map, json, json_end ), "unable to parse top-level map: " + surrounding_lines( json, json_end ) );
+    return map;
+}
+
+val val::json_decode( void * buffer, size_t buffer_len )
+{
+    val map;
+    const char * json = reinterpret_cast<const char *>( buffer );
+    const char * json_end = json + buffer_len;
+    csassert( parse_json_map( map, json, json_end ), "unable to parse top-level map: " + surrounding_lines( json, json_end ) );
+    return map;
+}
+
+void val::json_write( std::string file_name )
+{
+    int fd = open( file_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666 );
+    csassert( fd >= 0, "could not open file " + file_name + " for writing - open() error: " + strerror( errno ) );
+    {
+        Writer w( fd );
+        json_encode_expr( w );
+        w.put( '\n' );
+    }
+    ::close( fd );
+}
+
+void val::json_encode_expr( Writer& w ) const
+{
+    switch( k )
+    {
+        case kind::UNDEF:       w.put( "null", 4 );                                     break;
+        case kind::BOOL:        if ( u.b ) w.put( "true", 4 ); else w.put( "false", 5 ); break;
+        case kind::INT:         { std::string i_s = std::to_string( u.i ); w.put( i_s.data(), i_s.length() ); break; }
+        case kind::FLT:         json_put_real64( w, u.f );                              break;
+        case kind::STR:         json_put_string( w, u.s->s.data(), u.s->s.length() );   break;
+
+        case kind::LIST:
+            w.put( '[' );
+            for( auto it = u.l->l.begin(); it != u.l->l.end(); it++ )
+            {
+                if ( it != u.l->l.begin() ) w.put( ',' );
+                it->json_encode_expr( w );
+            }
+            w.put( ']' );
+            break;
+
+        case kind::MAP:
+            w.put( '{' );
+            for( auto it = u.m->m.begin(); it != u.m->m.end(); it++ )
+            {
+                if ( it != u.m->m.begin() ) w.put( ',' );
+                json_put_string( w, it->first.data(), it->first.length() );
+                w.put( ':' );
+                it->second.json_encode_expr( w );
+            }
+            w.put( '}' );
+            break;
+
+        default:
+            csdie( "json_write() does not support " + kind_to_str( k ) + " vals" );
+            break;
+    }
+    w.maybe_flush();
+}
+
+void val::json_put_string( Writer& w, const char * s, size_t len )
+{
+    static const char hex[] = "0123456789abcdef";
+    w.put( '"' );
+    for( size_t i = 0; i < len; i++ )
+    {
+        char ch = s[i];
+        switch( ch )
+        {
+            case '"':   w.put( "\\\"", 2 ); break;
+            case '\\':  w.put( "\\\\", 2 ); break;
+            case '\b':  w.put( "\\b", 2 ); break;
+            case '\f':  w.put( "\\f", 2 ); break;
+            case '\n':  w.put( "\\n", 2 ); break;
+            case '\r':  w.put( "\\r", 2 ); break;
+            case '\t':  w.put( "\\t", 2 ); break;
+            default:
+                if ( uint8_t( ch ) < 0x20 ) {
+                    w.put( "\\u00", 4 );
+                    w.put( hex[uint8_t( ch ) >> 4] );
+                    w.put( hex[ch & 0xf] );
+                } else {
+                    w.put( ch );
+                }
+                break;
+        }
+    }
+    w.put( '"' );
+}
+
+void val::json_put_real64( Writer& w, double f )
+{
+    if ( !std::isfinite( f ) ) {
+        w.put( "null", 4 );                             // JSON has no NaN or infinity
+        return;
+    }
+    char buff[32];
+    int len = snprintf( buff, sizeof( buff ), "%.17g", f );
+    w.put( buff, len );
+    if ( strpbrk( buff, ".eEn" ) == nullptr ) w.put( ".0", 2 );     // keep it a real when read back in
+}
+
+val val::file_map( const val& name, const val& options )
+{
+    std::string file_path = name;
+    std::string o_s = options;
+    bool is_random = false;
+    for( size_t i = 0; i < o_s.length(); i++ )
+    {
+        char ch = o_s.at( i );
+        switch( ch )
+        {
+            case 'r': is_random = true;                                                         break;
+            default:  csdie( "unknown file_map option character: " + std::string( 1, ch ) );    break;
+        }
+    }
+
+    int fd = open( file_path.c_str(), O_RDONLY );
+    csassert( fd >= 0, "could not open file " + file_path + " - open() error: " + strerror( errno ) );
+
+    struct stat file_stat;
+    if ( fstat( fd, &file_stat ) < 0 ) {
+        ::close( fd );
+        csdie( "could not stat file " + file_path + " - stat() error: " + strerror( errno ) );
+    }
+
+    val v;
+    v.k = kind::BLOB;
+    v.u.bl = new Blob;
+    v.u.bl->ref_cnt  = 1;
+    v.u.bl->data     = nullptr;
+    v.u.bl->len      = 0;
+    v.u.bl->map_addr = nullptr;
+    v.u.bl->map_len  = 0;
+    v.u.bl->owner    = nullptr;
+
+    if ( !S_ISREG( file_stat.st_mode ) || size_t( file_stat.st_size ) < FILE_MAP_MIN ) {
+        // pipes, devices, and small files: mmap() setup and page faults cost more than a few large read()s
+        char * buff;
+        uint64_t len;
+        bool ok = file_read_fd( fd, buff, len, S_ISREG( file_stat.st_mode ) ? uint64_t( file_stat.st_size ) : 0 );
+        ::close( fd );
+        csassert( ok, "could not read file " + file_path + " - read() error: " + strerror( errno ) );
+        v.u.bl->data = buff;
+        v.u.bl->len  = len;
+        return v;
+    }
+
+    // let mmap() choose an addr and make the region read-only;
+    // the mapping keeps the file referenced, so we don't need the fd anymore
+    size_t size = file_stat.st_size;
+    void * addr = mmap( 0, size, PROT_READ, MAP_FILE|MAP_SHARED, fd, 0 );
+    ::close( fd );
+    csassert( addr != MAP_FAILED, "file_map() mmap() call failed for " + file_path + ": " + strerror( errno ) );
+
+    // access-pattern hints are only advisory, so errors are ignored
+    if ( is_random ) {
+        madvise( addr, size, MADV_RANDOM );
+    } else {
+        madvise( addr, size, MADV_SEQUENTIAL );
+        madvise( addr, size, MADV_WILLNEED );
+    }
+#ifdef MADV_HUGEPAGE
+    if ( size >= (size_t(2) << 20) ) madvise( addr, size, MADV_HUGEPAGE );
+#endif
+
+    v.u.bl->data     = reinterpret_cast<const char *>( addr );
+    v.u.bl->len      = size;
+    v.u.bl->map_addr = addr;
+    v.u.bl->map_len  = size;
+    return v;
+}
+
+inline val val::file( const val& name, const val& options )
+{
+    std::string file_path = name;
+    std::string o_s = options;
+    bool is_read   = false;
+    bool is_write  = false;
+    bool is_create = false;
+    bool is_pipe   = false;
+    for( size_t i = 0; i < o_s.length(); i++ )
+    {
+        char ch = o_s.at( i );
+        switch( ch )
+        {
+            case 'r': is_read   = true;                                                     break;
+            case 'w': is_write  = true;                                                     break;
+            case 'c': is_create = true;                                                     break;
+            case 'p': is_pipe   = true;                                                     break;
+            default:  csdie( "unknown file option character: " + std::string( 1, ch ) );    break;
+        }
+    }
+    if ( is_create ) is_write = true;
+    if ( !is_write ) is_read  = true;
+
+    if ( is_pipe && is_create && mkfifo( file_path.c_str(), 0666 ) < 0 ) {
+        csassert( errno == EEXIST, "could not create pipe " + file_path + " - mkfifo() error: " + strerror( errno ) );
+    }
+    int flags = O_CLOEXEC | ((is_read && is_write) ? O_RDWR : is_write ? O_WRONLY : O_RDONLY);
+    if ( is_create && !is_pipe ) flags |= O_CREAT | O_TRUNC;
+    int fd;
+    do
+    {
+        fd = open( file_path.c_str(), flags, 0666 );
+    } while( fd < 0 && errno == EINTR );
+    csassert( fd >= 0, "could not open file " + file_path + " - open() error: " + strerror( errno ) );
+    return file_fd( is_read ? fd : -1, is_write ? fd : -1, file_path );
+}
+
+inline val val::file( const val& options )
+{
+    std::string o_s = options;
+    for( char ch : o_s ) csassert( ch == 'p', "unknown file option character: " + std::string( 1, ch ) );
+    if ( !o_s.empty() ) {
+        int fds[2];
+        cmd_pipe( fds );
+        return file_fd( fds[0], fds[1], "pipe" );
+    }
+
+    // unlinked right away, so it goes away with the FILE
+    const char * tmp_dir = getenv( "TMPDIR" );
+    std::string file_path = std::string( (tmp_dir != nullptr && *tmp_dir != '\0') ? tmp_dir : "/tmp" ) + "/cs.XXXXXX";
+    int fd = mkstemp( &file_path[0] );
+    csassert( fd >= 0, "could not create temporary file " + file_path + " - mkstemp() error: " + strerror( errno ) );
+    unlink( file_path.c_str() );
+    fcntl( fd, F_SETFD, FD_CLOEXEC );
+    return file_fd( fd, fd, file_path );
+}
+
+inline val val::file_fd( int rfd, int wfd, const std::string& name )
+{
+    val f;
+    f.k = kind::FILE;
+    f.u.fi = new File;
+    f.u.fi->ref_cnt = 1;
+    f.u.fi->name    = name;
+    f.u.fi->rfd     = rfd;
+    f.u.fi->wfd     = wfd;
+
+    // hints are only advisory, so errors are ignored
+    struct stat file_stat;
+    if ( rfd >= 0 && fstat( rfd, &file_stat ) == 0 && S_ISREG( file_stat.st_mode ) ) {
+        f.u.fi->is_reg = true;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise( rfd, 0, 0, POSIX_FADV_SEQUENTIAL );     // larger readahead window
+#elif defined( F_RDAHEAD )
+        fcntl( rfd, F_RDAHEAD, 1 );
+#endif
+    }
+    return f;
+}
+
+inline char * val::file_buf( size_t size )
+{
+    void * buf;
+    csassert( posix_memalign( &buf, FILE_BUF_ALIGN, size ) == 0, "file_buf() out of memory" );
+    return reinterpret_cast<char *>( buf );
+}
+
+inline val::File::~File( void )
+{
+    flush();
+    if ( wfd >= 0 && wfd != rfd ) ::close( wfd );
+    if ( rfd >= 0 ) ::close( rfd );
+    ::free( rbuf );
+    ::free( wbuf );
+}
+
+inline bool val::File::fill( void )
+{
+    if ( reof || rfd < 0 ) {
+        reof = true;
+        return false;
+    }
+    if ( wlen != 0 && wfd == rfd ) flush();
+
+    // keep the unread bytes, normally the start of a line, at the front; grow only when they fill the whole buffer
+    if ( rbuf == nullptr ) {
+        rbuf_size = FILE_BUF_SIZE;
+        rbuf = file_buf( rbuf_size );
+    } else if ( rpos != 0 ) {
+        memmove( rbuf, rbuf + rpos, rend - rpos );
+        rend -= rpos;
+        rpos  = 0;
+    } else if ( rend == rbuf_size ) {
+        char * bigger = file_buf( 2*rbuf_size );
+        memcpy( bigger, rbuf, rend );
+        ::free( rbuf );
+        rbuf = bigger;
+        rbuf_size *= 2;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = ::read( rfd, rbuf + rend, rbuf_size - rend );
+    } while( n < 0 && errno == EINTR );
+    csassert( n >= 0, "could not read file " + name + " - read() error: " + strerror( errno ) );
+    if ( n == 0 ) {
+        reof = true;
+        return false;
+    }
+    rend += size_t( n );
+    roff += uint64_t( n );
+#ifdef POSIX_FADV_WILLNEED
+    // start the disk on the next buffer's worth while this one is used
+    if ( is_reg ) posix_fadvise( rfd, off_t( roff ), off_t( rbuf_size ), POSIX_FADV_WILLNEED );
+#endif
+    return true;
+}
+
+inline bool val::File::read_line( std::string_view& line )
+{
+    size_t scanned = rpos;                              // no '\n' in [rpos, scanned)
+    for( ;; )
+    {
+        const char * nl = (rend > scanned) ? reinterpret_cast<const char *>( memchr( rbuf + scanned, '\n', rend - scanned ) ) : nullptr;
+        if ( nl != nullptr ) {
+            line = std::string_view( rbuf + rpos, size_t( nl - (rbuf + rpos) ) );
+            rpos = size_t( nl - rbuf ) + 1;
+            return true;
+        }
+        size_t kept = rend - rpos;
+        if ( !fill() ) {
+            // last line may lack its '\n'
+            if ( rpos == rend ) return false;
+            line = std::string_view( rbuf + rpos, rend - rpos );
+            rpos = rend;
+            return true;
+        }
+        scanned = rpos + kept;
+    }
+}
+
+inline val val::File::read( uint64_t max_len )
+{
+    std::string s;
+    while( s.size() < max_len )
+    {
+        if ( rpos == rend && !fill() ) break;
+        size_t n = size_t( std::min( uint64_t( rend - rpos ), max_len - s.size() ) );
+        s.append( rbuf + rpos, n );
+        rpos += n;
+    }
+    return s;
+}
+
+inline val val::File::read_blob( uint64_t max_len )
+{
+    char *   buff = nullptr;
+    uint64_t len  = 0;
+    uint64_t cap  = 0;
+    auto reserve = [&]( uint64_t need ) 
+    {
+        if ( need <= cap ) return;
+        cap = std::max( need, 2*cap );
+        buff = reinterpret_cast<char *>( realloc( buff, cap ) );
+        csassert( buff != nullptr, "read_blob() out of memory" );
+    };
+    bool sized = false;
+    if ( is_reg && max_len == uint64_t(-1) ) {
+        // size the BLOB for the rest of the file up front
+        struct stat st;
+        sized = fstat( rfd, &st ) == 0 && uint64_t( st.st_size ) > roff;
+        if ( sized ) reserve( uint64_t( st.st_size ) - roff + (rend - rpos) );
+    }
+
+    while( len < max_len )
+    {
+        if ( rpos != rend ) {
+            size_t n = size_t( std::min( uint64_t( rend - rpos ), max_len - len ) );
+            reserve( len + n );
+            memcpy( buff + len, rbuf + rpos, n );
+            rpos += n;
+            len  += n;
+            continue;
+        }
+        if ( reof || rfd < 0 ) break;
+        uint64_t room = std::min( max_len, cap ) - len;
+        if ( room < FILE_BUF_SIZE && (sized || max_len - len < FILE_BUF_SIZE) ) {
+            // small reads, and the check for EOF past a sized BLOB, go through the buffer
+            if ( !fill() ) break;
+            continue;
+        }
+
+        // large reads skip the buffer
+        if ( wlen != 0 && wfd == rfd ) flush();
+        if ( room < FILE_BUF_SIZE ) reserve( len + std::min( max_len - len, uint64_t( FILE_BUF_SIZE ) ) );
+        ssize_t n;
+        do
+        {
+            n = ::read( rfd, buff + len, size_t( std::min( max_len - len, cap - len ) ) );
+        } while( n < 0 && errno == EINTR );
+        csassert( n >= 0, "could not read file " + name + " - read() error: " + strerror( errno ) );
+        if ( n == 0 ) {
+            reof = true;
+            break;
+        }
+        len  += uint64_t( n );
+        roff += uint64_t( n );
+    }
+    return file_result( (buff != nullptr) ? buff : reinterpret_cast<char *>( malloc( 1 ) ), len, 'b' );
+}
+
+inline bool val::File::write( const char * data, size_t len )
+{
+    csassert( wfd >= 0, "file " + name + " is not open for writing" );
+    if ( rfd == wfd ) drop_input();
+    if ( wlen + len > FILE_BUF_SIZE ) {
+        if ( !flush() ) return false;
+        if ( len >= FILE_BUF_SIZE ) {
+            // large writes skip the buffer
+            bool ok = fd_write( wfd, data, len, false );
+            csassert( ok || errno == EPIPE, "could not write file " + name + " - write() error: " + strerror( errno ) );
+            return ok;
+        }
+    }
+    if ( wbuf == nullptr ) wbuf = file_buf( FILE_BUF_SIZE );
+    memcpy( wbuf + wlen, data, len );
+    wlen += len;
+    return true;
+}
+
+inline bool val::File::flush( void )
+{
+    if ( wlen == 0 ) return true;
+    bool ok = fd_write( wfd, wbuf, wlen, false );
+    csassert( ok || errno == EPIPE, "could not write file " + name + " - write() error: " + strerror( errno ) );
+    wlen = 0;
+    return ok;
+}
+
+inline void val::File::drop_input( void )
+{
+    // rfd's offset is past the bytes buffered but not yet read, so move it back to where the reader is
+    if ( !is_reg ) return;
+    if ( rpos != rend ) {
+        lseek( rfd, -off_t( rend - rpos ), SEEK_CUR );
+        roff -= rend - rpos;
+    }
+    rpos = 0;
+    rend = 0;
+    reof = false;
+}
+
+inline void val::File::seek( uint64_t pos )
+{
+    flush();
+    int fd = (rfd >= 0) ? rfd : wfd;
+    csassert( fd >= 0 && lseek( fd, off_t( pos ), SEEK_SET ) >= 0, "could not seek in file " + name + " - lseek() error: " + strerror( errno ) );
+    rpos = 0;
+    rend = 0;
+    reof = false;
+    roff = pos;
+}
+
+inline void val::File::close( void )
+{
+    // a read-only FILE gives up its fd; otherwise only writing ends
+    flush();
+    if ( wfd >= 0 ) {
+        if ( wfd != rfd ) ::close( wfd );
+        wfd = -1;
+    } else if ( rfd >= 0 ) {
+        ::close( rfd );
+        rfd  = -1;
+        reof = true;
+    }
+}
+
+inline val val::read_blob( uint64_t max_len )
+{
+    csassert( k == kind::FILE, "read_blob() allowed only on FILE" );
+    return u.fi->read_blob( max_len );
+}
+
+inline val val::read( uint64_t max_len )
+{
+    csassert( k == kind::FILE, "read() allowed only on FILE" );
+    return u.fi->read( max_len );
+}
+
+inline bool val::read_line( std::string_view& line )
+{
+    csassert( k == kind::FILE, "read_line() allowed only on FILE" );
+    return u.fi->read_line( line );
+}
+
+inline val::line_range val::lines( void )
+{
+    csassert( k == kind::FILE, "lines() allowed only on FILE" );
+    return line_range( *this );
+}
+
+inline bool val::write( const val& x )
+{
+    csassert( k == kind::FILE, "write() allowed only on FILE" );
+    if ( x.k == kind::BLOB ) return u.fi->write( x.u.bl->data, x.u.bl->len );
+    if ( x.k == kind::STR )  return u.fi->write( x.u.s->s.data(), x.u.s->s.size() );
+    std::string s = x;
+    return u.fi->write( s.data(), s.size() );
+}
+
+inline bool val::flush( void )
+{
+    csassert( k == kind::FILE, "flush() allowed only on FILE" );
+    return u.fi->flush();
+}
+
+inline void val::seek( uint64_t pos )
+{
+    csassert( k == kind::FILE, "seek() allowed only on FILE" );
+    u.fi->seek( pos );
+}
+
+inline val val::file_result( char * buff, uint64_t len, char as )
+{
+    if ( as == 'j' ) {
+        val m = json_decode( buff, len );
+        ::free( buff );
+        return m;
+    }
+    if ( as == 's' ) {
+        val s = std::string( buff, len );
+        ::free( buff );
+        return s;
+    }
+    val v;
+    v.k = kind::BLOB;
+    v.u.bl = new Blob;
+    v.u.bl->ref_cnt  = 1;
+    v.u.bl->data     = buff;
+    v.u.bl->len      = len;
+    v.u.bl->map_addr = nullptr;
+    v.u.bl->map_len  = 0;
+    v.u.bl->owner    = nullptr;
+    return v;
+}
+
+#ifdef CS_IO_URING
+//---------------------------------------------------------------------
+// Bare io_uring: submission and completion rings shared with the kernel, 
+// set up with raw system calls so there's no library to link
+//---------------------------------------------------------------------
+struct val::Uring
+{
+    int                         fd       = -1;
+    void *                      sq_ptr   = MAP_FAILED;
+    size_t                      sq_len   = 0;
+    void *                      cq_ptr   = MAP_FAILED;
+    size_t                      cq_len   = 0;
+    io_uring_sqe *              sqes     = nullptr;
+    size_t                      sqes_len = 0;
+    unsigned *                  sq_head;
+    unsigned *                  sq_tail;
+    unsigned *                  sq_array;
+    unsigned                    sq_mask;
+    unsigned                    sq_entries;
+    unsigned                    sq_next  = 0;           // our tail, published by enter()
+    unsigned                    to_submit = 0;
+    unsigned *                  cq_head;
+    unsigned *                  cq_tail;
+    unsigned                    cq_mask;
+    io_uring_cqe *              cqes;
+
+    ~Uring( void );
+    bool           open( unsigned entries, const std::vector<uint8_t>& ops ); // false if the kernel lacks io_uring or any of ops
+    io_uring_sqe * sqe( void );                         // next submission entry, zeroed
+    void           enter( unsigned min_complete );      // submits queued entries and waits for min_complete completions
+    bool           cqe( io_uring_cqe& c );              // pops next completion; false if none
+
+    template<typename T> static T * at( void * base, uint32_t off )  { return static_cast<T *>( static_cast<void *>( static_cast<char *>( base ) + off ) ); }
+};
+
+inline val::Uring::~Uring( void )
+{
+    if ( sqes != nullptr ) munmap( sqes, sqes_len );
+    if ( cq_ptr != MAP_FAILED && cq_ptr != sq_ptr ) munmap( cq_ptr, cq_len );
+    if ( sq_ptr != MAP_FAILED ) munmap( sq_ptr, sq_len );
+    if ( fd >= 0 ) ::close( fd );
+}
+
+inline bool val::Uring::open( unsigned entries, const std::vector<uint8_t>& ops )
+{
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    fd = int( syscall( __NR_io_uring_setup, entries, &p ) );
+    if ( fd < 0 ) return false;                         // before Linux 5.1, or blocked by seccomp
+
+    // probing needs Linux 5.6, which is also when openat and read arrived
+    std::vector<char> probe_buff( sizeof( io_uring_probe ) + 256 * sizeof( io_uring_probe_op ), 0 );
+    io_uring_probe * probe = at<io_uring_probe>( probe_buff.data(), 0 );
+    if ( syscall( __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256 ) < 0 ) return false;
+    for( uint8_t op : ops )
+    {
+        if ( op >= probe->ops_len || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0 ) return false;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    cq_len = p.cq_off.cqes  + p.cq_entries * sizeof( io_uring_cqe );
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if ( single ) sq_len = cq_len = std::max( sq_len, cq_len );
+    sq_ptr = mmap( 0, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if ( sq_ptr == MAP_FAILED ) return false;
+    cq_ptr = single ? sq_ptr : mmap( 0, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    if ( cq_ptr == MAP_FAILED ) return false;
+    sqes_len = p.sq_entries * sizeof( io_uring_sqe );
+    void * sqes_ptr = mmap( 0, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES );
+    if ( sqes_ptr == MAP_FAILED ) return false;
+    sqes = static_cast<io_uring_sqe *>( sqes_ptr );
+
+    sq_head    = at<unsigned>( sq_ptr, p.sq_off.head );
+    sq_tail    = at<unsigned>( sq_ptr, p.sq_off.tail );
+    sq_array   = at<unsigned>( sq_ptr, p.sq_off.array );
+    sq_mask    = *at<unsigned>( sq_ptr, p.sq_off.ring_mask );
+    sq_entries = p.sq_entries;
+    sq_next    = *sq_tail;
+    cq_head    = at<unsigned>( cq_ptr, p.cq_off.head );
+    cq_tail    = at<unsigned>( cq_ptr, p.cq_off.tail );
+    cq_mask    = *at<unsigned>( cq_ptr, p.cq_off.ring_mask );
+    cqes       = at<io_uring_cqe>( cq_ptr, p.cq_off.cqes );
+    return true;
+}
+
+inline io_uring_sqe * val::Uring::sqe( void )
+{
+    csassert( sq_next - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) < sq_entries, "io_uring submission queue is full" );
+    unsigned i = sq_next & sq_mask;
+    sq_array[i] = i;
+    sq_next++;
+    to_submit++;
+    memset( &sqes[i], 0, sizeof( sqes[i] ) );
+    return &sqes[i];
+}
+
+inline void val::Uring::enter( unsigned min_complete )
+{
+    // entries the kernel couldn't take yet (EAGAIN or EBUSY) go out on the next call, once completions are reaped
+    __atomic_store_n( sq_tail, sq_next, __ATOMIC_RELEASE );
+    for( ;; )
+    {
+        long n = syscall( __NR_io_uring_enter, fd, to_submit, min_complete, (min_complete != 0) ? IORING_ENTER_GETEVENTS : 0, nullptr, 0 );
+        if ( n >= 0 ) {
+            to_submit -= unsigned( n );
+            return;
+        }
+        if ( errno == EAGAIN || errno == EBUSY ) return;
+        csassert( errno == EINTR, std::string( "io_uring_enter() error: " ) + strerror( errno ) );
+    }
+}
+
+inline bool val::Uring::cqe( io_uring_cqe& c )
+{
+    unsigned head = *cq_head;
+    if ( head == __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE ) ) return false;
+    c = cqes[head & cq_mask];
+    __atomic_store_n( cq_head, head + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+inline bool val::read_files_uring( const val& paths, char as, std::vector<val>& results )
+{
+    Uring ring;
+    if ( !ring.open( URING_FILES_MAX, { IORING_OP_OPENAT, IORING_OP_READ } ) ) return false;
+
+    // opens are where cold lookups wait on the disk, so they all go out at once; once a file is open, 
+    // its inode is in memory and a plain fstat() is cheaper than a statx on the ring, which the kernel 
+    // always hands to a worker thread; the low bit of user_data says whether an open or a read completed
+    struct Job
+    {
+        std::string             path;
+        int                     fd      = -1;
+        uint64_t                size    = 0;            // 0 if unknown, as for pipes and /proc files
+        char *                  buff    = nullptr;
+        uint64_t                cap     = 0;
+        uint64_t                len     = 0;
+    };
+    enum : uint64_t { OPEN, READ };
+    uint64_t cnt = paths.size();
+    std::vector<Job> jobs( cnt );                       // never resized, so paths stay put for the kernel
+
+    auto read_more = [&]( uint64_t i )
+    {
+        Job& j = jobs[i];
+        if ( j.len == j.cap ) {
+            // size wasn't known
+            j.cap *= 2;
+            j.buff = reinterpret_cast<char *>( realloc( j.buff, j.cap ) );
+            csassert( j.buff != nullptr, "read_files() out of memory" );
+        }
+        io_uring_sqe * e = ring.sqe();
+        e->opcode    = IORING_OP_READ;
+        e->fd        = j.fd;
+        e->addr      = reinterpret_cast<uint64_t>( j.buff + j.len );
+        e->len       = unsigned( std::min( j.cap - j.len, uint64_t( 1 ) << 30 ) );
+        e->off       = j.len;
+        e->user_data = 2*i + READ;
+    };
+
+    uint64_t next = 0;
+    uint64_t active = 0;
+    while( next < cnt || active != 0 )
+    {
+        for( ; next < cnt && active < URING_FILES_MAX; next++, active++ )
+        {
+            Job& j = jobs[next];
+            j.path = std::string( paths.get( next ) );
+            io_uring_sqe * e = ring.sqe();
+            e->opcode     = IORING_OP_OPENAT;
+            e->fd         = AT_FDCWD;
+            e->addr       = reinterpret_cast<uint64_t>( j.path.c_str() );
+            e->open_flags = O_RDONLY|O_CLOEXEC;
+            e->user_data  = 2*next + OPEN;
+        }
+        ring.enter( 1 );
+
+        io_uring_cqe c;
+        while( ring.cqe( c ) )
+        {
+            uint64_t i = c.user_data / 2;
+            uint64_t op = c.user_data % 2;
+            Job& j = jobs[i];
+            if ( c.res < 0 && op == READ && (c.res == -EINTR || c.res == -EAGAIN) ) {
+                read_more( i );
+                continue;
+            }
+            csassert( c.res >= 0, "could not read file " + j.path + " - " + ((op == OPEN) ? "open" : "read") + "() error: " + strerror( -c.res ) );
+            if ( op == OPEN ) {
+                j.fd = c.res;
+                struct stat file_stat;
+                csassert( fstat( j.fd, &file_stat ) == 0, "could not stat file " + j.path + " - fstat() error: " + strerror( errno ) );
+                j.size   = S_ISREG( file_stat.st_mode ) ? uint64_t( file_stat.st_size ) : 0;
+                j.cap    = (j.size != 0) ? j.size : FILE_MAP_MIN;
+                j.buff   = reinterpret_cast<char *>( malloc( j.cap ) );
+                csassert( j.buff != nullptr, "read_files() out of memory" );
+                read_more( i );
+                continue;
+            }
+            j.len += uint64_t( c.res );
+            if ( c.res != 0 && (j.size == 0 || j.len < j.size) ) {
+                read_more( i );
+                continue;
+            }
+            ::close( j.fd );
+            results[i] = file_result( j.buff, j.len, as );
+            active--;
+        }
+    }
+    return true;
+}
+#endif
+
+inline val val::read_files( const val& paths, const val& options )
+{
+    std::string o_s = options;
+    char as = 'b';
+    for( char ch : o_s )
+    {
+        switch( ch )
+        {
+            case 's':
+            case 'j': as = ch;                                                                  break;
+            default:  csdie( "unknown read_files option character: " + std::string( 1, ch ) );  break;
+        }
+    }
+    val results = list();
+    std::vector<val>& rl = results.u.l->l;
+    rl.resize( paths.size() );
+#ifdef CS_IO_URING
+    if ( read_files_uring( paths, as, rl ) ) return results;
+#endif
+
+    // blocking reads spread over the pool in small chunks; decoding stays on this thread, 
+    // because the JSON parser's line counting isn't thread-safe
+    std::vector<std::pair<char *, uint64_t>> buffs( rl.size() );
+    ThreadPool::get().parallel_for( rl.size(), [&]( uint64_t first, uint64_t last )
+    {
+        for( uint64_t i = first; i < last; i++ )
+        {
+            std::string path = paths.get( i );
+            int fd = open( path.c_str(), O_RDONLY|O_CLOEXEC );
+            csassert( fd >= 0, "could not read file " + path + " - open() error: " + strerror( errno ) );
+            struct stat file_stat;
+            uint64_t size = (fstat( fd, &file_stat ) == 0 && S_ISREG( file_stat.st_mode )) ? uint64_t( file_stat.st_size ) : 0;
+            bool ok = file_read_fd( fd, buffs[i].first, buffs[i].second, size );
+            ::close( fd );
+            csassert( ok, "could not read file " + path + " - read() error: " + strerror( errno ) );
+        }
+    }, 4 );
+    for( size_t i = 0; i < rl.size(); i++ ) rl[i] = file_result( buffs[i].first, buffs[i].second, as );
+    return results;
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// PROCESSES
+//
+// Commands are split into words the way sh would and started directly with posix_spawnp(),
+// unless they use pipes, redirection, variables, globs or other things only sh does, in 
+// which case they're run with "/bin/sh -c".  Captured output is read from non-blocking 
+// pipes with poll(), so a child never stalls on a full stderr pipe while we wait on stdout.
+// On Linux the same poll() also waits for child exits through pidfds; elsewhere exited
+// children are found with waitpid( WNOHANG ) on a short poll() timeout.
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+inline bool val::cmd_words( const std::string& cmd, std::vector<std::string>& words )
+{
+    static const char * builtins[] = { "cd", "exit", "export", "source", ".", "alias", "unalias", "set", "unset", "eval", "exec",
+                                       "ulimit", "umask", "wait", "read", "trap", "shift", "return", "type", "hash", "command" };
+    words.clear();
+    std::string w;
+    bool in_word = false;
+    for( size_t i = 0; i < cmd.size(); i++ )
+    {
+        char ch = cmd[i];
+        switch( ch )
+        {
+            case ' ':
+            case '\t':
+                if ( in_word ) words.push_back( w );
+                w.clear();
+                in_word = false;
+                break;
+
+            case '\\':
+                if ( i+1 == cmd.size() || cmd[i+1] == '\n' ) return false;
+                w += cmd[++i];
+                in_word = true;
+                break;
+
+            case '\'':
+            {
+                size_t e = cmd.find( '\'', i+1 );
+                if ( e == std::string::npos ) return false;
+                w.append( cmd, i+1, e-i-1 );
+                i = e;
+                in_word = true;
+                break;
+            }
+
+            case '"':
+                for( i++; i < cmd.size() && cmd[i] != '"'; i++ )
+                {
+                    if ( cmd[i] == '$' || cmd[i] == '`' ) return false;
+                    if ( cmd[i] == '\\' && i+1 < cmd.size() && strchr( "\"\\$`", cmd[i+1] ) != nullptr ) i++;
+                    w += cmd[i];
+                }
+                if ( i == cmd.size() ) return false;
+                in_word = true;
+                break;
+
+            case '~':
+            case '#':
+                if ( !in_word ) return false;                   // home directory or comment
+                w += ch;
+                break;
+
+            case '=':
+                if ( words.empty() ) return false;              // VAR=value prefix
+                w += ch;
+                in_word = true;
+                break;
+
+            default:
+                if ( ch == '\0' || strchr( "|&;<>()$`*?[]{}!\n", ch ) != nullptr ) return false;
+                w += ch;
+                in_word = true;
+                break;
+        }
+    }
+    if ( in_word ) words.push_back( w );
+    if ( words.empty() ) return false;
+    for( const char * b : builtins ) if ( words[0] == b ) return false;
+    return true;
+}
+
+inline void val::cmd_pipe( int fds[2] )
+{
+#ifdef __linux__
+    csassert( pipe2( fds, O_CLOEXEC ) == 0, std::string( "pipe2() error: " ) + strerror( errno ) );
+#else
+    csassert( pipe( fds ) == 0, std::string( "pipe() error: " ) + strerror( errno ) );
+    fcntl( fds[0], F_SETFD, FD_CLOEXEC );
+    fcntl( fds[1], F_SETFD, FD_CLOEXEC );
+#endif
+}
+
+inline void val::proc_start( Proc& p, const std::string& cmd, char capture, int in_fd, int out_fd )
+{
+    std::vector<std::string> words;
+    if ( !cmd_words( cmd, words ) ) words = { "/bin/sh", "-c", cmd };
+    std::vector<char *> argv;
+    for( std::string& w : words ) argv.push_back( const_cast<char *>( w.c_str() ) );
+    argv.push_back( nullptr );
+
+    // pipes are close-on-exec, so the child keeps only the dup2()'d ends
+    int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+    uint32_t pipe_cnt = (capture == ',') ? 2 : (capture == '+') ? 1 : 0;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    for( uint32_t i = 0; i < pipe_cnt; i++ )
+    {
+        cmd_pipe( pipes[i] );
+        posix_spawn_file_actions_adddup2( &actions, pipes[i][1], 1+i );
+    }
+    if ( capture == '+' ) posix_spawn_file_actions_adddup2( &actions, pipes[0][1], 2 );
+    if ( in_fd >= 0 )     posix_spawn_file_actions_adddup2( &actions, in_fd, 0 );
+    if ( out_fd >= 0 )    posix_spawn_file_actions_adddup2( &actions, out_fd, 1 );
+    int err = posix_spawnp( &p.pid, argv[0], &actions, nullptr, argv.data(), environ );
+    posix_spawn_file_actions_destroy( &actions );
+
+    for( uint32_t i = 0; i < pipe_cnt; i++ )
+    {
+        ::close( pipes[i][1] );
+        p.fds[i] = pipes[i][0];
+        fcntl( p.fds[i], F_SETFL, fcntl( p.fds[i], F_GETFL ) | O_NONBLOCK );
+    }
+    if ( err != 0 ) {
+        // same as sh: a message on stderr and exit status 127
+        std::string msg = words[0] + ": " + strerror( err ) + "\n";
+        if ( capture == ' ' ) {
+            std::cerr << msg;
+        } else {
+            p.outs[(capture == ',') ? 1 : 0] += msg;
+        }
+        for( uint32_t i = 0; i < pipe_cnt; i++ )
+        {
+            ::close( p.fds[i] );
+            p.fds[i] = -1;
+        }
+        p.pid = -1;
+        p.status = 127 << 8;
+        return;
+    }
+#ifdef SYS_pidfd_open
+    p.pidfd = int( syscall( SYS_pidfd_open, p.pid, 0 ) );     // close-on-exec; fails before Linux 5.3
+#endif
+}
+
+inline void val::proc_drain( Proc * procs[], size_t cnt )
+{
+    // f is 0 or 1 for a pipe, 2 for a pidfd
+    std::vector<struct pollfd> pfds;
+    std::vector<std::pair<Proc *, uint32_t>> owners;
+    bool must_check = false;                            // some child without a pidfd may have exited
+    for( size_t i = 0; i < cnt; i++ )
+    {
+        Proc& p = *procs[i];
+        for( uint32_t f = 0; f < 2; f++ )
+        {
+            if ( p.fds[f] < 0 ) continue;
+            pfds.push_back( { p.fds[f], POLLIN, 0 } );
+            owners.push_back( { &p, f } );
+        }
+        if ( p.pidfd >= 0 ) {
+            pfds.push_back( { p.pidfd, POLLIN, 0 } );
+            owners.push_back( { &p, 2 } );
+        } else if ( p.pid >= 0 && p.fds[0] < 0 && p.fds[1] < 0 ) {
+            must_check = true;
+        }
+    }
+    if ( pfds.empty() && !must_check ) return;
+    if ( poll( pfds.data(), nfds_t( pfds.size() ), must_check ? 10 : -1 ) < 0 ) {
+        csassert( errno == EINTR, std::string( "poll() error: " ) + strerror( errno ) );
+        return;
+    }
+
+    for( size_t i = 0; i < pfds.size(); i++ )
+    {
+        if ( pfds[i].revents == 0 ) continue;
+        Proc& p = *owners[i].first;
+        uint32_t f = owners[i].second;
+        if ( f == 2 ) {
+            if ( waitpid( p.pid, &p.status, WNOHANG ) == p.pid ) {
+                ::close( p.pidfd );
+                p.pidfd = -1;
+                p.pid = -1;
+            }
+            continue;
+        }
+
+        // read straight into the output string until the pipe is empty
+        std::string& out = p.outs[f];
+        for( ;; )
+        {
+            size_t len = out.size();
+            out.resize( len + PROC_READ_SIZE );
+            ssize_t n = ::read( p.fds[f], &out[len], PROC_READ_SIZE );
+            out.resize( len + ((n > 0) ? size_t( n ) : 0) );
+            if ( n > 0 ) continue;
+            if ( n < 0 && errno == EINTR ) continue;
+            if ( n < 0 && errno == EAGAIN ) break;
+            ::close( p.fds[f] );                        // EOF or error
+            p.fds[f] = -1;
+            break;
+        }
+    }
+
+    if ( must_check ) {
+        for( size_t i = 0; i < cnt; i++ )
+        {
+            Proc& p = *procs[i];
+            if ( p.pid >= 0 && p.pidfd < 0 && p.fds[0] < 0 && p.fds[1] < 0 && waitpid( p.pid, &p.status, WNOHANG ) == p.pid ) p.pid = -1;
+        }
+    }
+}
+
+inline void val::proc_finish( Proc& p )
+{
+    Proc * procs[] = { &p };
+    while( p.fds[0] >= 0 || p.fds[1] >= 0 ) proc_drain( procs, 1 );
+    if ( p.pidfd >= 0 ) {
+        ::close( p.pidfd );
+        p.pidfd = -1;
+    }
+    if ( p.pid < 0 ) return;
+    while( waitpid( p.pid, &p.status, 0 ) < 0 )
+    {
+        csassert( errno == EINTR, std::string( "waitpid() error: " ) + strerror( errno ) );
+    }
+    p.pid = -1;
+}
+
+inline bool val::proc_done( const Proc& p )
+{
+    return p.pid < 0 && p.fds[0] < 0 && p.fds[1] < 0;
+}
+
+inline val val::lines_list( const std::string& s )
+{
+    val lines = list();
+    for( size_t pos = 0; pos < s.size(); )
+    {
+        size_t e = s.find( '\n', pos );
+        if ( e == std::string::npos ) e = s.size();
+        lines.push( s.substr( pos, e - pos ) );
+        pos = e + 1;
+    }
+    return lines;
+}
+
+inline char val::run_capture( const std::string& o_s )
+{
+    if ( o_s == "o+e" || o_s == "o,e" || o_s == "i,o,e" ) csdie( "run_all() can't use run() options " + o_s + ", which return FILEs" );
+    if ( o_s == "" ) return ' ';
+    if ( o_s == "so+se" || o_s == "lo+le" ) return '+';
+    if ( o_s == "so,se" || o_s == "lo,le" ) return ',';
+    csdie( "unknown run() options: " + o_s );
+    return ' ';
+}
+
+inline val val::run_result( const Proc& p, const std::string& o_s )
+{
+    if ( o_s == "" ) return p.status;
+    bool together = o_s[2] == '+';
+    if ( o_s[0] == 's' ) return together ? val( p.outs[0] ) : val{ p.outs[0], p.outs[1] };
+    return together ? lines_list( p.outs[0] ) : val{ lines_list( p.outs[0] ), lines_list( p.outs[1] ) };
+}
+
+inline val val::run_files( const std::string& cmd, const std::string& o_s )
+{
+    // the child is reaped when the last of its FILEs goes away
+    bool has_in = o_s == "i,o,e";
+    int in_fds[2] = { -1, -1 };
+    if ( has_in ) cmd_pipe( in_fds );
+    std::shared_ptr<Proc> p( new Proc, []( Proc * p ) { proc_finish( *p ); delete p; } );
+    bool together = o_s == "o+e";
+    proc_start( *p, cmd, together ? '+' : ',', in_fds[0] );
+    val files = list();
+    if ( has_in ) {
+        ::close( in_fds[0] );
+        files.push( file_fd( -1, in_fds[1], "stdin of " + cmd ) );
+        files.get( 0 ).u.fi->child = p;
+    }
+    for( uint32_t f = 0; f < (together ? 1U : 2U); f++ )
+    {
+        // our reads block, unlike proc_drain()'s
+        int fd = p->fds[f];
+        p->fds[f] = -1;
+        if ( fd >= 0 ) fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) & ~O_NONBLOCK );
+        val fl = file_fd( fd, -1, std::string( together ? "stdout+stderr" : (f == 0) ? "stdout" : "stderr" ) + " of " + cmd );
+        File * fi = fl.u.fi;
+        fi->child = p;
+        if ( !p->outs[f].empty() ) {
+            // the command couldn't be started, so there is only proc_start()'s message
+            fi->rbuf_size = std::max( size_t( FILE_BUF_SIZE ), p->outs[f].size() );
+            fi->rbuf = file_buf( fi->rbuf_size );
+            memcpy( fi->rbuf, p->outs[f].data(), p->outs[f].size() );
+            fi->rend = p->outs[f].size();
+            fi->reof = true;
+        }
+        files.push( fl );
+    }
+    return (files.size() == 1) ? files.get( 0 ) : files;
+}
+
+inline val val::run( val options ) const
+{
+    std::string o_s = options;
+    if ( o_s == "o+e" || o_s == "o,e" || o_s == "i,o,e" ) return run_files( *this, o_s );
+    Proc p;
+    proc_start( p, *this, run_capture( o_s ) );
+    proc_finish( p );
+    return run_result( p, o_s );
+}
+
+inline val val::run_all( const val& cmds, uint64_t max_jobs, const val& options )
+{
+    // like make -j: keep max_jobs children going, starting the next command as each one finishes
+    std::string o_s = options;
+    char capture = run_capture( o_s );
+    uint64_t cnt = cmds.size();
+    if ( max_jobs == 0 ) max_jobs = std::max( 1U, std::thread::hardware_concurrency() );
+    std::vector<Proc> procs( cnt );
+    std::vector<Proc *> active;
+    uint64_t next = 0;
+    while( next < cnt || !active.empty() )
+    {
+        while( next < cnt && active.size() < max_jobs )
+        {
+            proc_start( procs[next], cmds.get( next ), capture );
+            active.push_back( &procs[next++] );
+        }
+        proc_drain( active.data(), active.size() );
+        active.erase( std::remove_if( active.begin(), active.end(), []( const Proc * p ) { return proc_done( *p ); } ), active.end() );
+    }
+
+    val results = list();
+    for( const Proc& p : procs ) results.push( run_result( p, o_s ) );
+    return results;
+}
+
+inline val val::pipeline( const val& cmds, const val& options )
+{
+    bool has_in  = false;
+    bool has_out = false;
+    std::string o_s = options;
+    for( char ch : o_s )
+    {
+        switch( ch )
+        {
+            case 'i': has_in  = true;                                                           break;
+            case 'o': has_out = true;                                                           break;
+            default:  csdie( "unknown pipeline option character: " + std::string( 1, ch ) );    break;
+        }
+    }
+    uint64_t cnt = cmds.size();
+    csassert( cnt != 0, "pipeline() needs at least one command" );
+
+    val p;
+    p.k = kind::PROCESS;
+    p.u.pr = new Process;
+    p.u.pr->ref_cnt = 1;
+    p.u.pr->stages.resize( cnt );
+
+    // each child gets its ends with dup2(); ours are closed as soon as it has them, so EOF flows down the pipeline
+    int fds[2];
+    int prev_read = -1;
+    if ( has_in ) {
+        cmd_pipe( fds );
+        prev_read = fds[0];
+        p.u.pr->in_fd = fds[1];
+    }
+    for( uint64_t i = 0; i < cnt; i++ )
+    {
+        int write_fd = -1;
+        int next_read = -1;
+        if ( i+1 < cnt || has_out ) {
+            cmd_pipe( fds );
+            next_read = fds[0];
+            write_fd  = fds[1];
+        }
+        proc_start( p.u.pr->stages[i], cmds.get( i ), ' ', prev_read, write_fd );
+        if ( prev_read >= 0 ) ::close( prev_read );
+        if ( write_fd >= 0 )  ::close( write_fd );
+        prev_read = next_read;
+    }
+    p.u.pr->out_fd = prev_read;
+    return p;
+}
+
+inline val val::Process::join( void )
+{
+    // unread output is dropped, so the last stage may get SIGPIPE
+    std::lock_guard<std::mutex> lock( mtx );
+    if ( statuses.defined() ) return statuses;
+    close();
+    if ( out_fd >= 0 ) {
+        ::close( out_fd );
+        out_fd = -1;
+    }
+    statuses = list();
+    for( Proc& stage : stages )
+    {
+        proc_finish( stage );
+        statuses.push( stage.status );
+    }
+    return statuses;
+}
+
+inline bool val::fd_write( int fd, const char * data, size_t len, bool can_splice )
+{
+    // SIGPIPE is blocked while writing, so a reader that has exited gives EPIPE rather than killing us
+    sigset_t pipe_set;
+    sigset_t old_set;
+    sigemptyset( &pipe_set );
+    sigaddset( &pipe_set, SIGPIPE );
+    pthread_sigmask( SIG_BLOCK, &pipe_set, &old_set );
+    bool ok = true;
+    while( len != 0 )
+    {
+        ssize_t n;
+#ifdef __linux__
+        if ( can_splice ) {
+            // the pipe takes references to the file's pages, which stay valid even after the BLOB is unmapped
+            struct iovec iov = { const_cast<char *>( data ), len };
+            n = vmsplice( fd, &iov, 1, 0 );
+        } else
+#endif
+        {
+            (void)can_splice;
+            n = ::write( fd, data, len );
+        }
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) {
+            ok = false;
+            break;
+        }
+        data += n;
+        len  -= size_t( n );
+    }
+    if ( !ok && errno == EPIPE ) {
+        sigset_t pending;
+        int sig;
+        if ( sigpending( &pending ) == 0 && sigismember( &pending, SIGPIPE ) ) sigwait( &pipe_set, &sig );
+    }
+    pthread_sigmask( SIG_SETMASK, &old_set, nullptr );
+    return ok;
+}
+
+inline bool val::Process::send( const val& x )
+{
+    if ( in_fd < 0 ) return false;
+    if ( x.k == kind::BLOB ) return fd_write( in_fd, x.u.bl->data, x.u.bl->len, x.u.bl->is_mapped() );
+    std::string s = x;
+    return fd_write( in_fd, s.data(), s.size(), false );
+}
+
+inline bool val::Process::recv( val& x )
+{
+    if ( out_fd < 0 ) return false;
+    std::string s( PROC_READ_SIZE, '\0' );
+    ssize_t n;
+    do
+    {
+        n = ::read( out_fd, &s[0], s.size() );
+    } while( n < 0 && errno == EINTR );
+    if ( n <= 0 ) return false;
+    s.resize( size_t( n ) );
+    x = s;
+    return true;
+}
+
+inline void val::Process::close( void )
+{
+    if ( in_fd >= 0 ) {
+        ::close( in_fd );
+        in_fd = -1;
+    }
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// BINARY ENCODING
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+val val::bin_read( std::string file_name )
+{
+    return bin_decode( file_map( file_name ) );
+}
+
+val val::bin_decode( const void * buffer, size_t buffer_len )
+{
+    const char * xxx = reinterpret_cast<const char *>( buffer );
+    return bin_decode_buf( xxx, xxx + buffer_len, val() );
+}
+
+val val::bin_decode( const val& blob )
+{
+    csassert( blob.k == kind::BLOB, "bin_decode() val argument must be a BLOB" );
+    return bin_decode_buf( blob.u.bl->data, blob.u.bl->data + blob.u.bl->len, blob );
+}
+
+val val::bin_decode_buf( const char * xxx, const char * xxx_end, const val& src )
+{
+    size_t buffer_len = size_t( xxx_end - xxx );
+    csassert( buffer_len >= 4 && xxx[0] == 'c' && xxx[1] == 's' && xxx[2] == 'b', "bin_decode() buffer does not start with csb magic" );
+    csassert( xxx[3] == 1, "bin_decode() unsupported version " + std::to_string( int( xxx[3] ) ) );
+    xxx += 4;
+
+    val v;
+    std::vector<std::string> keys;
+    csassert( bin_decode_expr( v, keys, xxx, xxx_end, src ), "unable to decode bin data" );
+    csassert( xxx == xxx_end, "bin_decode() found extra bytes after top-level value" );
+    return v;
+}
+
+void val::bin_write( std::string file_name ) const
+{
+    int fd = open( file_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666 );
+    csassert( fd >= 0, "could not open file " + file_name + " for writing - open() error: " + strerror( errno ) );
+    {
+        Writer w( fd );
+        std::unordered_map<std::string,uint64_t> keys;
+        w.put( "csb\x01", 4 );
+        bin_encode_expr( w, keys );
+    }
+    ::close( fd );
+}
+
+std::string val::bin_encode( void ) const
+{
+    Writer w;
+    std::unordered_map<std::string,uint64_t> keys;
+    w.put( "csb\x01", 4 );
+    bin_encode_expr( w, keys );
+    return std::move( w.buff );
+}
+
+void val::bin_encode_expr( Writer& w, std::unordered_map<std::string,uint64_t>& keys ) const
+{
+    switch( k )
+    {
+        case kind::UNDEF:
+            w.put( char( bin_tag::UNDEF ) );
+            break;
+
+        case kind::BOOL:
+            w.put( char( u.b ? bin_tag::BOOL_TRUE : bin_tag::BOOL_FALSE ) );
+            break;
+
+        case kind::INT:
+            w.put( char( bin_tag::INT ) );
+            w.put_varint( zigzag( u.i ) );
+            break;
+
+        case kind::FLT:
+            w.put( char( bin_tag::FLT ) );
+            w.put_le( f64_bits( u.f ), 8 );
+            break;
+
+        case kind::STR:
+            w.put( char( bin_tag::STR ) );
+            w.put_varint( u.s->s.length() );
+            w.put( u.s->s.data(), u.s->s.length() );
+            break;
+
+        case kind::BLOB:
+            w.put( char( bin_tag::BLOB ) );
+            w.put_varint( u.bl->len );
+            w.put( u.bl->data, u.bl->len );
+            break;
+
+        case kind::LIST:
+            w.put( char( bin_tag::LIST ) );
+            w.put_varint( u.l->l.size() );
+            for( const val& x : u.l->l ) 
+            {
+                x.bin_encode_expr( w, keys );
+                w.maybe_flush();
+            }
+            break;
+
+        case kind::MAP:
+            w.put( char( bin_tag::MAP ) );
+            w.put_varint( u.m->m.size() );
+            for( const auto& it : u.m->m ) 
+            {
+                // key reference 0 means a new key follows; otherwise it's 1 + index of earlier key
+                auto kit = keys.find( it.first );
+                if ( kit != keys.end() ) {
+                    w.put_varint( kit->second + 1 );
+                } else {
+                    keys.emplace( it.first, keys.size() );
+                    w.put_varint( 0 );
+                    w.put_varint( it.first.length() );
+                    w.put( it.first.data(), it.first.length() );
+                }
+                it.second.bin_encode_expr( w, keys );
+                w.maybe_flush();
+            }
+            break;
+
+        default:
+            csdie( "bin_encode() does not support " + kind_to_str( k ) + " vals" );
+            break;
+    }
+}
+
+bool val::bin_decode_expr( val& v, std::vector<std::string>& keys, const char *& xxx, const char * xxx_end, const val& src )
+{
+    uint8_t tag;
+    uint64_t x;
+    const char * bytes;
+    if ( !get_byte( tag, xxx, xxx_end ) ) return false;
+    switch( bin_tag( tag ) )
+    {
+        case bin_tag::UNDEF:      v = val();            return true;
+        case bin_tag::BOOL_FALSE: v = val( false );     return true;
+        case bin_tag::BOOL_TRUE:  v = val( true );      return true;
+
+        case bin_tag::INT:
+            if ( !get_varint( x, xxx, xxx_end ) ) return false;
+            v = val( unzigzag( x ) );
+            return true;
+
+        case bin_tag::FLT:
+            if ( !get_le( x, 8, xxx, xxx_end ) ) return false;
+            v = val( bits_f64( x ) );
+            return true;
+
+        case bin_tag::STR:
+            if ( !get_varint( x, xxx, xxx_end ) || !get_bytes( bytes, x, xxx, xxx_end ) ) return false;
+            v = val( std::string( bytes, x ) );
+            return true;
+
+        case bin_tag::BLOB:
+            if ( !get_varint( x, xxx, xxx_end ) || !get_bytes( bytes, x, xxx, xxx_end ) ) return false;
+            v = blob_part( src, bytes, x );
+            return true;
+
+        case bin_tag::LIST:
+        {
+            if ( !get_varint( x, xxx, xxx_end ) ) return false;
+            csassert( x <= uint64_t( xxx_end - xxx ), "bin LIST count is larger than remaining data" );
+            v = list();
+            std::vector<val>& l = v.u.l->l;
+            l.resize( x );
+            for( uint64_t i = 0; i < x; i++ )
+            {
+                if ( !bin_decode_expr( l[i], keys, xxx, xxx_end, src ) ) return false;
+            }
+            return true;
+        }
+
+        case bin_tag::MAP:
+        {
+            if ( !get_varint( x, xxx, xxx_end ) ) return false;
+            csassert( x <= uint64_t( xxx_end - xxx ), "bin MAP count is larger than remaining data" );
+            v = map();
+            std::unordered_map<std::string,val>& m = v.u.m->m;
+            m.reserve( x );
+            for( uint64_t i = 0; i < x; i++ )
+            {
+                uint64_t key_ref;
+                if ( !get_varint( key_ref, xxx, xxx_end ) ) return false;
+                if ( key_ref == 0 ) {
+                    uint64_t len;
+                    if ( !get_varint( len, xxx, xxx_end ) || !get_bytes( bytes, len, xxx, xxx_end ) ) return false;
+                    keys.emplace_back( bytes, len );
+                    key_ref = keys.size();
+                }
+                csassert( key_ref <= keys.size(), "bin MAP key reference is out of range" );
+                if ( !bin_decode_expr( m[keys[key_ref-1]], keys, xxx, xxx_end, src ) ) return false;
+            }
+            return true;
+        }
+
+        default:
+            csdie( "bin_decode() found unknown tag " + std::to_string( uint32_t( tag ) ) );
+            return false;
+    }
+}
+
+inline bool val::get_byte( uint8_t& b, const char *& xxx, const char * xxx_end )
+{
+    csassert( xxx != xxx_end, "premature end of binary data" );
+    b = uint8_t( *xxx++ );
+    return true;
+}
+
+inline bool val::get_bytes( const char *& bytes, uint64_t len, const char *& xxx, const char * xxx_end )
+{
+    csassert( len <= uint64_t( xxx_end - xxx ), "premature end of binary data" );
+    bytes = xxx;
+    xxx += len;
+    return true;
+}
+
+inline bool val::get_be( uint64_t& x, uint32_t byte_cnt, const char *& xxx, const char * xxx_end )
+{
+    csassert( byte_cnt <= uint64_t( xxx_end - xxx ), "premature end of binary data" );
+    x = 0;
+    for( uint32_t i = 0; i < byte_cnt; i++ ) x = (x << 8) | uint8_t( *xxx++ );
+    return true;
+}
+
+inline bool val::get_le( uint64_t& x, uint32_t byte_cnt, const char *& xxx, const char * xxx_end )
+{
+    csassert( byte_cnt <= uint64_t( xxx_end - xxx ), "premature end of binary data" );
+    x = 0;
+    for( uint32_t i = 0; i < byte_cnt; i++ ) x |= uint64_t( uint8_t( *xxx++ ) ) << (8*i);
+    return true;
+}
+
+inline bool val::get_varint( uint64_t& x, const char *& xxx, const char * xxx_end )
+{
+    x = 0;
+    for( uint32_t shift = 0; ; shift += 7 )
+    {
+        csassert( xxx != xxx_end, "premature end of binary data" );
+        csassert( shift < 64, "varint is too long" );
+        uint8_t b = uint8_t( *xxx++ );
+        x |= uint64_t( b & 0x7f ) << shift;
+        if ( (b & 0x80) == 0 ) return true;
+    }
+}
+
+void val::Writer::flush( void )
+{
+    if ( fd < 0 ) return;
+    const char * p = buff.data();
+    size_t len = buff.size();
+    while( len != 0 )
+    {
+        ssize_t cnt = ::write( fd, p, len );
+        if ( cnt < 0 && errno == EINTR ) continue;
+        csassert( cnt > 0, std::string( "write() error: " ) + strerror( errno ) );
+        p   += cnt;
+        len -= cnt;
+    }
+    flushed_len += buff.size();
+    buff.clear();
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// MESSAGEPACK
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+val val::msgpack_decode( const void * buffer, size_t buffer_len )
+{
+    const char * xxx = reinterpret_cast<const char *>( buffer );
+    return msgpack_decode_buf( xxx, xxx + buffer_len, val() );
+}
+
+val val::msgpack_decode( const val& blob )
+{
+    csassert( blob.k == kind::BLOB, "msgpack_decode() val argument must be a BLOB" );
+    return msgpack_decode_buf( blob.u.bl->data, blob.u.bl->data + blob.u.bl->len, blob );
+}
+
+val val::msgpack_decode_buf( const char * xxx, const char * xxx_end, const val& src )
+{
+    val v;
+    csassert( msgpack_decode_expr( v, xxx, xxx_end, src ), "unable to decode MessagePack data" );
+    csassert( xxx == xxx_end, "msgpack_decode() found extra bytes after top-level value" );
+    return v;
+}
+
+std::string val::msgpack_encode( void ) const
+{
+    Writer w;
+    msgpack_encode_expr( w );
+    return std::move( w.buff );
+}
+
+void val::msgpack_encode_expr( Writer& w ) const
+{
+    switch( k )
+    {
+        case kind::UNDEF:
+            w.put( char( 0xc0 ) );
+            break;
+
+        case kind::BOOL:
+            w.put( char( u.b ? 0xc3 : 0xc2 ) );
+            break;
+
+        case kind::INT:
+            if ( u.i >= 0 ) {
+                uint64_t x = u.i;
+                if ( x < 0x80 ) {
+                    w.put( char( x ) );
+                } else if ( x <= 0xff ) {
+                    w.put( char( 0xcc ) ); w.put_be( x, 1 );
+                } else if ( x <= 0xffff ) {
+                    w.put( char( 0xcd ) ); w.put_be( x, 2 );
+                } else if ( x <= 0xffffffff ) {
+                    w.put( char( 0xce ) ); w.put_be( x, 4 );
+                } else {
+                    w.put( char( 0xcf ) ); w.put_be( x, 8 );
+                }
+            } else {
+                if ( u.i >= -32 ) {
+                    w.put( char( u.i ) );
+                } else if ( u.i >= INT8_MIN ) {
+                    w.put( char( 0xd0 ) ); w.put_be( u.i, 1 );
+                } else if ( u.i >= INT16_MIN ) {
+                    w.put( char( 0xd1 ) ); w.put_be( u.i, 2 );
+                } else if ( u.i >= INT32_MIN ) {
+                    w.put( char( 0xd2 ) ); w.put_be( u.i, 4 );
+                } else {
+                    w.put( char( 0xd3 ) ); w.put_be( u.i, 8 );
+                }
+            }
+            break;
+
+        case kind::FLT:
+            w.put( char( 0xcb ) );
+            w.put_be( f64_bits( u.f ), 8 );
+            break;
+
+        case kind::STR:
+        case kind::BLOB:
+        {
+            const char * bytes = (k == kind::STR) ? u.s->s.data()   : u.bl->data;
+            uint64_t     len   = (k == kind::STR) ? u.s->s.length() : u.bl->len;
+            csassert( len <= 0xffffffff, "MessagePack strings are limited to 4GB" );
+            if ( k == kind::STR && len < 32 ) {
+                w.put( char( 0xa0 | len ) );
+            } else if ( len <= 0xff ) {
+                w.put( char( (k == kind::STR) ? 0xd9 : 0xc4 ) ); w.put_be( len, 1 );
+            } else if ( len <= 0xffff ) {
+                w.put( char( (k == kind::STR) ? 0xda : 0xc5 ) ); w.put_be( len, 2 );
+            } else {
+                w.put( char( (k == kind::STR) ? 0xdb : 0xc6 ) ); w.put_be( len, 4 );
+            }
+            w.put( bytes, len );
+            break;
+        }
+
+        case kind::LIST:
+        {
+            uint64_t cnt = u.l->l.size();
+            if ( cnt < 16 ) {
+                w.put( char( 0x90 | cnt ) );
+            } else if ( cnt <= 0xffff ) {
+                w.put( char( 0xdc ) ); w.put_be( cnt, 2 );
+            } else {
+                w.put( char( 0xdd ) ); w.put_be( cnt, 4 );
+            }
+            for( const val& x : u.l->l ) x.msgpack_encode_expr( w );
+            break;
+        }
+
+        case kind::MAP:
+        {
+            uint64_t cnt = u.m->m.size();
+            if ( cnt < 16 ) {
+                w.put( char( 0x80 | cnt ) );
+            } else if ( cnt <= 0xffff ) {
+                w.put( char( 0xde ) ); w.put_be( cnt, 2 );
+            } else {
+                w.put( char( 0xdf ) ); w.put_be( cnt, 4 );
+            }
+            for( const auto& it : u.m->m ) 
+            {
+                uint64_t len = it.first.length();
+                if ( len < 32 ) {
+                    w.put( char( 0xa0 | len ) );
+                } else if ( len <= 0xff ) {
+                    w.put( char( 0xd9 ) ); w.put_be( len, 1 );
+                } else if ( len <= 0xffff ) {
+                    w.put( char( 0xda ) ); w.put_be( len, 2 );
+                } else {
+                    w.put( char( 0xdb ) ); w.put_be( len, 4 );
+                }
+                w.put( it.first.data(), len );
+                it.second.msgpack_encode_expr( w );
+            }
+            break;
+        }
+
+        default:
+            csdie( "msgpack_encode() does not support " + kind_to_str( k ) + " vals" );
+            break;
+    }
+}
+
+bool val::msgpack_decode_expr( val& v, const char *& xxx, const char * xxx_end, const val& src )
+{
+    uint8_t b;
+    uint64_t x;
+    uint64_t cnt;
+    const char * bytes;
+    if ( !get_byte( b, xxx, xxx_end ) ) return false;
+
+    if ( b < 0x80 ) {                                                   // positive fixint
+        v = val( int64_t( b ) );
+        return true;
+    } 
+    if ( b >= 0xe0 ) {                                                  // negative fixint
+        v = val( int64_t( int8_t( b ) ) );
+        return true;
+    }
+    if ( (b & 0xe0) == 0xa0 ) {                                         // fixstr
+        if ( !get_bytes( bytes, b & 0x1f, xxx, xxx_end ) ) return false;
+        v = val( std::string( bytes, b & 0x1f ) );
+        return true;
+    }
+    if ( (b & 0xf0) == 0x90 || (b & 0xf0) == 0x80 ) {                   // fixarray or fixmap
+        cnt = b & 0x0f;
+        goto array_or_map;
+    }
+
+    switch( b )
+    {
+        case 0xc0:      v = val();              return true;
+        case 0xc2:      v = val( false );       return true;
+        case 0xc3:      v = val( true );        return true;
+
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            if ( !get_be( x, 1 << (b - 0xcc), xxx, xxx_end ) ) return false;
+            csassert( x <= uint64_t( INT64_MAX ), "msgpack_decode() value " + std::to_string( x ) + " is out of int64 range" );
+            v = val( int64_t( x ) );
+            return true;
+
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+        {
+            uint32_t byte_cnt = 1 << (b - 0xd0);
+            if ( !get_be( x, byte_cnt, xxx, xxx_end ) ) return false;
+            uint32_t shift = 64 - 8*byte_cnt;
+            v = val( int64_t( x << shift ) >> shift );                  // sign-extend
+            return true;
+        }
+
+        case 0xca:
+        {
+            if ( !get_be( x, 4, xxx, xxx_end ) ) return false;
+            uint32_t x32 = uint32_t( x );
+            float f;
+            memcpy( &f, &x32, 4 );
+            v = val( double( f ) );
+            return true;
+        }
+
+        case 0xcb:
+            if ( !get_be( x, 8, xxx, xxx_end ) ) return false;
+            v = val( bits_f64( x ) );
+            return true;
+
+        case 0xd9:
+        case 0xda:
+        case 0xdb:
+            if ( !get_be( x, 1 << (b - 0xd9), xxx, xxx_end ) || !get_bytes( bytes, x, xxx, xxx_end ) ) return false;
+            v = val( std::string( bytes, x ) );
+            return true;
+
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+            if ( !get_be( x, 1 << (b - 0xc4), xxx, xxx_end ) || !get_bytes( bytes, x, xxx, xxx_end ) ) return false;
+            v = blob_part( src, bytes, x );
+            return true;
+
+        case 0xdc:
+        case 0xde:
+            if ( !get_be( cnt, 2, xxx, xxx_end ) ) return false;
+            goto array_or_map;
+
+        case 0xdd:
+        case 0xdf:
+            if ( !get_be( cnt, 4, xxx, xxx_end ) ) return false;
+            goto array_or_map;
+
+        default:
+            csdie( "msgpack_decode() does not support type byte " + std::to_string( uint32_t( b ) ) );
+            return false;
+    }
+
+array_or_map:
+    csassert( cnt <= uint64_t( xxx_end - xxx ), "MessagePack count is larger than remaining data" );
+    if ( (b & 0xf0) == 0x90 || b == 0xdc || b == 0xdd ) {
+        v = list();
+        std::vector<val>& l = v.u.l->l;
+        l.resize( cnt );
+        for( uint64_t i = 0; i < cnt; i++ )
+        {
+            if ( !msgpack_decode_expr( l[i], xxx, xxx_end, src ) ) return false;
+        }
+    } else {
+        v = map();
+        std::unordered_map<std::string,val>& m = v.u.m->m;
+        m.reserve( cnt );
+        for( uint64_t i = 0; i < cnt; i++ )
+        {
+            val key;
+            if ( !msgpack_decode_expr( key, xxx, xxx_end, src ) ) return false;
+            if ( !msgpack_decode_expr( m[(key.k == kind::STR) ? key.u.s->s : std::string( key )], xxx, xxx_end, src ) ) return false;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// CBOR
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+val val::cbor_decode( const void * buffer, size_t buffer_len )
+{
+    const char * xxx = reinterpret_cast<const char *>( buffer );
+    return cbor_decode_buf( xxx, xxx + buffer_len, val() );
+}
+
+val val::cbor_decode( const val& blob )
+{
+    csassert( blob.k == kind::BLOB, "cbor_decode() val argument must be a BLOB" );
+    return cbor_decode_buf( blob.u.bl->data, blob.u.bl->data + blob.u.bl->len, blob );
+}
+
+val val::cbor_decode_buf( const char * xxx, const char * xxx_end, const val& src )
+{
+    val v;
+    csassert( cbor_decode_expr( v, xxx, xxx_end, src ), "unable to decode CBOR data" );
+    csassert( xxx == xxx_end, "cbor_decode() found extra bytes after top-level value" );
+    return v;
+}
+
+std::string val::cbor_encode( void ) const
+{
+    Writer w;
+    cbor_encode_expr( w );
+    return std::move( w.buff );
+}
+
+inline void val::cbor_put_head( Writer& w, uint8_t major, uint64_t x )
+{
+    major <<= 5;
+    if ( x < 24 ) {
+        w.put( char( major | x ) );
+    } else if ( x <= 0xff ) {
+        w.put( char( major | 24 ) ); w.put_be( x, 1 );
+    } else if ( x <= 0xffff ) {
+        w.put( char( major | 25 ) ); w.put_be( x, 2 );
+    } else if ( x <= 0xffffffff ) {
+        w.put( char( major | 26 ) ); w.put_be( x, 4 );
+    } else {
+        w.put( char( major | 27 ) ); w.put_be( x, 8 );
+    }
+}
+
+void val::cbor_encode_expr( Writer& w ) const
+{
+    switch( k )
+    {
+        case kind::UNDEF:       w.put( char( 0xf6 ) );                                          break;
+        case kind::BOOL:        w.put( char( u.b ? 0xf5 : 0xf4 ) );                             break;
+        case kind::INT:         cbor_put_head( w, (u.i >= 0) ? 0 : 1, (u.i >= 0) ? u.i : -1-u.i ); break;
+        case kind::FLT:         w.put( char( 0xfb ) ); w.put_be( f64_bits( u.f ), 8 );          break;
+        case kind::STR:         cbor_put_head( w, 3, u.s->s.length() ); w.put( u.s->s.data(), u.s->s.length() ); break;
+        case kind::BLOB:        cbor_put_head( w, 2, u.bl->len ); w.put( u.bl->data, u.bl->len ); break;
+
+        case kind::LIST:
+            cbor_put_head( w, 4, u.l->l.size() );
+            for( const val& x : u.l->l ) x.cbor_encode_expr( w );
+            break;
+
+        case kind::MAP:
+            cbor_put_head( w, 5, u.m->m.size() );
+            for( const auto& it : u.m->m ) 
+            {
+                cbor_put_head( w, 3, it.first.length() ); 
+                w.put( it.first.data(), it.first.length() );
+                it.second.cbor_encode_expr( w );
+            }
+            break;
+
+        default:
+            csdie( "cbor_encode() does not support " + kind_to_str( k ) + " vals" );
+            break;
+    }
+}
+
+bool val::cbor_decode_expr( val& v, const char *& xxx, const char * xxx_end, const val& src )
+{
+    uint8_t b;
+    if ( !get_byte( b, xxx, xxx_end ) ) return false;
+    uint8_t major = b >> 5;
+    uint8_t info  = b & 0x1f;
+
+    // argument; info 31 means indefinite length for strings, arrays and maps
+    uint64_t x = info;
+    bool is_indef = false;
+    if ( info >= 24 && info <= 27 ) {
+        if ( !get_be( x, 1 << (info - 24), xxx, xxx_end ) ) return false;
+    } else if ( info == 31 && major >= 2 && major <= 5 ) {
+        is_indef = true;
+    } else if ( info > 27 && major != 7 ) {
+        csdie( "cbor_decode() found reserved additional info " + std::to_string( uint32_t( info ) ) );
+    }
+
+    switch( major )
+    {
+        case 0:
+            csassert( x <= uint64_t( INT64_MAX ), "cbor_decode() value " + std::to_string( x ) + " is out of int64 range" );
+            v = val( int64_t( x ) );
+            return true;
+
+        case 1:
+            csassert( x <= uint64_t( INT64_MAX ), "cbor_decode() negative value below INT64_MIN is out of int64 range" );
+            v = val( -1 - int64_t( x ) );
+            return true;
+
+        case 2:
+        case 3:
+        {
+            const char * bytes;
+            std::string s;
+            if ( !is_indef ) {
+                if ( !get_bytes( bytes, x, xxx, xxx_end ) ) return false;
+                if ( major == 2 ) {
+                    v = blob_part( src, bytes, x );
+                    return true;
+                }
+                s.assign( bytes, x );
+            } else {
+                // concatenation of definite-length chunks up to break
+                for( ;; )
+                {
+                    csassert( xxx != xxx_end, "premature end of binary data" );
+                    if ( uint8_t( *xxx ) == 0xff ) { xxx++; break; }
+                    val chunk;
+                    if ( !cbor_decode_expr( chunk, xxx, xxx_end, src ) ) return false;
+                    s += std::string( chunk );
+                }
+            }
+            v = (major == 3) ? val( s ) : blob_copy( s.data(), s.length() );
+            return true;
+        }
+
+        case 4:
+        {
+            v = list();
+            std::vector<val>& l = v.u.l->l;
+            if ( !is_indef ) {
+                csassert( x <= uint64_t( xxx_end - xxx ), "CBOR count is larger than remaining data" );
+                l.resize( x );
+                for( uint64_t i = 0; i < x; i++ )
+                {
+                    if ( !cbor_decode_expr( l[i], xxx, xxx_end, src ) ) return false;
+                }
+            } else {
+                for( ;; )
+                {
+                    csassert( xxx != xxx_end, "premature end of binary data" );
+                    if ( uint8_t( *xxx ) == 0xff ) { xxx++; break; }
+                    l.emplace_back();
+                    if ( !cbor_decode_expr( l.back(), xxx, xxx_end, src ) ) return false;
+                }
+            }
+            return true;
+        }
+
+        case 5:
+        {
+            v = map();
+            std::unordered_map<std::string,val>& m = v.u.m->m;
+            if ( !is_indef ) {
+                csassert( x <= uint64_t( xxx_end - xxx ), "CBOR count is larger than remaining data" );
+                m.reserve( x );
+            }
+            for( uint64_t i = 0; is_indef || i < x; i++ )
+            {
+                if ( is_indef ) {
+                    csassert( xxx != xxx_end, "premature end of binary data" );
+                    if ( uint8_t( *xxx ) == 0xff ) { xxx++; break; }
+                }
+                val key;
+                if ( !cbor_decode_expr( key, xxx, xxx_end, src ) ) return false;
+                if ( !cbor_decode_expr( m[(key.k == kind::STR) ? key.u.s->s : std::string( key )], xxx, xxx_end, src ) ) return false;
+            }
+            return true;
+        }
+
+        case 6:
+            // semantic tag; decode the tagged item as is
+            return cbor_decode_expr( v, xxx, xxx_end, src );
+
+        default:
+        {
+            switch( info )
+            {
+                case 20:        v = val( false );       return true;
+                case 21:        v = val( true );        return true;
+                case 22:                                                // null
+                case 23:        v = val();              return true;    // undefined
+
+                case 25:
+                {
+                    // half precision
+                    uint32_t h    = uint32_t( x );
+                    uint32_t exp  = (h >> 10) & 0x1f;
+                    uint32_t mant = h & 0x3ff;
+                    double   f    = (exp == 0)  ? std::ldexp( double( mant ), -24 ) :
+                                    (exp == 31) ? ((mant == 0) ? INFINITY : NAN) :
+                                                  std::ldexp( double( mant + 1024 ), int( exp ) - 25 );
+                    v = val( (h & 0x8000) ? -f : f );
+                    return true;
+                }
+
+                case 26:
+                {
+                    uint32_t x32 = uint32_t( x );
+                    float f;
+                    memcpy( &f, &x32, 4 );
+                    v = val( double( f ) );
+                    return true;
+                }
+
+                case 27:
+                    v = val( bits_f64( x ) );
+                    return true;
+
+                default:
+                    csdie( "cbor_decode() does not support simple value " + std::to_string( uint32_t( info ) ) );
+                    return false;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// ZERO-COPY IMAGES
+//
+// Header is 32 bytes: "csimg" magic and version, byte-order marker, root record offset, 
+// and total length.  Each record starts with one 64-bit word holding the bin_tag in 
+// the low byte and a count in the upper bytes:
+//
+//     UNDEF, BOOL_FALSE, BOOL_TRUE:    no payload
+//     INT, FLT:                        one 64-bit word holding the value
+//     STR, BLOB:                       byte count, then the bytes plus a NUL, padded to 8 bytes
+//     LIST:                            entry count, then one record offset per entry
+//     MAP:                             entry count, then key record and value record offsets 
+//                                      per entry, sorted by key bytes
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+static const char     IMAGE_MAGIC[8]   = { 'c', 's', 'i', 'm', 'g', 0, 0, 1 };
+static const uint64_t IMAGE_HDR_LEN    = 32;
+static const uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+
+void val::image_write( std::string file_name ) const
+{
+    int fd = open( file_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666 );
+    csassert( fd >= 0, "could not open file " + file_name + " for writing - open() error: " + strerror( errno ) );
+    uint64_t root;
+    uint64_t total_len;
+    {
+        Writer w( fd );
+        std::unordered_map<std::string,uint64_t> keys;
+        w.buff.append( IMAGE_HDR_LEN, '\0' );             // filled in below
+        root = image_write_expr( w, keys );
+        total_len = w.pos();
+    }
+
+    // records are written children-first, so the root offset isn't known until the end
+    char hdr[IMAGE_HDR_LEN];
+    memset( hdr, 0, IMAGE_HDR_LEN );
+    memcpy( hdr,    IMAGE_MAGIC, 8 );
+    memcpy( hdr+8,  &IMAGE_BYTE_ORDER, 4 );
+    memcpy( hdr+16, &root, 8 );
+    memcpy( hdr+24, &total_len, 8 );
+    csassert( pwrite( fd, hdr, IMAGE_HDR_LEN, 0 ) == ssize_t( IMAGE_HDR_LEN ), std::string( "image_write() pwrite() error: " ) + strerror( errno ) );
+    ::close( fd );
+}
+
+uint64_t val::image_write_str( Writer& w, bin_tag tag, const char * s, uint64_t s_len )
+{
+    uint64_t o = w.pos();
+    uint64_t hdr = uint64_t( tag ) | (s_len << 8);
+    w.put( &hdr, 8 );
+    w.put( s, s_len );
+    w.buff.append( 8 - (s_len & 7), '\0' );           // NUL plus padding
+    return o;
+}
+
+uint64_t val::image_write_expr( Writer& w, std::unordered_map<std::string,uint64_t>& keys ) const
+{
+    uint64_t o;
+    uint64_t hdr;
+    switch( k )
+    {
+        case kind::UNDEF:
+        case kind::BOOL:
+            o = w.pos();
+            hdr = uint64_t( (k == kind::UNDEF) ? bin_tag::UNDEF : u.b ? bin_tag::BOOL_TRUE : bin_tag::BOOL_FALSE );
+            w.put( &hdr, 8 );
+            break;
+
+        case kind::INT:
+        case kind::FLT:
+            o = w.pos();
+            hdr = uint64_t( (k == kind::INT) ? bin_tag::INT : bin_tag::FLT );
+            w.put( &hdr, 8 );
+            w.put( &u, 8 );
+            break;
+
+        case kind::STR:
+            o = image_write_str( w, bin_tag::STR, u.s->s.data(), u.s->s.length() );
+            break;
+
+        case kind::BLOB:
+            o = image_write_str( w, bin_tag::BLOB, u.bl->data, u.bl->len );
+            break;
+
+        case kind::LIST:
+        {
+            std::vector<uint64_t> offs;
+            offs.reserve( u.l->l.size() );
+            for( const val& x : u.l->l ) offs.push_back( x.image_write_expr( w, keys ) );
+
+            o = w.pos();
+            hdr = uint64_t( bin_tag::LIST ) | (uint64_t( offs.size() ) << 8);
+            w.put( &hdr, 8 );
+            w.put( offs.data(), offs.size()*8 );
+            break;
+        }
+
+        case kind::MAP:
+        {
+            std::vector<const std::pair<const std::string,val> *> entries;
+            entries.reserve( u.m->m.size() );
+            for( const auto& it : u.m->m ) entries.push_back( &it );
+            std::sort( entries.begin(), entries.end(), []( auto a, auto b ) { return a->first < b->first; } );
+
+            std::vector<uint64_t> offs;
+            offs.reserve( entries.size()*2 );
+            for( auto e : entries )
+            {
+                auto kit = keys.find( e->first );
+                if ( kit == keys.end() ) kit = keys.emplace( e->first, image_write_str( w, bin_tag::STR, e->first.data(), e->first.length() ) ).first;
+                offs.push_back( kit->second );
+                offs.push_back( e->second.image_write_expr( w, keys ) );
+            }
+
+            o = w.pos();
+            hdr = uint64_t( bin_tag::MAP ) | (uint64_t( entries.size() ) << 8);
+            w.put( &hdr, 8 );
+            w.put( offs.data(), offs.size()*8 );
+            break;
+        }
+
+        default:
+            csdie( "image_write() does not support " + kind_to_str( k ) + " vals" );
+            return 0;
+    }
+    w.maybe_flush();
+    return o;
+}
+
+val::image val::image_map( std::string file_name )
+{
+    image img;
+    img.file = file_map( file_name, "r" );      // random access; pages come in as they are touched
+    img.base = img.file.data();
+    img.len  = img.file.size();
+    csassert( img.len >= IMAGE_HDR_LEN && memcmp( img.base, IMAGE_MAGIC, 8 ) == 0, file_name + " is not a cs image" );
+    uint32_t byte_order;
+    memcpy( &byte_order, img.base+8, 4 );
+    csassert( byte_order == IMAGE_BYTE_ORDER, file_name + " was written with a different byte order" );
+    csassert( img.word( 24 ) == img.len, file_name + " is truncated" );
+    img.off = img.word( 16 );
+    return img;
+}
+
+inline val::image::image( const image& parent, uint64_t _off )
+{
+    file = parent.file;
+    base = parent.base;
+    len  = parent.len;
+    off  = _off;
+}
+
+inline std::string val::image::kind( void ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::UNDEF:            return "UNDEF";
+        case bin_tag::BOOL_FALSE:       
+        case bin_tag::BOOL_TRUE:        return "BOOL";
+        case bin_tag::INT:              return "INT";
+        case bin_tag::FLT:              return "FLT";
+        case bin_tag::STR:              return "STR";
+        case bin_tag::BLOB:             return "BLOB";
+        case bin_tag::LIST:             return "LIST";
+        case bin_tag::MAP:              return "MAP";
+        default:                        return "<unknown kind>";
+    }
+}
+
+inline val::image::operator bool( void ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::BOOL_FALSE:       return false;
+        case bin_tag::BOOL_TRUE:        return true;
+        case bin_tag::INT:              return word( off+8 ) != 0;
+        case bin_tag::LIST:             
+        case bin_tag::MAP:              return size() != 0;
+        default:                        csdie( "can't convert image " + kind() + " to bool" ); return false;
+    }
+}
+
+inline val::image::operator int64_t( void ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::BOOL_FALSE:       return 0;
+        case bin_tag::BOOL_TRUE:        return 1;
+        case bin_tag::INT:              return int64_t( word( off+8 ) );
+        case bin_tag::FLT:              return int64_t( bits_f64( word( off+8 ) ) );
+        case bin_tag::LIST:             
+        case bin_tag::MAP:              return size();
+        default:                        csdie( "can't convert image " + kind() + " to int64_t" ); return 0;
+    }
+}
+
+inline val::image::operator double( void ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::INT:              return double( int64_t( word( off+8 ) ) );
+        case bin_tag::FLT:              return bits_f64( word( off+8 ) );
+        case bin_tag::LIST:             
+        case bin_tag::MAP:              return double( size() );
+        default:                        csdie( "can't convert image " + kind() + " to double" ); return 0.0;
+    }
+}
+
+inline std::string_view val::image::str( void ) const
+{
+    bin_tag t = tag();
+    csassert( t == bin_tag::STR || t == bin_tag::BLOB, "image str() allowed only on STR or BLOB" );
+    uint64_t s_len = payload();
+    csassert( off+8+s_len <= len, "image offset out of range" );
+    return std::string_view( base+off+8, s_len );
+}
+
+inline uint64_t val::image::size( void ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::STR:
+        case bin_tag::BLOB:
+        case bin_tag::LIST:
+        case bin_tag::MAP:              return payload();
+        default:                        csdie( "can't call size() on an image " + kind() ); return 0;
+    }
+}
+
+inline val::image val::image::at( uint64_t i ) const
+{
+    bin_tag t = tag();
+    csassert( t == bin_tag::LIST || t == bin_tag::MAP, "image at() allowed only on LIST or MAP" );
+    csassert( i < payload(), "image index is out of range" );
+    return image( *this, word( off + 8 + ((t == bin_tag::LIST) ? 8*i : 16*i+8) ) );
+}
+
+inline std::string_view val::image::key_at( uint64_t i ) const
+{
+    csassert( tag() == bin_tag::MAP, "image key_at() allowed only on MAP" );
+    csassert( i < payload(), "image index is out of range" );
+    return image( *this, word( off + 8 + 16*i ) ).str();
+}
+
+inline val::image val::image::get( std::string_view key ) const
+{
+    csassert( tag() == bin_tag::MAP, "image get() of a key allowed only on MAP" );
+    uint64_t lo = 0;
+    uint64_t hi = payload();
+    while( lo < hi )
+    {
+        uint64_t mid = lo + (hi - lo)/2;
+        int cmp = key_at( mid ).compare( key );
+        if ( cmp == 0 ) return at( mid );
+        if ( cmp < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    csdie( "image MAP key " + std::string( key ) + " does not exist" );
+    return image();
+}
+
+inline val::image val::image::get( const val& key ) const
+{
+    return (tag() == bin_tag::LIST) ? at( int64_t( key ) ) : get( std::string_view( std::string( key ) ) );
+}
+
+inline bool val::image::exists( const val& key ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::LIST:
+        {
+            int64_t index = key;
+            return index >= 0 && uint64_t( index ) < payload();
+        }
+
+        case bin_tag::MAP:
+        {
+            std::string key_s = key;
+            uint64_t lo = 0;
+            uint64_t hi = payload();
+            while( lo < hi )
+            {
+                uint64_t mid = lo + (hi - lo)/2;
+                int cmp = key_at( mid ).compare( key_s );
+                if ( cmp == 0 ) return true;
+                if ( cmp < 0 ) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return false;
+        }
+
+        default:
+        {
+            csdie( "can't call exists() on an image " + kind() );  
+            return false;
+        }
+    }
+}
+
+inline val val::image::to_val( void ) const
+{
+    switch( tag() )
+    {
+        case bin_tag::UNDEF:            return val();
+        case bin_tag::BOOL_FALSE:       return val( false );
+        case bin_tag::BOOL_TRUE:        return val( true );
+        case bin_tag::INT:              return val( int64_t( word( off+8 ) ) );
+        case bin_tag::FLT:              return val( bits_f64( word( off+8 ) ) );
+        case bin_tag::STR:              return val( std::string( str() ) );
+        case bin_tag::BLOB:             { std::string_view b = str(); return file.slice( uint64_t( b.data() - base ), b.length() ); }
+
+        case bin_tag::LIST:
+        {
+            val l = list();
+            uint64_t cnt = payload();
+            l.u.l->l.reserve( cnt );
+            for( uint64_t i = 0; i < cnt; i++ ) l.u.l->l.push_back( at( i ).to_val() );
+            return l;
+        }
+
+        case bin_tag::MAP:
+        {
+            val m = map();
+            uint64_t cnt = payload();
+            m.u.m->m.reserve( cnt );
+            for( uint64_t i = 0; i < cnt; i++ ) m.u.m->m.emplace( std::string( key_at( i ) ), at( i ).to_val() );
+            return m;
+        }
+
+        default:
+            csdie( "image has unknown tag" );
+            return val();
+    }
+}
+
+bool val::file_read_fd( int fd, char *& buff, uint64_t& len, uint64_t size_hint )
+{
+    size_t cap = (size_hint != 0) ? (size_hint + 1) : FILE_MAP_MIN;         // room for the read() that sees EOF
+    buff = reinterpret_cast<char *>( malloc( cap ) );
+    csassert( buff != nullptr, "file_read_fd() out of memory" );
+    len = 0;
+    for( ;; )
+    {
+        if ( len == cap ) {
+            cap *= 2;
+            char * new_buff = reinterpret_cast<char *>( realloc( buff, cap ) );
+            csassert( new_buff != nullptr, "file_read_fd() out of memory" );
+            buff = new_buff;
+        }
+        ssize_t cnt = ::read( fd, buff + len, cap - len );
+        if ( cnt == 0 ) return true;
+        if ( cnt < 0 ) {
+            if ( errno == EINTR ) continue;
+            ::free( buff );
+            buff = nullptr;
+            len = 0;
+            return false;
+        }
+        len += cnt;
+    }
+}
+
+val val::blob_copy( const void * data, uint64_t len )
+{
+    val v;
+    v.k = kind::BLOB;
+    v.u.bl = new Blob;
+    v.u.bl->ref_cnt  = 1;
+    v.u.bl->len      = len;
+    v.u.bl->map_addr = nullptr;
+    v.u.bl->map_len  = 0;
+    v.u.bl->owner    = nullptr;
+    char * buff = reinterpret_cast<char *>( malloc( len != 0 ? len : 1 ) );
+    csassert( buff != nullptr, "blob_copy() out of memory" );
+    memcpy( buff, data, len );
+    v.u.bl->data = buff;
+    return v;
+}
+
+val val::blob_part( const val& src, const char * data, uint64_t len )
+{
+    if ( src.k != kind::BLOB ) return blob_copy( data, len );
+    return src.slice( uint64_t( data - src.u.bl->data ), len );
+}
+
+inline void val::blob_free( Blob * blob )
+{
+    if ( blob->owner != nullptr ) {
+        if ( --blob->owner->ref_cnt == 0 ) blob_free( blob->owner );
+    } else if ( blob->map_addr != nullptr ) {
+        munmap( blob->map_addr, blob->map_len );
+    } else {
+        ::free( const_cast<char *>( blob->data ) );
+    }
+    delete blob;
+}
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// AUTOMATON REGEX
+//
+// Used for the regex overloads that take a regex val when the options include 'd'.
+// The pattern is parsed into an NFA program over bytes.  A search runs a lazily-built
+// DFA forward with leftmost-first cutoffs to find where the match ends, then a DFA for
+// the reversed program backward from there to find where it starts, then a Pike VM over
+// just the match when submatches are needed.  DFA states are built on first use and
+// kept per thread; transitions are indexed by byte class rather than byte.  When no
+// partial match is in flight, the forward scan skips to the next occurrence of the
+// pattern's literal prefix, if any, using memchr()/memmem().
+//
+// Patterns with backreferences, lookahead or other backtracking-only features, and the
+// basic POSIX, awk, grep and egrep grammars, fall back to std::regex.
+//
+// Overall matches are the same as std::regex's, but a group inside a repetition whose body 
+// can match empty, like (c*?)* or ((\b)*|(.))+, may capture differently, because engines 
+// differ on which iteration, possibly an empty one, sets it last.
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+struct val::Regex
+{
+    Regex( const std::string& pattern, const std::string& options );
+
+    std::unique_ptr<std::regex> std_re;                 // set when the automaton isn't used
+
+    val  match( const char * s, size_t len ) const;                                             // same as std::regex_match() version
+    val  replace( const char * s, size_t len, const std::string& fmt, uint64_t max ) const;     // same as std::regex_replace() version
+
+    enum class op : uint8_t
+    {
+        SET,                                            // consume byte in sets[x]
+        SPLIT,                                          // try x, then y
+        JMP,                                            // go to x
+        SAVE,                                           // record position in capture slot x
+        ASSERT,                                         // continue only if cond holds
+        MATCH,
+    };
+
+    enum class cond : uint8_t
+    {
+        BEGIN,
+        END,
+        WORD_BOUNDARY,
+        NOT_WORD_BOUNDARY,
+    };
+
+    struct Inst
+    {
+        op                      o;
+        cond                    c;
+        uint32_t                x;
+        uint32_t                y;
+    };
+
+    struct Node                                         // parse tree
+    {
+        enum class type : uint8_t { EMPTY, SET, CAT, ALT, REPEAT, GROUP, ASSERT };
+
+        type                    t      = type::EMPTY;
+        uint32_t                x      = 0;             // SET: set index; REPEAT: min; GROUP: capture index or NO_GROUP; ASSERT: cond
+        uint32_t                y      = 0;             // REPEAT: max or REPEAT_INF
+        bool                    greedy = true;
+        std::vector<Node>       kids;
+    };
+
+    struct Parser;
+    struct Dfa;
+    struct Dfas;                                        // the DFAs and submatch buffers one search uses
+
+    static const uint32_t       NO_GROUP    = 0xffffffff;
+    static const uint32_t       REPEAT_INF  = 0xffffffff;
+    static const uint32_t       REPEAT_MAX  = 1000;     // larger counts fall back to std::regex
+    static const size_t         INST_MAX    = 100000;
+    static const size_t         BACKTRACK_MAX = 256*1024;   // most (pc, position) pairs for backtracking rather than Pike VM
+    static const uint32_t       SEARCH_PC   = 0;        // fwd[0..3) is the unanchored .*? loop
+    static const uint32_t       ANCHORED_PC = 3;
+
+    bool                        icase     = false;
+    bool                        posix     = false;      // leftmost-longest rather than leftmost-first
+    uint32_t                    group_cnt = 1;          // includes group 0
+    std::vector<std::bitset<256>> sets;
+    std::vector<Inst>           fwd;
+    std::vector<Inst>           rev;                    // reversed, without SAVEs
+    uint8_t                     byte_class[256];
+    std::vector<uint8_t>        class_byte;             // a representative byte per class
+    std::string                 prefix;                 // literal that every match starts with
+    std::string                 inner;                  // longest literal found that every match contains
+
+    mutable std::mutex          idle_mtx;
+    mutable std::vector<std::unique_ptr<Dfas>> idle;    // DFAs not currently in use by any thread
+
+    bool compile( const std::string& pattern );
+    bool emit( std::vector<Inst>& prog, const Node& n, bool reverse ) const;
+    bool literal_prefix( const Node& n );
+    struct Lits                                         // literals every match of a node starts with, ends with, and contains
+    {
+        bool                    exact = false;          // node matches only this one string, so pre, suf and best are all it
+        std::string             pre;
+        std::string             suf;
+        std::string             best;
+    };
+    Lits literals( const Node& n ) const;
+    static constexpr bool is_word( uint8_t c )          { return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_'; }
+    static bool holds( cond c, bool at_begin, bool prev_word, bool at_end, bool next_word );
+    static void format( std::string& out, const std::string& fmt, const char * s, size_t len, size_t prev_end, const int64_t * caps, uint32_t group_cnt );
+    template<typename Find, typename FindNonEmpty>
+    static std::string replace_matches( const char * s, size_t len, const std::string& fmt, uint64_t max, uint32_t group_cnt, Find find, FindNonEmpty find_non_empty );
+
+    std::unique_ptr<Dfas> lease( void ) const;
+    void                  unlease( std::unique_ptr<Dfas> dfas ) const;
+    int64_t search_end( Dfa& dfa, const char * s, size_t len, size_t pos ) const;
+    int64_t search_start( Dfa& dfa, const char * s, size_t len, size_t pos, size_t end ) const;
+    int64_t longest_end( Dfa& dfa, const char * s, size_t len, size_t start ) const;
+    bool    find( Dfas& dfas, const char * s, size_t len, size_t pos, std::vector<int64_t>& caps ) const;
+    bool    submatches( Dfas& dfas, const char * s, size_t len, size_t start, int64_t must_end, bool not_null, std::vector<int64_t>& caps ) const;
+    bool    pike( Dfas& dfas, const char * s, size_t len, size_t start, int64_t must_end, bool not_null, std::vector<int64_t>& caps ) const;
+    bool    backtrack( Dfas& dfas, const char * s, size_t len, size_t start, int64_t must_end, bool not_null, std::vector<int64_t>& caps ) const;
+};
+
+struct val::Regex::Parser
+{
+    Regex&                      re;
+    const char *                p;
+    const char *                end;
+    bool                        ok = true;              // false once something unsupported is seen
+
+    Parser( Regex& _re, const std::string& pattern ) : re( _re ), p( pattern.data() ), end( pattern.data() + pattern.size() ) {}
+
+    Node                        alt( void );
+    Node                        cat( void );
+    Node                        atom( void );
+    bool                        quantifier( Node& n );
+    Node                        bracket( void );
+    bool                        escape( std::bitset<256>& set, bool in_bracket );
+    bool                        class_name( std::bitset<256>& set );
+    bool                        number( uint32_t& n );
+    Node                        set_node( std::bitset<256> set );
+};
+
+struct val::Regex::Dfa
+{
+    const Regex&                re;
+    const std::vector<Inst>&    prog;
+    bool                        cut;                    // drop lower-priority threads once one matches
+    uint32_t                    class_cnt;              // END is class_cnt
+    std::vector<std::vector<uint32_t>> pcs;             // per state: SET, ASSERT and MATCH pcs in priority order
+    std::vector<uint8_t>        flags;                  // per state: AT_BEGIN, PREV_WORD
+    std::vector<uint8_t>        is_search_start;        // per state: pcs are those of the unanchored start
+    std::vector<int32_t>        trans;                  // per state and class: (next << 1) | matched, or -1 if not built yet
+    std::unordered_map<std::string, int32_t> index;
+    std::vector<uint32_t>       search_start_pcs;
+    std::vector<uint64_t>       mark;                   // closure dedupe
+    uint64_t                    gen = 0;
+    std::vector<uint32_t>       stack;
+    std::vector<uint32_t>       tmp;
+
+    static const int32_t        DEAD      = 0;
+    static const uint8_t        AT_BEGIN  = 1;
+    static const uint8_t        PREV_WORD = 2;
+    static const size_t         STATE_MAX = 10000;      // cache is flushed when it gets this big
+
+    Dfa( const Regex& _re, const std::vector<Inst>& _prog, bool _cut );
+    void    flush( void );
+    int32_t start( uint32_t pc, uint8_t f );
+    int32_t step( int32_t& s, uint32_t c );             // may flush and so renumber s
+    int32_t intern( std::vector<uint32_t>& state_pcs, uint8_t f );
+    void    closure( uint32_t pc, bool asserts, bool at_begin, bool prev_word, bool at_end, bool next_word, std::vector<uint32_t>& out );
+    uint8_t flags_at( const char * s, size_t pos ) const { return uint8_t( ((pos == 0) ? AT_BEGIN : 0) | ((pos > 0 && is_word( s[pos-1] )) ? PREV_WORD : 0) ); }
+};
+
+struct val::Regex::Dfas
+{
+    struct Frame { uint32_t pc; int64_t slot; int64_t old; };  // Pike VM; slot >= 0 means restore cur[slot]
+
+    Dfa                         first;                  // forward, leftmost-first
+    Dfa                         all;                    // forward, every thread
+    Dfa                         rev;                    // backward, every thread
+
+    std::vector<uint32_t>       cpcs, npcs;             // Pike VM thread lists
+    std::vector<int64_t>        ccaps, ncaps;
+    std::vector<int64_t>        cur;
+    std::vector<uint64_t>       mark;
+    uint64_t                    gen = 0;
+    std::vector<Frame>          stack;
+    std::vector<uint64_t>       visited;                // backtracker's (pc, position) bitmap
+
+    Dfas( const Regex& re ) : first( re, re.fwd, true ), all( re, re.fwd, false ), rev( re, re.rev, false ), 
+                              cur( 2*re.group_cnt, -1 ), mark( re.fwd.size(), 0 ) {}
+};
+
+inline val::Regex::Regex( const std::string& pattern, const std::string& options )
+{
+    bool automaton   = false;
+    bool std_grammar = false;
+    for( char ch : options )
+    {
+        switch( ch )
+        {
+            case 'd': automaton = true;         break;
+            case 'i': icase = true;             break;
+            case 'P': posix = true;             break;
+            case 'p':
+            case 'a':
+            case 'g':
+            case 'G': std_grammar = true;       break;
+            default:                            break;  // regex() complains about bad ones
+        }
+    }
+    if ( automaton && !std_grammar && compile( pattern ) ) return;
+
+    std_re.reset( new std::regex( val( pattern ).regex( options ) ) );
+}
+
+inline bool val::Regex::compile( const std::string& pattern )
+{
+    Parser parser( *this, pattern );
+    Node root = parser.alt();
+    if ( !parser.ok || parser.p != parser.end ) return false;
+
+    // fwd: .*? loop, then the regex wrapped in group 0
+    sets.push_back( std::bitset<256>().set() );
+    fwd.push_back( Inst{ op::SPLIT, cond::BEGIN, ANCHORED_PC, 1 } );
+    fwd.push_back( Inst{ op::SET,   cond::BEGIN, uint32_t( sets.size()-1 ), 0 } );
+    fwd.push_back( Inst{ op::JMP,   cond::BEGIN, SEARCH_PC, 0 } );
+    fwd.push_back( Inst{ op::SAVE,  cond::BEGIN, 0, 0 } );
+    if ( !emit( fwd, root, false ) ) return false;
+    fwd.push_back( Inst{ op::SAVE,  cond::BEGIN, 1, 0 } );
+    fwd.push_back( Inst{ op::MATCH, cond::BEGIN, 0, 0 } );
+    if ( !emit( rev, root, true ) ) return false;
+    rev.push_back( Inst{ op::MATCH, cond::BEGIN, 0, 0 } );
+
+    // byte classes: bytes that every set, and \b, treats alike share a class
+    std::bitset<256> word;
+    for( uint32_t b = 0; b < 256; b++ ) word[b] = is_word( uint8_t( b ) );
+    memset( byte_class, 0, sizeof( byte_class ) );
+    uint32_t class_cnt = 1;
+    auto refine = [&]( const std::bitset<256>& set )
+    {
+        int32_t remap[2][256];
+        memset( remap, -1, sizeof( remap ) );
+        uint32_t cnt = 0;
+        for( uint32_t b = 0; b < 256; b++ )
+        {
+            int32_t& to = remap[set[b]][byte_class[b]];
+            if ( to < 0 ) to = int32_t( cnt++ );
+            byte_class[b] = uint8_t( to );
+        }
+        class_cnt = cnt;
+    };
+    refine( word );
+    for( const auto& set : sets )
+    {
+        if ( class_cnt == 256 ) break;
+        refine( set );
+    }
+    class_byte.resize( class_cnt );
+    for( uint32_t b = 256; b-- > 0; ) class_byte[byte_class[b]] = uint8_t( b );
+
+    literal_prefix( root );
+    inner = literals( root ).best;
+    return true;
+}
+
+//--------------------------------------------------------------------------------------
+// Parser - ECMAScript syntax, plus [:name:] classes; sets ok=false for anything
+// the automaton doesn't do
+//--------------------------------------------------------------------------------------
+inline val::Regex::Node val::Regex::Parser::alt( void )
+{
+    Node first = cat();
+    if ( p == end || *p != '|' ) return first;
+    Node n;
+    n.t = Node::type::ALT;
+    n.kids.push_back( std::move( first ) );
+    while( ok && p != end && *p == '|' )
+    {
+        p++;
+        n.kids.push_back( cat() );
+    }
+    return n;
+}
+
+inline val::Regex::Node val::Regex::Parser::cat( void )
+{
+    Node n;
+    n.t = Node::type::CAT;
+    while( ok && p != end && *p != '|' && *p != ')' )
+    {
+        Node a = atom();
+        if ( !ok ) break;
+        if ( a.t == Node::type::ASSERT ) {
+            if ( p != end && (*p == '*' || *p == '+' || *p == '?' || *p == '{') ) ok = false;
+        } else {
+            while( ok && p != end && (*p == '*' || *p == '+' || *p == '?' || *p == '{') )
+            {
+                if ( !quantifier( a ) ) ok = false;
+                if ( re.posix ) break;
+            }
+        }
+        n.kids.push_back( std::move( a ) );
+    }
+    return n;
+}
+
+inline bool val::Regex::Parser::quantifier( Node& n )
+{
+    uint32_t min = 0;
+    uint32_t max = REPEAT_INF;
+    switch( *p++ )
+    {
+        case '*':                               break;
+        case '+': min = 1;                      break;
+        case '?': max = 1;                      break;
+        case '{':
+            if ( !number( min ) ) return false;
+            max = min;
+            if ( p != end && *p == ',' ) {
+                p++;
+                max = REPEAT_INF;
+                if ( p != end && *p != '}' && !number( max ) ) return false;
+            }
+            if ( p == end || *p++ != '}' || min > max || min > REPEAT_MAX || (max != REPEAT_INF && max > REPEAT_MAX) ) return false;
+            break;
+
+        default:                                return false;
+    }
+    Node r;
+    r.t = Node::type::REPEAT;
+    r.x = min;
+    r.y = max;
+    if ( p != end && *p == '?' ) {
+        if ( re.posix ) return false;
+        r.greedy = false;
+        p++;
+    }
+    if ( p != end && (*p == '*' || *p == '+' || *p == '?' || *p == '{') ) return false;    // std::regex rejects these
+    r.kids.push_back( std::move( n ) );
+    n = std::move( r );
+    return true;
+}
+
+inline bool val::Regex::Parser::number( uint32_t& n )
+{
+    if ( p == end || *p < '0' || *p > '9' ) return false;
+    n = 0;
+    while( p != end && *p >= '0' && *p <= '9' )
+    {
+        n = n*10 + uint32_t( *p++ - '0' );
+        if ( n > REPEAT_MAX ) return false;
+    }
+    return true;
+}
+
+inline val::Regex::Node val::Regex::Parser::set_node( std::bitset<256> set )
+{
+    if ( re.icase ) {
+        for( uint32_t b = 'a'; b <= 'z'; b++ )
+        {
+            if ( set[b] || set[b - 'a' + 'A'] ) set[b] = set[b - 'a' + 'A'] = true;
+        }
+    }
+    Node n;
+    n.t = Node::type::SET;
+    n.x = uint32_t( re.sets.size() );
+    re.sets.push_back( set );
+    return n;
+}
+
+inline val::Regex::Node val::Regex::Parser::atom( void )
+{
+    Node n;
+    std::bitset<256> set;
+    char ch = *p++;
+    switch( ch )
+    {
+        case '(':
+        {
+            uint32_t group = re.group_cnt++;
+            if ( p != end && *p == '?' ) {
+                if ( re.posix || p+1 == end || p[1] != ':' ) { ok = false; return n; }    // lookahead
+                p += 2;
+                group = NO_GROUP;
+                re.group_cnt--;
+            }
+            Node inner = alt();
+            if ( p == end || *p++ != ')' ) { ok = false; return n; }
+            n.t = Node::type::GROUP;
+            n.x = group;
+            n.kids.push_back( std::move( inner ) );
+            return n;
+        }
+
+        case '[':
+            return bracket();
+
+        case '.':
+            set.set();
+            if ( re.posix ) {
+                set[0] = false;
+            } else {
+                set['\n'] = false;
+                set['\r'] = false;
+            }
+            return set_node( set );
+
+        case '^':
+        case '$':
+            n.t = Node::type::ASSERT;
+            n.x = uint32_t( (ch == '^') ? cond::BEGIN : cond::END );
+            return n;
+
+        case '\\':
+            if ( p == end ) { ok = false; return n; }
+            if ( re.posix && isalnum( uint8_t( *p ) ) ) { ok = false; return n; }
+            if ( *p == 'b' || *p == 'B' ) {
+                n.t = Node::type::ASSERT;
+                n.x = uint32_t( (*p++ == 'b') ? cond::WORD_BOUNDARY : cond::NOT_WORD_BOUNDARY );
+                return n;
+            }
+            if ( !escape( set, false ) ) { ok = false; return n; }
+            return set_node( set );
+
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case '}':
+        case ']':
+            ok = false;                                 // let std::regex decide what these mean
+            return n;
+
+        default:
+            set[uint8_t( ch )] = true;
+            return set_node( set );
+    }
+}
+
+inline bool val::Regex::Parser::escape( std::bitset<256>& set, bool in_bracket )
+{
+    auto hex = [&]( uint32_t digit_cnt, uint32_t& x )
+    {
+        x = 0;
+        for( uint32_t i = 0; i < digit_cnt; i++ )
+        {
+            if ( p == end || !isxdigit( uint8_t( *p ) ) ) return false;
+            char d = char( tolower( *p++ ) );
+            x = x*16 + uint32_t( (d <= '9') ? (d - '0') : (d - 'a' + 10) );
+        }
+        return true;
+    };
+
+    char ch = *p++;
+    uint32_t x;
+    switch( ch )
+    {
+        case 'd': for( uint32_t b = '0'; b <= '9'; b++ ) set[b] = true;                                 return true;
+        case 'D': for( uint32_t b = 0; b < 256; b++ ) if ( b < '0' || b > '9' ) set[b] = true;          return true;
+        case 'w': for( uint32_t b = 0; b < 256; b++ ) if ( is_word( uint8_t( b ) ) ) set[b] = true;     return true;
+        case 'W': for( uint32_t b = 0; b < 256; b++ ) if ( !is_word( uint8_t( b ) ) ) set[b] = true;    return true;
+        case 's': for( char c : std::string( " \t\n\v\f\r" ) ) set[uint8_t( c )] = true;                return true;
+        case 'S': set.set(); for( char c : std::string( " \t\n\v\f\r" ) ) set[uint8_t( c )] = false;    return true;
+        case 'f': set['\f'] = true;                                                                     return true;
+        case 'n': set['\n'] = true;                                                                     return true;
+        case 'r': set['\r'] = true;                                                                     return true;
+        case 't': set['\t'] = true;                                                                     return true;
+        case 'v': set['\v'] = true;                                                                     return true;
+        case '0': set[0] = true;                                                                        return true;
+        case 'b': if ( !in_bracket ) return false; set['\b'] = true;                                    return true;
+        case 'x': if ( !hex( 2, x ) ) return false; set[x] = true;                                      return true;
+        case 'u': if ( !hex( 4, x ) || x > 0xff ) return false; set[x] = true;                          return true;
+        case 'c':
+            if ( p == end || !isalpha( uint8_t( *p ) ) ) return false;
+            set[uint8_t( *p++ ) % 32] = true;
+            return true;
+
+        default:
+            if ( isalnum( uint8_t( ch ) ) ) return false;       // backreference or something else we don't do
+            set[uint8_t( ch )] = true;
+            return true;
+    }
+}
+
+inline bool val::Regex::Parser::class_name( std::bitset<256>& set )
+{
+    // p is just past "[:"
+    const char * name = p;
+    while( p != end && *p != ':' ) p++;
+    if ( p+1 >= end || p[1] != ']' ) return false;
+    std::string n( name, p );
+    p += 2;
+    static const char * const names[] = { "alnum", "alpha", "blank", "cntrl", "digit", "d", "graph", "lower", 
+                                          "print", "punct", "space", "s", "upper", "xdigit", "w" };
+    if ( std::find( std::begin( names ), std::end( names ), n ) == std::end( names ) ) return false; // unknown; std::regex rejects it
+    for( uint32_t b = 0; b < 256; b++ )
+    {
+        int c = int( b );
+        int in  = (n == "alnum")  ? isalnum( c )  : (n == "alpha")  ? isalpha( c )  : (n == "blank") ? (c == ' ' || c == '\t') :
+                  (n == "cntrl")  ? iscntrl( c )  : (n == "digit" || n == "d") ? isdigit( c ) : (n == "graph") ? isgraph( c ) :
+                  (n == "lower")  ? islower( c )  : (n == "print")  ? isprint( c )  : (n == "punct") ? ispunct( c ) :
+                  (n == "space" || n == "s") ? isspace( c ) : (n == "upper") ? isupper( c ) : (n == "xdigit") ? isxdigit( c ) :
+                  is_word( uint8_t( b ) );
+        if ( in != 0 ) set[b] = true;
+    }
+    return true;
+}
+
+inline val::Regex::Node val::Regex::Parser::bracket( void )
+{
+    // p is just past '['
+    std::bitset<256> set;
+    bool negate = p != end && *p == '^';
+    if ( negate ) p++;
+    if ( p != end && *p == ']' ) {                      // "[]" and "[^]" differ between grammars
+        ok = false;
+        return Node();
+    }
+    while( ok && p != end && *p != ']' )
+    {
+        // one item: a class name, an escape, or a single byte that may start a range
+        std::bitset<256> item;
+        int32_t lo = -1;
+        if ( *p == '[' && p+1 != end && p[1] == ':' ) {
+            p += 2;
+            ok = class_name( item );
+        } else if ( *p == '[' && p+1 != end && (p[1] == '.' || p[1] == '=') ) {
+            ok = false;                                 // collating elements
+        } else if ( *p == '\\' && !re.posix ) {
+            p++;
+            ok = p != end && escape( item, true );
+            if ( ok && item.count() == 1 ) {
+                for( uint32_t b = 0; b < 256; b++ ) if ( item[b] ) lo = int32_t( b );
+            }
+        } else {
+            lo = uint8_t( *p++ );
+            item[lo] = true;
+        }
+
+        if ( ok && p+1 < end && *p == '-' && p[1] != ']' ) {
+            // range
+            p++;
+            std::bitset<256> hi_item;
+            int32_t hi = -1;
+            if ( *p == '\\' && !re.posix ) {
+                p++;
+                ok = p != end && escape( hi_item, true ) && hi_item.count() == 1;
+                if ( ok ) for( uint32_t b = 0; b < 256; b++ ) if ( hi_item[b] ) hi = int32_t( b );
+            } else if ( *p == '[' ) {
+                ok = false;
+            } else {
+                hi = uint8_t( *p++ );
+            }
+            if ( !ok || lo < 0 || hi < lo ) {
+                ok = false;
+                break;
+            }
+            for( int32_t b = lo; b <= hi; b++ ) item[b] = true;
+        }
+        set |= item;
+    }
+    if ( p == end ) ok = false;
+    if ( !ok ) return Node();
+    p++;
+
+    if ( re.icase ) {
+        for( uint32_t b = 'a'; b <= 'z'; b++ )
+        {
+            if ( set[b] || set[b - 'a' + 'A'] ) set[b] = set[b - 'a' + 'A'] = true;
+        }
+    }
+    if ( negate ) set.flip();
+    return set_node( set );
+}
+
+//--------------------------------------------------------------------------------------
+// Compilation
+//--------------------------------------------------------------------------------------
+inline bool val::Regex::emit( std::vector<Inst>& prog, const Node& n, bool reverse ) const
+{
+    if ( prog.size() > INST_MAX ) return false;
+
+    switch( n.t )
+    {
+        case Node::type::EMPTY:
+            return true;
+
+        case Node::type::SET:
+            prog.push_back( Inst{ op::SET, cond::BEGIN, n.x, 0 } );
+            return true;
+
+        case Node::type::ASSERT:
+        {
+            cond c = cond( n.x );
+            if ( reverse && c == cond::BEGIN ) {
+                c = cond::END;
+            } else if ( reverse && c == cond::END ) {
+                c = cond::BEGIN;
+            }
+            prog.push_back( Inst{ op::ASSERT, c, 0, 0 } );
+            return true;
+        }
+
+        case Node::type::CAT:
+            for( size_t i = 0; i < n.kids.size(); i++ )
+            {
+                if ( !emit( prog, n.kids[reverse ? (n.kids.size()-1-i) : i], reverse ) ) return false;
+            }
+            return true;
+
+        case Node::type::GROUP:
+            if ( n.x != NO_GROUP && !reverse ) prog.push_back( Inst{ op::SAVE, cond::BEGIN, 2*n.x, 0 } );
+            if ( !emit( prog, n.kids[0], reverse ) ) return false;
+            if ( n.x != NO_GROUP && !reverse ) prog.push_back( Inst{ op::SAVE, cond::BEGIN, 2*n.x+1, 0 } );
+            return true;
+
+        case Node::type::ALT:
+        {
+            std::vector<size_t> jmps;
+            for( size_t i = 0; i < n.kids.size(); i++ )
+            {
+                size_t split = prog.size();
+                if ( i+1 < n.kids.size() ) prog.push_back( Inst{ op::SPLIT, cond::BEGIN, uint32_t( split+1 ), 0 } );
+                if ( !emit( prog, n.kids[i], reverse ) ) return false;
+                if ( i+1 < n.kids.size() ) {
+                    jmps.push_back( prog.size() );
+                    prog.push_back( Inst{ op::JMP, cond::BEGIN, 0, 0 } );
+                    prog[split].y = uint32_t( prog.size() );
+                }
+            }
+            for( size_t j : jmps ) prog[j].x = uint32_t( prog.size() );
+            return true;
+        }
+
+        case Node::type::REPEAT:
+        {
+            const Node& kid = n.kids[0];
+            for( uint32_t i = 0; i < n.x; i++ )
+            {
+                if ( !emit( prog, kid, reverse ) ) return false;
+            }
+            if ( n.y == REPEAT_INF ) {
+                // L: split body, out; body: kid; jmp L; out:
+                uint32_t split = uint32_t( prog.size() );
+                prog.push_back( Inst{ op::SPLIT, cond::BEGIN, 0, 0 } );
+                if ( !emit( prog, kid, reverse ) ) return false;
+                prog.push_back( Inst{ op::JMP, cond::BEGIN, split, 0 } );
+                uint32_t out = uint32_t( prog.size() );
+                prog[split].x = n.greedy ? split+1 : out;
+                prog[split].y = n.greedy ? out : split+1;
+            } else {
+                // nested optional copies, each of which can skip to the end
+                std::vector<uint32_t> splits;
+                for( uint32_t i = n.x; i < n.y; i++ )
+                {
+                    splits.push_back( uint32_t( prog.size() ) );
+                    prog.push_back( Inst{ op::SPLIT, cond::BEGIN, 0, 0 } );
+                    if ( !emit( prog, kid, reverse ) ) return false;
+                }
+                uint32_t out = uint32_t( prog.size() );
+                for( uint32_t split : splits )
+                {
+                    prog[split].x = n.greedy ? split+1 : out;
+                    prog[split].y = n.greedy ? out : split+1;
+                }
+            }
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+inline bool val::Regex::literal_prefix( const Node& n )
+{
+    // appends the literal that n must start with; returns true if that's all of n
+    switch( n.t )
+    {
+        case Node::type::EMPTY:
+            return true;
+
+        case Node::type::SET:
+            if ( sets[n.x].count() != 1 ) return false;
+            for( uint32_t b = 0; b < 256; b++ ) if ( sets[n.x][b] ) prefix += char( b );
+            return true;
+
+        case Node::type::CAT:
+            for( const Node& kid : n.kids )
+            {
+                if ( !literal_prefix( kid ) ) return false;
+            }
+            return true;
+
+        case Node::type::GROUP:
+            return literal_prefix( n.kids[0] );
+
+        case Node::type::REPEAT:
+            if ( n.x == 0 ) return false;
+            return literal_prefix( n.kids[0] ) && n.x == 1 && n.y == 1;
+
+        default:
+            return false;
+    }
+}
+
+inline val::Regex::Lits val::Regex::literals( const Node& n ) const
+{
+    Lits r;
+    switch( n.t )
+    {
+        case Node::type::EMPTY:
+        case Node::type::ASSERT:
+            r.exact = true;
+            return r;
+
+        case Node::type::SET:
+            if ( sets[n.x].count() != 1 ) return r;
+            for( uint32_t b = 0; b < 256; b++ ) if ( sets[n.x][b] ) r.pre = std::string( 1, char( b ) );
+            r.exact = true;
+            r.suf = r.best = r.pre;
+            return r;
+
+        case Node::type::GROUP:
+            return literals( n.kids[0] );
+
+        case Node::type::REPEAT:
+            // every repetition still starts, ends and contains the same
+            if ( n.x == 0 ) return r;
+            r = literals( n.kids[0] );
+            if ( n.x != 1 || n.y != 1 ) r.exact = false;
+            return r;
+
+        case Node::type::CAT:
+            r.exact = true;
+            for( const Node& kid : n.kids )
+            {
+                Lits k = literals( kid );
+                std::string across = r.suf + k.pre;
+                if ( r.exact ) r.pre += k.pre;
+                r.suf = k.exact ? (r.suf + k.suf) : k.suf;
+                r.exact = r.exact && k.exact;
+                for( const std::string * lit : { &k.best, &across, &r.suf } ) if ( lit->size() > r.best.size() ) r.best = *lit;
+            }
+            return r;
+
+        default:
+            return r;                                   // ALT: nothing shared is worked out
+    }
+}
+
+inline bool val::Regex::holds( cond c, bool at_begin, bool prev_word, bool at_end, bool next_word )
+{
+    switch( c )
+    {
+        case cond::BEGIN:               return at_begin;
+        case cond::END:                 return at_end;
+        case cond::WORD_BOUNDARY:       return prev_word != next_word;
+        case cond::NOT_WORD_BOUNDARY:   return prev_word == next_word;
+        default:                        return false;
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Lazy DFA
+//--------------------------------------------------------------------------------------
+inline val::Regex::Dfa::Dfa( const Regex& _re, const std::vector<Inst>& _prog, bool _cut )
+    : re( _re ), prog( _prog ), cut( _cut ), class_cnt( uint32_t( _re.class_byte.size() ) ), mark( _prog.size(), 0 )
+{
+    if ( &prog == &re.fwd ) {
+        gen++;
+        closure( SEARCH_PC, false, false, false, false, false, search_start_pcs );
+    }
+    flush();
+}
+
+inline void val::Regex::Dfa::flush( void )
+{
+    pcs.clear();
+    flags.clear();
+    is_search_start.clear();
+    trans.clear();
+    index.clear();
+    pcs.push_back( std::vector<uint32_t>() );           // DEAD
+    flags.push_back( 0 );
+    is_search_start.push_back( 0 );
+    trans.resize( class_cnt+1, DEAD << 1 );
+}
+
+inline void val::Regex::Dfa::closure( uint32_t pc, bool asserts, bool at_begin, bool prev_word, bool at_end, bool next_word,
+                                      std::vector<uint32_t>& out )
+{
+    // depth-first so that out stays in priority order; without asserts, ASSERT pcs are left in out to be resolved later
+    stack.push_back( pc );
+    while( !stack.empty() )
+    {
+        pc = stack.back();
+        stack.pop_back();
+        if ( mark[pc] == gen ) continue;
+        mark[pc] = gen;
+        const Inst& in = prog[pc];
+        switch( in.o )
+        {
+            case op::JMP:       stack.push_back( in.x );                                        break;
+            case op::SPLIT:     stack.push_back( in.y ); stack.push_back( in.x );               break;
+            case op::SAVE:      stack.push_back( pc+1 );                                        break;
+            case op::ASSERT:
+                if ( !asserts ) {
+                    out.push_back( pc );
+                } else if ( holds( in.c, at_begin, prev_word, at_end, next_word ) ) {
+                    stack.push_back( pc+1 );
+                }
+                break;
+            case op::SET:
+            case op::MATCH:
+            default:            out.push_back( pc );                                            break;
+        }
+    }
+}
+
+inline int32_t val::Regex::Dfa::intern( std::vector<uint32_t>& state_pcs, uint8_t f )
+{
+    if ( state_pcs.empty() ) return DEAD;
+    std::string key( reinterpret_cast<const char *>( state_pcs.data() ), state_pcs.size() * sizeof( uint32_t ) );
+    key += char( f );
+    auto it = index.find( key );
+    if ( it != index.end() ) return it->second;
+
+    int32_t s = int32_t( pcs.size() );
+    index[key] = s;
+    is_search_start.push_back( state_pcs == search_start_pcs );
+    pcs.push_back( state_pcs );
+    flags.push_back( f );
+    trans.resize( trans.size() + class_cnt+1, -1 );
+    return s;
+}
+
+inline int32_t val::Regex::Dfa::start( uint32_t pc, uint8_t f )
+{
+    if ( pcs.size() >= STATE_MAX ) flush();
+    tmp.clear();
+    gen++;
+    closure( pc, false, false, false, false, false, tmp );
+    return intern( tmp, f );
+}
+
+inline int32_t val::Regex::Dfa::step( int32_t& s, uint32_t c )
+{
+    int32_t t = trans[size_t( s ) * (class_cnt+1) + c];
+    if ( t >= 0 ) return t;
+
+    if ( pcs.size() >= STATE_MAX ) {
+        std::vector<uint32_t> s_pcs = pcs[s];
+        uint8_t s_flags = flags[s];
+        flush();
+        s = intern( s_pcs, s_flags );
+    }
+
+    // resolve assertions now that the next byte is known, then advance the threads that accept it
+    bool at_end    = c == class_cnt;
+    bool next_word = !at_end && is_word( re.class_byte[c] );
+    bool at_begin  = (flags[s] & AT_BEGIN) != 0;
+    bool prev_word = (flags[s] & PREV_WORD) != 0;
+    std::vector<uint32_t> list;
+    gen++;
+    for( uint32_t pc : pcs[s] ) closure( pc, true, at_begin, prev_word, at_end, next_word, list );
+
+    bool matched = false;
+    std::vector<uint32_t> next_pcs;
+    gen++;
+    for( uint32_t pc : list )
+    {
+        const Inst& in = prog[pc];
+        if ( in.o == op::MATCH ) {
+            matched = true;
+            if ( cut ) break;
+        } else if ( !at_end && re.sets[in.x][re.class_byte[c]] ) {
+            closure( pc+1, false, false, false, false, false, next_pcs );
+        }
+    }
+    int32_t next = at_end ? DEAD : intern( next_pcs, next_word ? PREV_WORD : 0 );
+    t = (next << 1) | int32_t( matched );
+    trans[size_t( s ) * (class_cnt+1) + c] = t;
+    return t;
+}
+
+//--------------------------------------------------------------------------------------
+// Searches
+//--------------------------------------------------------------------------------------
+inline std::unique_ptr<val::Regex::Dfas> val::Regex::lease( void ) const
+{
+    {
+        std::lock_guard<std::mutex> lock( idle_mtx );
+        if ( !idle.empty() ) {
+            std::unique_ptr<Dfas> dfas = std::move( idle.back() );
+            idle.pop_back();
+            return dfas;
+        }
+    }
+    return std::unique_ptr<Dfas>( new Dfas( *this ) );
+}
+
+inline void val::Regex::unlease( std::unique_ptr<Dfas> dfas ) const
+{
+    std::lock_guard<std::mutex> lock( idle_mtx );
+    idle.push_back( std::move( dfas ) );
+}
+
+inline int64_t val::Regex::search_end( Dfa& dfa, const char * s, size_t len, size_t pos ) const
+{
+    // end of leftmost-first match at or after pos, or -1
+    int32_t st = dfa.start( SEARCH_PC, dfa.flags_at( s, pos ) );
+    int64_t last = -1;
+    for( size_t i = pos; ; i++ )
+    {
+        if ( dfa.is_search_start[st] && !prefix.empty() && i < len ) {
+            // nothing in flight, so skip to where the next match could start
+            const char * found = (prefix.size() == 1) ? static_cast<const char *>( memchr( s+i, prefix[0], len-i ) )
+                                                      : static_cast<const char *>( memmem( s+i, len-i, prefix.data(), prefix.size() ) );
+            if ( found == nullptr ) return last;
+            if ( size_t( found - s ) != i ) {
+                i = size_t( found - s );
+                st = dfa.start( SEARCH_PC, dfa.flags_at( s, i ) );
+            }
+        }
+        int32_t t = dfa.step( st, (i < len) ? byte_class[uint8_t( s[i] )] : dfa.class_cnt );
+        if ( t & 1 ) last = int64_t( i );
+        st = t >> 1;
+        if ( i == len || st == Dfa::DEAD ) return last;
+    }
+}
+
+inline int64_t val::Regex::search_start( Dfa& dfa, const char * s, size_t len, size_t pos, size_t end ) const
+{
+    // start of longest match of the reversed program ending at end and starting at or after pos
+    uint8_t f = uint8_t( ((end == len) ? Dfa::AT_BEGIN : 0) | ((end < len && is_word( s[end] )) ? Dfa::PREV_WORD : 0) );
+    int32_t st = dfa.start( 0, f );
+    int64_t first = -1;
+    for( size_t i = end; ; i-- )
+    {
+        int32_t t = dfa.step( st, (i > 0) ? byte_class[uint8_t( s[i-1] )] : dfa.class_cnt );
+        if ( t & 1 ) first = int64_t( i );
+        st = t >> 1;
+        if ( i == pos || st == Dfa::DEAD ) return first;
+    }
+}
+
+inline int64_t val::Regex::longest_end( Dfa& dfa, const char * s, size_t len, size_t start ) const
+{
+    int32_t st = dfa.start( ANCHORED_PC, dfa.flags_at( s, start ) );
+    int64_t last = -1;
+    for( size_t i = start; ; i++ )
+    {
+        int32_t t = dfa.step( st, (i < len) ? byte_class[uint8_t( s[i] )] : dfa.class_cnt );
+        if ( t & 1 ) last = int64_t( i );
+        st = t >> 1;
+        if ( i == len || st == Dfa::DEAD ) return last;
+    }
+}
+
+inline bool val::Regex::submatches( Dfas& dfas, const char * s, size_t len, size_t start, int64_t must_end, bool not_null, std::vector<int64_t>& caps ) const
+{
+    // leftmost-first, or highest priority ending at must_end if that's >= 0;
+    // backtracking with a visited bitmap is faster for short spans, and is linear too
+    size_t span = ((must_end >= 0) ? size_t( must_end ) : len) - start + 1;
+    if ( span * fwd.size() <= BACKTRACK_MAX ) return backtrack( dfas, s, len, start, must_end, not_null, caps );
+    return pike( dfas, s, len, start, must_end, not_null, caps );
+}
+
+inline bool val::Regex::backtrack( Dfas& dfas, const char * s, size_t len, size_t start, int64_t must_end, bool not_null, std::vector<int64_t>& caps ) const
+{
+    // depth-first in priority order, so the first MATCH accepted is the one wanted; a (pc, position) already
+    // visited by a higher-priority path can't lead anywhere new
+    using Frame = Dfas::Frame;
+    size_t limit = (must_end >= 0) ? size_t( must_end ) : len;
+    size_t span  = limit - start + 1;
+    std::vector<uint64_t>& visited = dfas.visited;
+    visited.assign( (span * fwd.size() + 63) / 64, 0 );
+    std::vector<int64_t>& cur = dfas.cur;
+    std::fill( cur.begin(), cur.end(), -1 );
+    std::vector<Frame>& stack = dfas.stack;
+    stack.clear();
+    stack.push_back( Frame{ ANCHORED_PC, -1, int64_t( start ) } );     // old holds the position for jobs
+    while( !stack.empty() )
+    {
+        Frame f = stack.back();
+        stack.pop_back();
+        if ( f.slot >= 0 ) {
+            cur[f.slot] = f.old;
+            continue;
+        }
+        uint32_t pc = f.pc;
+        size_t   i  = size_t( f.old );
+        for( ;; )
+        {
+            size_t bit = (i - start) * fwd.size() + pc;
+            if ( visited[bit >> 6] & (uint64_t( 1 ) << (bit & 63)) ) break;
+            visited[bit >> 6] |= uint64_t( 1 ) << (bit & 63);
+
+            const Inst& in = fwd[pc];
+            if ( in.o == op::SET ) {
+                if ( i == limit || !sets[in.x][uint8_t( s[i] )] ) break;
+                pc++;
+                i++;
+            } else if ( in.o == op::SPLIT ) {
+                stack.push_back( Frame{ in.y, -1, int64_t( i ) } );
+                pc = in.x;
+            } else if ( in.o == op::JMP ) {
+                pc = in.x;
+            } else if ( in.o == op::SAVE ) {
+                stack.push_back( Frame{ 0, in.x, cur[in.x] } );
+                cur[in.x] = int64_t( i );
+                pc++;
+            } else if ( in.o == op::ASSERT ) {
+                if ( !holds( in.c, i == 0, i > 0 && is_word( s[i-1] ), i == len, i < len && is_word( s[i] ) ) ) break;
+                pc++;
+            } else {
+                if ( (not_null && i == start) || (must_end >= 0 && i != limit) ) break;
+                caps = cur;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline bool val::Regex::pike( Dfas& dfas, const char * s, size_t len, size_t start, int64_t must_end, bool not_null, std::vector<int64_t>& caps ) const
+{
+    // leftmost-first, or highest priority ending at must_end if that's >= 0
+    using Frame = Dfas::Frame;
+    size_t nslots = 2 * group_cnt;
+    std::vector<uint32_t>& cpcs  = dfas.cpcs;
+    std::vector<uint32_t>& npcs  = dfas.npcs;
+    std::vector<int64_t>&  ccaps = dfas.ccaps;
+    std::vector<int64_t>&  ncaps = dfas.ncaps;
+    std::vector<int64_t>&  cur   = dfas.cur;
+    std::vector<uint64_t>& mark  = dfas.mark;
+    uint64_t&              gen   = dfas.gen;
+    std::vector<Frame>&    stack = dfas.stack;
+    cpcs.clear();
+    ccaps.clear();
+    std::fill( cur.begin(), cur.end(), -1 );
+
+    auto add = [&]( std::vector<uint32_t>& pcs, std::vector<int64_t>& pcaps, uint32_t pc0, size_t i )
+    {
+        bool at_begin  = i == 0;
+        bool prev_word = i > 0 && is_word( s[i-1] );
+        bool at_end    = i == len;
+        bool next_word = i < len && is_word( s[i] );
+        stack.push_back( Frame{ pc0, -1, 0 } );
+        while( !stack.empty() )
+        {
+            Frame f = stack.back();
+            stack.pop_back();
+            if ( f.slot >= 0 ) {
+                cur[f.slot] = f.old;
+                continue;
+            }
+            uint32_t pc = f.pc;
+            if ( mark[pc] == gen ) continue;
+            mark[pc] = gen;
+            const Inst& in = fwd[pc];
+            switch( in.o )
+            {
+                case op::JMP:       stack.push_back( Frame{ in.x, -1, 0 } );                                        break;
+                case op::SPLIT:     stack.push_back( Frame{ in.y, -1, 0 } ); stack.push_back( Frame{ in.x, -1, 0 } ); break;
+                case op::SAVE:
+                    stack.push_back( Frame{ 0, in.x, cur[in.x] } );
+                    cur[in.x] = int64_t( i );
+                    stack.push_back( Frame{ pc+1, -1, 0 } );
+                    break;
+                case op::ASSERT:
+                    if ( holds( in.c, at_begin, prev_word, at_end, next_word ) ) stack.push_back( Frame{ pc+1, -1, 0 } );
+                    break;
+                case op::SET:
+                case op::MATCH:
+                default:
+                    pcs.push_back( pc );
+                    pcaps.insert( pcaps.end(), cur.begin(), cur.end() );
+                    break;
+            }
+        }
+    };
+
+    bool found = false;
+    gen++;
+    add( cpcs, ccaps, ANCHORED_PC, start );
+    for( size_t i = start; !cpcs.empty(); i++ )
+    {
+        gen++;
+        npcs.clear();
+        ncaps.clear();
+        for( size_t t = 0; t < cpcs.size(); t++ )
+        {
+            const Inst& in = fwd[cpcs[t]];
+            if ( in.o == op::MATCH ) {
+                if ( (not_null && i == start) || (must_end >= 0 && int64_t( i ) != must_end) ) continue;
+                caps.assign( ccaps.begin() + t*nslots, ccaps.begin() + (t+1)*nslots );
+                found = true;
+                if ( must_end >= 0 ) return true;
+                break;
+            }
+            if ( i < len && sets[in.x][uint8_t( s[i] )] ) {
+                std::copy( ccaps.begin() + t*nslots, ccaps.begin() + (t+1)*nslots, cur.begin() );
+                add( npcs, ncaps, cpcs[t]+1, i+1 );
+            }
+        }
+        if ( i == len || (must_end >= 0 && int64_t( i ) >= must_end) ) break;
+        std::swap( cpcs, npcs );
+        std::swap( ccaps, ncaps );
+    }
+    return found;
+}
+
+inline bool val::Regex::find( Dfas& dfas, const char * s, size_t len, size_t pos, std::vector<int64_t>& caps ) const
+{
+    // caps gets the first match at or after pos
+    int64_t end = search_end( dfas.first, s, len, pos );
+    if ( end < 0 ) return false;
+    int64_t start = search_start( dfas.rev, s, len, pos, size_t( end ) );
+    csassert( start >= 0, "regex automaton found a match end without a start" );
+    if ( posix ) end = longest_end( dfas.all, s, len, size_t( start ) );
+    if ( group_cnt > 1 ) return submatches( dfas, s, len, size_t( start ), end, false, caps );
+    caps.assign( { start, end } );
+    return true;
+}
+
+inline val val::Regex::match( const char * s, size_t len ) const
+{
+    if ( prefix.size() > len || memcmp( s, prefix.data(), prefix.size() ) != 0 ) return val();
+
+    // submatches() is needed for groups, and it can tell if there's a match by itself
+    std::unique_ptr<Dfas> dfas = lease();
+    std::vector<int64_t> caps = { 0, int64_t( len ) };
+    bool matched = (group_cnt > 1) ? submatches( *dfas, s, len, 0, int64_t( len ), false, caps ) 
+                                   : longest_end( dfas->all, s, len, 0 ) == int64_t( len );
+    unlease( std::move( dfas ) );
+    if ( !matched ) return val();
+    val matches = list();
+    for( uint32_t g = 0; g < group_cnt; g++ )
+    {
+        matches.push( (caps[2*g] >= 0 && caps[2*g+1] >= 0) ? std::string( s + caps[2*g], size_t( caps[2*g+1] - caps[2*g] ) ) : std::string() );
+    }
+    return matches;
+}
+
+inline void val::Regex::format( std::string& out, const std::string& fmt, const char * s, size_t len, size_t prev_end, 
+                                 const int64_t * caps, uint32_t group_cnt )
+{
+    // ECMAScript rules in std::match_results::format()
+    size_t b = size_t( caps[0] );
+    size_t e = size_t( caps[1] );
+    for( size_t i = 0; i < fmt.size(); i++ )
+    {
+        if ( fmt[i] != '$' || i+1 == fmt.size() ) {
+            out += fmt[i];
+            continue;
+        }
+        char ch = fmt[++i];
+        if ( ch == '$' ) {
+            out += '$';
+        } else if ( ch == '&' ) {
+            out.append( s + b, e - b );
+        } else if ( ch == '`' ) {
+            out.append( s + prev_end, b - prev_end );
+        } else if ( ch == '\'' ) {
+            out.append( s + e, len - e );
+        } else if ( ch >= '0' && ch <= '9' ) {
+            uint32_t g = uint32_t( ch - '0' );
+            if ( i+1 < fmt.size() && fmt[i+1] >= '0' && fmt[i+1] <= '9' ) g = g*10 + uint32_t( fmt[++i] - '0' );
+            if ( g < group_cnt && caps[2*g] >= 0 && caps[2*g+1] >= 0 ) out.append( s + caps[2*g], size_t( caps[2*g+1] - caps[2*g] ) );
+        } else {
+            out += '$';
+            i--;
+        }
+    }
+}
+
+template<typename Find, typename FindNonEmpty>
+inline std::string val::Regex::replace_matches( const char * s, size_t len, const std::string& fmt, uint64_t max, uint32_t group_cnt,
+                                                Find find, FindNonEmpty find_non_empty )
+{
+    // same matches as std::regex_iterator; find( pos ) returns the caps of the first match at or after pos, 
+    // and find_non_empty( pos ) those of a non-empty match starting at pos, else nullptr
+    std::string out;
+    out.reserve( len + len / 8 );
+    size_t prev_end = 0;
+    uint64_t cnt = 0;
+    const int64_t * caps = (max != 0) ? find( size_t( 0 ) ) : nullptr;
+    while( caps != nullptr )
+    {
+        size_t b = size_t( caps[0] );
+        size_t e = size_t( caps[1] );
+        out.append( s + prev_end, b - prev_end );
+        format( out, fmt, s, len, prev_end, caps, group_cnt );
+        prev_end = e;
+        if ( ++cnt == max ) break;
+
+        if ( b != e ) {
+            caps = find( e );
+        } else if ( (caps = find_non_empty( e )) == nullptr && e < len ) {
+            caps = find( e+1 );
+        }
+    }
+    out.append( s + prev_end, len - prev_end );
+    return out;
+}
+
+inline val val::Regex::replace( const char * s, size_t len, const std::string& fmt, uint64_t max ) const
+{
+    std::unique_ptr<Dfas> dfas = lease();
+    std::vector<int64_t> caps;
+    std::string out = replace_matches( s, len, fmt, max, group_cnt,
+        [&]( size_t pos ) -> const int64_t * { return find( *dfas, s, len, pos, caps ) ? caps.data() : nullptr; },
+        [&]( size_t pos ) -> const int64_t * { return submatches( *dfas, s, len, pos, -1, true, caps ) ? caps.data() : nullptr; } );
+    unlease( std::move( dfas ) );
+    return out;
+}
+
+//--------------------------------------------------------------------------------------
+// Regex cache and the regex overloads that use it
+//--------------------------------------------------------------------------------------
+struct val::RegexCache
+{
+    using entry = std::pair<std::string, std::shared_ptr<const Regex>>;
+
+    std::mutex                  mtx;
+    std::list<entry>            lru;                    // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    uint64_t                    hits   = 0;
+    uint64_t                    misses = 0;
+
+    static RegexCache& get( void )                      { static RegexCache * cache = new RegexCache; return *cache; }
+};
+
+inline std::shared_ptr<const val::Regex> val::regex_cached( const val& re, const val& options )
+{
+    // entries are shared_ptrs so that a regex evicted by another thread stays alive while it's in use
+    std::string o_s = options;
+    std::string re_s = re;
+    std::string key = o_s + '\0' + re_s;
+    RegexCache& cache = RegexCache::get();
+    {
+        std::lock_guard<std::mutex> lock( cache.mtx );
+        auto it = cache.index.find( key );
+        if ( it != cache.index.end() ) {
+            cache.hits++;
+            cache.lru.splice( cache.lru.begin(), cache.lru, it->second );
+            return it->second->second;
+        }
+        cache.misses++;
+    }
+
+    // compile outside the lock; if two threads race on the same miss, the second insert wins
+    std::shared_ptr<const Regex> regex = std::make_shared<const Regex>( re_s, o_s );
+    std::lock_guard<std::mutex> lock( cache.mtx );
+    auto it = cache.index.find( key );
+    if ( it != cache.index.end() ) {
+        it->second->second = regex;
+        cache.lru.splice( cache.lru.begin(), cache.lru, it->second );
+    } else {
+        cache.lru.emplace_front( key, regex );
+        cache.index[key] = cache.lru.begin();
+        if ( cache.lru.size() > REGEX_CACHE_MAX ) {
+            cache.index.erase( cache.lru.back().first );
+            cache.lru.pop_back();
+        }
+    }
+    return regex;
+}
+
+inline val val::regex_cache_stats( void )
+{
+    RegexCache& cache = RegexCache::get();
+    std::lock_guard<std::mutex> lock( cache.mtx );
+    val stats = map();
+    stats.set( "hits",     cache.hits );
+    stats.set( "misses",   cache.misses );
+    stats.set( "size",     uint64_t( cache.lru.size() ) );
+    stats.set( "capacity", REGEX_CACHE_MAX );
+    return stats;
+}
+
+inline val val::match( const val& re, const val& options ) const
+{
+    std::shared_ptr<const Regex> regex = regex_cached( re, options );
+    if ( regex->std_re ) return match( *regex->std_re );
+    std::string s_tmp;
+    const std::string& s = (k == kind::STR) ? u.s->s : (s_tmp = std::string( *this ));
+    return regex->match( s.data(), s.size() );
 }
 
 inline val val::replace( const val& re, const val& fmt, const val& options ) const
 {
-    return replace( re.regex( options ), fmt );
+    std::shared_ptr<const Regex> regex = regex_cached( re, options );
+    if ( regex->std_re ) return replace( *regex->std_re, fmt );
+    std::string s_tmp;
+    const std::string& s = (k == kind::STR) ? u.s->s : (s_tmp = std::string( *this ));
+    return regex->replace( s.data(), s.size(), fmt, uint64_t( -1 ) );
 }
 
-inline val val::replace_all( const std::regex& regex, const val& fmt, uint64_t max ) const
+inline val val::replace_all( const val& re, const val& fmt, const val& options, uint64_t max ) const
 {
-    std::string s   = *this;
-    std::string f_s = fmt;
-    for( size_t i = 0; i < max && std::regex_search( s, regex ); i++ )
+    std::shared_ptr<const Regex> regex = regex_cached( re, options );
+    if ( regex->std_re ) return replace_all( *regex->std_re, fmt, max );
+    std::string s_tmp;
+    const std::string& s = (k == kind::STR) ? u.s->s : (s_tmp = std::string( *this ));
+    return regex->replace( s.data(), s.size(), fmt, max );
+}
+
+//--------------------------------------------------------------------------------------
+// Lazy searching
+//--------------------------------------------------------------------------------------
+class val::match_view
+{
+public:
+    match_view( void )                                          { s = nullptr; }
+
+    explicit operator bool( void ) const                        { return !caps.empty(); }
+    size_t           size( void ) const                         { return caps.size() / 2; }     // number of groups, including group 0
+    std::string_view operator [] ( size_t g ) const;            // group g; empty if it didn't participate
+    int64_t          position( size_t g=0 ) const;              // offset of group g in the text, or -1
+    val              to_val( void ) const;                      // LIST of STR copies, same as match() returns
+
+private:
+    friend class val;
+    friend class match_range;
+
+    val                         text;                   // keeps the searched bytes alive
+    const char *                s;
+    std::vector<int64_t>        caps;                   // start and end of each group, or -1
+};
+
+class val::match_range
+{
+public:
+    match_range( match_range&& ) = default;
+    ~match_range( void );
+
+    class iterator
     {
-        s = std::regex_replace( s, regex, f_s );
+    public:
+        inline iterator( match_range * _r )                             { r = _r;                                      }
+        inline iterator& operator ++ ( void )                           { if ( !r->next() ) r = nullptr; return *this; }
+        inline bool      operator != ( const iterator& other ) const    { return r != other.r;                         }
+        inline const match_view& operator * ( void ) const              { return r->cur;                               }
+    private:
+        match_range *   r;
+    };
+
+    iterator begin( void )                                      { return iterator( (!started && next()) ? this : nullptr ); }
+    iterator end( void )                                        { return iterator( nullptr );                                }
+
+private:
+    friend class val;
+
+    const char *                s;
+    size_t                      len;
+    std::shared_ptr<const Regex> regex;
+    std::unique_ptr<Regex::Dfas> dfas;                  // leased until the last match is found
+    std::unique_ptr<std::cregex_iterator> std_it;
+    match_view                  cur;
+    bool                        started = false;
+    bool                        done    = false;
+
+    match_range( const val& text, const val& re, const val& options );
+    bool next( void );
+};
+
+inline std::string_view val::match_view::operator [] ( size_t g ) const
+{
+    if ( 2*g+1 >= caps.size() || caps[2*g] < 0 || caps[2*g+1] < 0 ) return std::string_view();
+    return std::string_view( s + caps[2*g], size_t( caps[2*g+1] - caps[2*g] ) );
+}
+
+inline int64_t val::match_view::position( size_t g ) const
+{
+    return (2*g < caps.size()) ? caps[2*g] : -1;
+}
+
+inline val val::match_view::to_val( void ) const
+{
+    if ( caps.empty() ) return val();
+    val matches = list();
+    for( size_t g = 0; g < size(); g++ ) matches.push( std::string( (*this)[g] ) );
+    return matches;
+}
+
+inline val::match_range::match_range( const val& text, const val& re, const val& options )
+{
+    // STR and BLOB bytes are searched in place; anything else is converted to a STR first
+    cur.text = (text.k == kind::STR || text.k == kind::BLOB) ? text : val( std::string( text ) );
+    s   = (cur.text.k == kind::STR) ? cur.text.u.s->s.data() : cur.text.u.bl->data;
+    len = (cur.text.k == kind::STR) ? cur.text.u.s->s.size() : cur.text.u.bl->len;
+    cur.s = s;
+    regex = regex_cached( re, options );
+    if ( !regex->std_re ) dfas = regex->lease();
+}
+
+inline val::match_range::~match_range( void )
+{
+    if ( dfas ) regex->unlease( std::move( dfas ) );
+}
+
+inline bool val::match_range::next( void )
+{
+    if ( done ) return false;
+    bool found;
+    if ( regex->std_re ) {
+        if ( !started ) {
+            std_it.reset( new std::cregex_iterator( s, s + len, *regex->std_re ) );
+        } else {
+            ++*std_it;
+        }
+        found = *std_it != std::cregex_iterator();
+        if ( found ) {
+            const std::cmatch& m = **std_it;
+            cur.caps.resize( 2*m.size() );
+            for( size_t g = 0; g < m.size(); g++ )
+            {
+                cur.caps[2*g]   = m[g].matched ? (m[g].first - s)  : -1;
+                cur.caps[2*g+1] = m[g].matched ? (m[g].second - s) : -1;
+            }
+        }
+    } else if ( !started ) {
+        found = regex->find( *dfas, s, len, 0, cur.caps );
+    } else {
+        // step past an empty match the same way Regex::replace_matches() does
+        size_t b = size_t( cur.caps[0] );
+        size_t e = size_t( cur.caps[1] );
+        if ( b != e ) {
+            found = regex->find( *dfas, s, len, e, cur.caps );
+        } else {
+            found = regex->submatches( *dfas, s, len, e, -1, true, cur.caps ) || (e < len && regex->find( *dfas, s, len, e+1, cur.caps ));
+        }
     }
-    return s;
+    started = true;
+    if ( !found ) {
+        done = true;
+        cur.caps.clear();
+        std_it.reset();
+        if ( dfas ) regex->unlease( std::move( dfas ) );
+    }
+    return found;
 }
 
-inline val val::replace_all( const val& re, const val& fmt, const val& options, uint64_t max ) const
+inline val::match_view val::search( const val& re, const val& options ) const
 {
-    return replace_all( re.regex( options ), fmt, max );
+    match_range r( *this, re, options );
+    match_view m;
+    if ( r.next() ) m = r.cur;
+    return m;
 }
 
-inline uint64_t val::size( void ) const
+inline val::match_range val::match_all( const val& re, const val& options ) const
 {
-    switch( k ) 
+    return match_range( *this, re, options );
+}
+
+//--------------------------------------------------------------------------------------
+// Searching files
+//--------------------------------------------------------------------------------------
+inline uint64_t val::grep_lines( const char * s, const char * end )
+{
+    // each '\n' byte becomes 0, then exactly the 0 bytes become 1, without carries between bytes; 
+    // the per-byte sums of 4 words are added across bytes with one multiply
+    const uint64_t nl   = 0x0a0a0a0a0a0a0a0aULL;
+    const uint64_t lo   = 0x7f7f7f7f7f7f7f7fULL;
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t cnt = 0;
+    for( ; end - s >= 32; s += 32 )
     {
-        case kind::STR:        
+        uint64_t sums = 0;
+        for( uint32_t w = 0; w < 4; w++ )
         {
-            return u.s->s.length();
+            uint64_t x;
+            memcpy( &x, s + 8*w, 8 );
+            x ^= nl;
+            sums += ~(((x & lo) + lo) | x | lo) >> 7;
         }
+        cnt += (sums * ones) >> 56;
+    }
+    for( ; s < end; s++ ) cnt += (*s == '\n') ? 1 : 0;
+    return cnt;
+}
 
-        case kind::LIST:        
-        {
-            return u.l->l.size();
+inline uint64_t val::grep_text( const Regex& regex, const char * s, size_t len, std::vector<GrepHit>& hits )
+{
+    // p is always at the start of a line; with a literal, it jumps to the line holding the next occurrence
+    std::unique_ptr<Regex::Dfas> dfas;
+    if ( !regex.std_re ) dfas = regex.lease();
+    const std::string& lit = regex.inner;
+    const char * end = s + len;
+    const char * counted = s;                           // line_num is the number of '\n's before counted
+    uint64_t line_num = 0;
+    for( const char * p = s; p < end; )
+    {
+        if ( !lit.empty() ) {
+            const char * found = (lit.size() == 1) ? static_cast<const char *>( memchr( p, lit[0], size_t( end - p ) ) )
+                                                   : static_cast<const char *>( memmem( p, size_t( end - p ), lit.data(), lit.size() ) );
+            if ( found == nullptr ) break;
+            while( found > p && found[-1] != '\n' ) found--;
+            p = found;
+        }
+        const char * e = static_cast<const char *>( memchr( p, '\n', size_t( end - p ) ) );
+        if ( e == nullptr ) e = end;
+        bool matched = regex.std_re ? std::regex_search( p, e, *regex.std_re ) 
+                                    : regex.search_end( dfas->first, p, size_t( e - p ), 0 ) >= 0;
+        if ( matched ) {
+            line_num += grep_lines( counted, p );
+            counted = p;
+            hits.push_back( GrepHit{ line_num, p, size_t( e - p ) } );
         }
+        if ( e == end ) break;
+        p = e + 1;
+    }
+    line_num += grep_lines( counted, end );
+    if ( dfas ) regex.unlease( std::move( dfas ) );
+    return line_num;
+}
 
-        case kind::MAP:        
+inline void val::grep_pieces( const Regex& regex, const char * s, size_t len, std::vector<GrepHit>& hits )
+{
+    // a piece ends just after a '\n', so lines aren't split, and its hits' line numbers are fixed up 
+    // afterward from the '\n' counts of the pieces before it
+    std::vector<size_t> bounds = { 0 };
+    while( len - bounds.back() > GREP_PIECE )
+    {
+        const char * e = static_cast<const char *>( memchr( s + bounds.back() + GREP_PIECE, '\n', len - bounds.back() - GREP_PIECE ) );
+        if ( e == nullptr ) break;
+        bounds.push_back( size_t( e - s ) + 1 );
+    }
+    bounds.push_back( len );
+    uint64_t piece_cnt = bounds.size() - 1;
+    std::vector<std::vector<GrepHit>> piece_hits( piece_cnt );
+    std::vector<uint64_t> nl_cnts( piece_cnt );
+    ThreadPool::get().parallel_for( piece_cnt, [&]( uint64_t first_piece, uint64_t last_piece )
+    {
+        for( uint64_t j = first_piece; j < last_piece; j++ ) nl_cnts[j] = grep_text( regex, s + bounds[j], bounds[j+1] - bounds[j], piece_hits[j] );
+    }, 1 );
+    uint64_t line_base = 0;
+    for( uint64_t j = 0; j < piece_cnt; j++ )
+    {
+        for( GrepHit& hit : piece_hits[j] )
         {
-            return u.m->m.size();
+            hit.line_num += line_base;
+            hits.push_back( hit );
         }
+        line_base += nl_cnts[j];
+    }
+}
 
-        case kind::CUSTOM:      
-        {
-            return u.c->size();
+inline val val::grep( const val& paths, const val& re, const val& options )
+{
+    // sorted walks keep the order stable from run to run
+    std::vector<std::string> files;
+    auto add = [&]( const val& path )
+    {
+        if ( !path.path_is_dir() ) {
+            files.push_back( path );
+            return;
         }
+        val found = walk( path, 0, "rs" );
+        for( const val& f : found.u.l->l ) files.push_back( f );
+    };
+    if ( paths.k == kind::LIST ) {
+        for( const val& path : paths.u.l->l ) add( path );
+    } else {
+        add( paths );
+    }
+    std::shared_ptr<const Regex> regex = regex_cached( re, std::string( options ) + "d" );
 
-        default:
+    // each file's hits are copied out and its BLOB released before the next file, so only the files 
+    // being searched are held in memory, and large files are searched in pieces
+    std::vector<std::vector<val>> matches_of( files.size() );
+    ThreadPool& pool = ThreadPool::get();
+    pool.parallel_for( files.size(), [&]( uint64_t first, uint64_t last )
+    {
+        for( uint64_t i = first; i < last; i++ )
         {
-            csdie( "can't call size() on a " + kind_to_str(k) + " val" );  
-            return false;
+            val blob = file_map( files[i] );
+            const char * s = blob.u.bl->data;
+            size_t len = blob.u.bl->len;
+            std::vector<GrepHit> hits;
+            if ( len < 2*GREP_PIECE ) {
+                grep_text( *regex, s, len, hits );
+            } else {
+                grep_pieces( *regex, s, len, hits );
+            }
+            val path = files[i];
+            for( const GrepHit& hit : hits ) matches_of[i].push_back( val{ path, int64_t( hit.line_num + 1 ), std::string( hit.s, hit.len ) } );
         }
+    }, 1 );
+
+    val matches = list();
+    for( std::vector<val>& m : matches_of )
+    {
+        matches.u.l->l.insert( matches.u.l->l.end(), std::make_move_iterator( m.begin() ), std::make_move_iterator( m.end() ) );
     }
+    return matches;
 }
 
-inline bool val::exists( const val& key ) const
+
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+//
+// COMPILE-TIME REGEX
+//
+// Used by the match<P>(), replace<P>() and replace_all<P>() templates.  The pattern is
+// parsed during C++ compilation into a constexpr program of the automaton's instructions,
+// where a SET may also repeat (x = min, y = max).  The matcher is a backtracker with one
+// function instantiation per instruction, so each step's opcode, byte set and targets are
+// compile-time constants.  A per-thread (instruction, position) stamp table over the SPLITs
+// and repeated SETs keeps it linear in the text.  A search skips ahead to bytes that can
+// start a match.
+//
+// Texts longer than CT_TEXT_MAX, and matches that would recurse deeper than CT_DEPTH_MAX,
+// are handed to the automaton engine instead, which gives the same results except for the 
+// captures of a group inside a repetition whose body can match empty: for (c*?)* on "cc" 
+// the backtracker's group 1 is "c" and the automaton's is "cc", and replace_all() may split 
+// such matches differently, so with those patterns the result can depend on text length.
+//
+//--------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------
+struct val::CtInst
 {
-    switch( k ) 
+    static const uint32_t       NO_MEMO = 0xffffffff;
+
+    Regex::op                   o      = Regex::op::MATCH;
+    Regex::cond                 c      = Regex::cond::BEGIN;
+    bool                        greedy = true;
+    uint32_t                    x      = 0;             // SET: min; SPLIT, JMP: target; SAVE: slot
+    uint32_t                    y      = 0;             // SET: max or Regex::REPEAT_INF; SPLIT: second target
+    uint32_t                    memo   = NO_MEMO;       // stamp table row
+    uint64_t                    set[4] = { 0, 0, 0, 0 };
+
+    static constexpr bool has( const uint64_t * set, uint8_t b )        { return (set[b >> 6] >> (b & 63)) & 1; }
+    static constexpr void add( uint64_t * set, uint32_t b )             { set[b >> 6] |= uint64_t( 1 ) << (b & 63); }
+};
+
+template<size_t N>                                      // N == 0 only counts instructions
+struct val::CtProg
+{
+    CtInst                      inst[N ? N : 1] = {};
+    uint32_t                    size      = 0;
+    uint32_t                    group_cnt = 1;          // includes group 0
+    uint32_t                    memo_cnt  = 0;
+    uint64_t                    first[4]  = { 0, 0, 0, 0 };     // bytes that can start a match
+    uint32_t                    first_cnt = 0;
+    bool                        nullable  = false;      // can match without consuming anything; first isn't used then
+    bool                        ok        = true;
+
+    constexpr CtProg( const char * p );
+
+    constexpr uint32_t emit( Regex::op o, uint32_t x = 0, uint32_t y = 0 );
+    constexpr void     patch( uint32_t pc, uint32_t x, uint32_t y );
+    constexpr void     alt( const char * p, uint32_t i, uint32_t end );
+    constexpr void     cat( const char * p, uint32_t i, uint32_t end );
+    constexpr void     repeat( const char * p, uint32_t a, uint32_t e, uint32_t min, uint32_t max, bool greedy );
+    constexpr void     atom( const char * p, uint32_t a, uint32_t e );
+    constexpr bool     atom_set( const char * p, uint32_t a, uint32_t e, uint64_t * set );
+    constexpr uint32_t atom_end( const char * p, uint32_t i, uint32_t end );
+    constexpr uint32_t bracket_end( const char * p, uint32_t i, uint32_t end );
+    constexpr uint32_t bar( const char * p, uint32_t i, uint32_t end );
+    constexpr uint32_t groups_before( const char * p, uint32_t i );
+    constexpr bool     quantifier( const char * p, uint32_t& i, uint32_t end, uint32_t& min, uint32_t& max );
+    constexpr void     bracket( const char * p, uint32_t i, uint32_t end, uint64_t * set );
+    constexpr void     escape( const char * p, uint32_t& i, uint32_t end, uint64_t * set, bool in_bracket );
+    constexpr void     class_name( const char * p, uint32_t& i, uint32_t end, uint64_t * set );
+    constexpr void     analyze( void );
+};
+
+template<size_t N>
+constexpr val::CtProg<N>::CtProg( const char * p )
+{
+    uint32_t len = 0;
+    while( p[len] != '\0' ) len++;
+    emit( Regex::op::SAVE, 0 );
+    alt( p, 0, len );
+    emit( Regex::op::SAVE, 1 );
+    emit( Regex::op::MATCH );
+    group_cnt = 1 + groups_before( p, len );
+    if ( ok && N != 0 ) analyze();
+}
+
+template<size_t N>
+constexpr uint32_t val::CtProg<N>::emit( Regex::op o, uint32_t x, uint32_t y )
+{
+    if ( size < N ) {
+        inst[size].o = o;
+        inst[size].x = x;
+        inst[size].y = y;
+    }
+    return size++;
+}
+
+template<size_t N>
+constexpr void val::CtProg<N>::patch( uint32_t pc, uint32_t x, uint32_t y )
+{
+    if ( pc < N ) {
+        inst[pc].x = x;
+        inst[pc].y = y;
+    }
+}
+
+template<size_t N>
+constexpr void val::CtProg<N>::alt( const char * p, uint32_t i, uint32_t end )
+{
+    uint32_t j = bar( p, i, end );
+    if ( j == end ) {
+        cat( p, i, end );
+        return;
+    }
+    uint32_t split = emit( Regex::op::SPLIT );
+    cat( p, i, j );
+    uint32_t jmp = emit( Regex::op::JMP );
+    patch( split, split+1, size );
+    alt( p, j+1, end );
+    patch( jmp, size, 0 );
+}
+
+template<size_t N>
+constexpr void val::CtProg<N>::cat( const char * p, uint32_t i, uint32_t end )
+{
+    while( ok && i < end )
     {
-        case kind::LIST:        
-        {
-            int64_t index = key;
-            return index >= 0 && index < int64_t(u.l->l.size());
+        uint32_t a = i;
+        uint32_t e = atom_end( p, a, end );
+        if ( !ok ) return;
+        uint32_t min = 1;
+        uint32_t max = 1;
+        bool greedy = true;
+        i = e;
+        if ( i < end && (p[i] == '*' || p[i] == '+' || p[i] == '?' || p[i] == '{') ) {
+            bool is_assert = p[a] == '^' || p[a] == '$' || (p[a] == '\\' && (p[a+1] == 'b' || p[a+1] == 'B'));
+            if ( is_assert || !quantifier( p, i, end, min, max ) ) {
+                ok = false;
+                return;
+            }
+            if ( i < end && p[i] == '?' ) {
+                greedy = false;
+                i++;
+            }
+            if ( i < end && (p[i] == '*' || p[i] == '+' || p[i] == '?' || p[i] == '{') ) {
+                ok = false;
+                return;
+            }
         }
+        repeat( p, a, e, min, max, greedy );
+    }
+}
 
-        case kind::MAP:        
+template<size_t N>
+constexpr bool val::CtProg<N>::quantifier( const char * p, uint32_t& i, uint32_t end, uint32_t& min, uint32_t& max )
+{
+    min = 0;
+    max = Regex::REPEAT_INF;
+    switch( p[i++] )
+    {
+        case '*':                                       return true;
+        case '+': min = 1;                              return true;
+        case '?': max = 1;                              return true;
+        default:                                        break;
+    }
+
+    // {n}, {n,} or {n,m}
+    auto number = [&]( uint32_t& n )
+    {
+        if ( i == end || p[i] < '0' || p[i] > '9' ) return false;
+        n = 0;
+        while( i < end && p[i] >= '0' && p[i] <= '9' )
         {
-            auto it = u.m->m.find( std::string( key ) );
-            return it != u.m->m.end();
+            n = n*10 + uint32_t( p[i++] - '0' );
+            if ( n > Regex::REPEAT_MAX ) return false;
         }
+        return true;
+    };
+    if ( !number( min ) ) return false;
+    max = min;
+    if ( i < end && p[i] == ',' ) {
+        i++;
+        max = Regex::REPEAT_INF;
+        if ( i < end && p[i] != '}' && !number( max ) ) return false;
+    }
+    return i < end && p[i++] == '}' && min <= max;
+}
 
-        case kind::CUSTOM:      
+template<size_t N>
+constexpr void val::CtProg<N>::repeat( const char * p, uint32_t a, uint32_t e, uint32_t min, uint32_t max, bool greedy )
+{
+    uint64_t set[4] = { 0, 0, 0, 0 };
+    if ( min == 1 && max == 1 ) {
+        atom( p, a, e );
+    } else if ( atom_set( p, a, e, set ) ) {
+        uint32_t pc = emit( Regex::op::SET, min, max );
+        if ( pc < N ) {
+            inst[pc].greedy = greedy;
+            for( uint32_t w = 0; w < 4; w++ ) inst[pc].set[w] = set[w];
+        }
+    } else if ( ok ) {
+        // copies of the atom reuse its group numbers, which come from its position in the pattern
+        for( uint32_t k = 0; k < min; k++ ) atom( p, a, e );
+        if ( max == Regex::REPEAT_INF ) {
+            uint32_t split = emit( Regex::op::SPLIT );
+            atom( p, a, e );
+            emit( Regex::op::JMP, split );
+            if ( greedy ) patch( split, split+1, size ); else patch( split, size, split+1 );
+        } else {
+            uint32_t first_split = size;
+            uint32_t copy_len = 0;
+            for( uint32_t k = min; k < max; k++ )
+            {
+                uint32_t split = emit( Regex::op::SPLIT );
+                atom( p, a, e );
+                copy_len = size - split;
+            }
+            for( uint32_t k = min; k < max; k++ )
+            {
+                uint32_t split = first_split + (k - min) * copy_len;
+                if ( greedy ) patch( split, split+1, size ); else patch( split, size, split+1 );
+            }
+        }
+    }
+}
+
+template<size_t N>
+constexpr void val::CtProg<N>::atom( const char * p, uint32_t a, uint32_t e )
+{
+    switch( p[a] )
+    {
+        case '(':
+            if ( p[a+1] == '?' ) {
+                if ( p[a+2] != ':' ) {
+                    ok = false;                         // lookahead
+                    return;
+                }
+                alt( p, a+3, e-1 );
+                return;
+            } else {
+                uint32_t g = 1 + groups_before( p, a );
+                emit( Regex::op::SAVE, 2*g );
+                alt( p, a+1, e-1 );
+                emit( Regex::op::SAVE, 2*g+1 );
+                return;
+            }
+
+        case '^':
+        case '$':
         {
-            return u.c->exists( key );
+            uint32_t pc = emit( Regex::op::ASSERT );
+            if ( pc < N ) inst[pc].c = (p[a] == '^') ? Regex::cond::BEGIN : Regex::cond::END;
+            return;
         }
 
         default:
         {
-            csdie( "can't call exists() on a " + kind_to_str(k) + " val" );  
-            return false;
+            if ( p[a] == '\\' && (p[a+1] == 'b' || p[a+1] == 'B') ) {
+                uint32_t pc = emit( Regex::op::ASSERT );
+                if ( pc < N ) inst[pc].c = (p[a+1] == 'b') ? Regex::cond::WORD_BOUNDARY : Regex::cond::NOT_WORD_BOUNDARY;
+                return;
+            }
+            uint64_t set[4] = { 0, 0, 0, 0 };
+            if ( !atom_set( p, a, e, set ) ) return;
+            uint32_t pc = emit( Regex::op::SET, 1, 1 );
+            if ( pc < N ) for( uint32_t w = 0; w < 4; w++ ) inst[pc].set[w] = set[w];
+            return;
         }
     }
 }
 
-inline       ValProxy::operator val const&( void )              { return v.get( key );   }
-inline val&  ValProxy::operator = ( const val& other )          { v.set( key, other ); return v; }
-inline       ValProxyI::operator val const&( void )             { return v.get( key );   }
-inline val&  ValProxyI::operator = ( const val& other )         { v.set( key, other ); return v; }
-inline       ValProxyCS::operator val const&( void )            { return v.get( key );   }
-inline val&  ValProxyCS::operator = ( const val& other )        { v.set( key, other ); return v; }
-inline const val& val::operator [] ( const val& key ) const     { return get( key ); }
+template<size_t N>
+constexpr bool val::CtProg<N>::atom_set( const char * p, uint32_t a, uint32_t e, uint64_t * set )
+{
+    // false if the atom isn't a single byte set
+    switch( p[a] )
+    {
+        case '(':
+        case '^':
+        case '$':
+            return false;
 
-inline const val& val::get( const val& key ) const
+        case '[':
+            bracket( p, a, e, set );
+            return ok;
+
+        case '.':
+            for( uint32_t b = 0; b < 256; b++ ) if ( b != '\n' && b != '\r' ) CtInst::add( set, b );
+            return true;
+
+        case '\\':
+        {
+            if ( p[a+1] == 'b' || p[a+1] == 'B' ) return false;
+            uint32_t i = a+1;
+            escape( p, i, e, set, false );
+            return ok;
+        }
+
+        default:
+            CtInst::add( set, uint8_t( p[a] ) );
+            return true;
+    }
+}
+
+template<size_t N>
+constexpr uint32_t val::CtProg<N>::atom_end( const char * p, uint32_t i, uint32_t end )
 {
-    switch( k ) 
+    switch( p[i] )
     {
-        case kind::LIST:        
+        case '(':
         {
-            int64_t index = key;
-            csassert( index >= 0 && index < int64_t(u.l->l.size()), "LIST index is out of range" );
-            return u.l->l[index];
+            uint32_t depth = 0;
+            for( uint32_t j = i; j < end; )
+            {
+                if ( p[j] == '\\' ) {
+                    j += 2;
+                } else if ( p[j] == '[' ) {
+                    j = bracket_end( p, j, end );
+                } else {
+                    if ( p[j] == '(' ) depth++;
+                    if ( p[j] == ')' && --depth == 0 ) return j+1;
+                    j++;
+                }
+            }
+            ok = false;
+            return end;
         }
 
-        case kind::MAP:        
+        case '[':
+            return bracket_end( p, i, end );
+
+        case '\\':
         {
-            auto it = u.m->m.find( std::string( key ) );
-            csassert( it != u.m->m.end(), "MAP key " + std::string(key) + " does not exist" );
-            return it->second;
+            uint32_t e = (i+1 == end) ? end+1 : (p[i+1] == 'x') ? i+4 : (p[i+1] == 'u') ? i+6 : (p[i+1] == 'c') ? i+3 : i+2;
+            if ( e > end ) ok = false;
+            return ok ? e : end;
+        }
+
+        case ')':
+        case '|':
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case '}':
+        case ']':
+            ok = false;
+            return end;
+
+        default:
+            return i+1;
+    }
+}
+
+template<size_t N>
+constexpr uint32_t val::CtProg<N>::bracket_end( const char * p, uint32_t i, uint32_t end )
+{
+    uint32_t j = i+1;
+    if ( j < end && p[j] == '^' ) j++;
+    if ( j < end && p[j] == ']' ) j = end;              // "[]" and "[^]" differ between grammars
+    while( j < end && p[j] != ']' )
+    {
+        if ( p[j] == '\\' ) {
+            j += 2;
+        } else if ( p[j] == '[' && j+1 < end && p[j+1] == ':' ) {
+            j += 2;
+            while( j < end && p[j] != ':' ) j++;
+            j += 2;
+        } else {
+            j++;
+        }
+    }
+    if ( j >= end ) {
+        ok = false;
+        return end;
+    }
+    return j+1;
+}
+
+template<size_t N>
+constexpr uint32_t val::CtProg<N>::bar( const char * p, uint32_t i, uint32_t end )
+{
+    // first '|' in [i, end) outside of groups and brackets
+    uint32_t depth = 0;
+    for( uint32_t j = i; j < end; )
+    {
+        if ( p[j] == '\\' ) {
+            j += 2;
+        } else if ( p[j] == '[' ) {
+            j = bracket_end( p, j, end );
+        } else {
+            if ( p[j] == '(' ) depth++;
+            if ( p[j] == ')' && depth > 0 ) depth--;
+            if ( p[j] == '|' && depth == 0 ) return j;
+            j++;
+        }
+    }
+    return end;
+}
+
+template<size_t N>
+constexpr uint32_t val::CtProg<N>::groups_before( const char * p, uint32_t i )
+{
+    uint32_t cnt = 0;
+    for( uint32_t j = 0; j < i; )
+    {
+        if ( p[j] == '\\' ) {
+            j += 2;
+        } else if ( p[j] == '[' ) {
+            uint32_t len = j;
+            while( p[len] != '\0' ) len++;
+            j = bracket_end( p, j, len );
+        } else {
+            if ( p[j] == '(' && p[j+1] != '?' ) cnt++;
+            j++;
         }
+    }
+    return cnt;
+}
 
-        case kind::CUSTOM:      
+template<size_t N>
+constexpr void val::CtProg<N>::bracket( const char * p, uint32_t i, uint32_t end, uint64_t * set )
+{
+    // i is at '['; same rules as Regex::Parser::bracket()
+    uint64_t acc[4] = { 0, 0, 0, 0 };
+    i++;
+    bool negate = i < end && p[i] == '^';
+    if ( negate ) i++;
+    while( ok && i < end && p[i] != ']' )
+    {
+        uint64_t item[4] = { 0, 0, 0, 0 };
+        int32_t lo = -1;
+        auto single = [&]( const uint64_t * s )
         {
-            return u.c->get( key );
+            int32_t b = -1;
+            for( uint32_t c = 0; c < 256; c++ ) 
+            {
+                if ( !CtInst::has( s, uint8_t( c ) ) ) continue;
+                if ( b >= 0 ) return -1;
+                b = int32_t( c );
+            }
+            return b;
+        };
+        if ( p[i] == '[' && i+1 < end && p[i+1] == ':' ) {
+            i += 2;
+            class_name( p, i, end, item );
+        } else if ( p[i] == '[' && i+1 < end && (p[i+1] == '.' || p[i+1] == '=') ) {
+            ok = false;                                 // collating elements
+        } else if ( p[i] == '\\' ) {
+            i++;
+            escape( p, i, end, item, true );
+            lo = single( item );
+        } else {
+            lo = uint8_t( p[i++] );
+            CtInst::add( item, uint32_t( lo ) );
         }
 
-        default:
-        {
-            csdie( "can't call get() on a " + kind_to_str(k) + " val" );  
-            return undef;
+        if ( ok && i+1 < end && p[i] == '-' && p[i+1] != ']' ) {
+            // range
+            i++;
+            int32_t hi = -1;
+            if ( p[i] == '\\' ) {
+                uint64_t hi_item[4] = { 0, 0, 0, 0 };
+                i++;
+                escape( p, i, end, hi_item, true );
+                hi = single( hi_item );
+            } else if ( p[i] == '[' ) {
+                ok = false;
+            } else {
+                hi = uint8_t( p[i++] );
+            }
+            if ( !ok || lo < 0 || hi < lo ) {
+                ok = false;
+                return;
+            }
+            for( int32_t b = lo; b <= hi; b++ ) CtInst::add( item, uint32_t( b ) );
         }
+        for( uint32_t w = 0; w < 4; w++ ) acc[w] |= item[w];
     }
+    if ( i >= end ) ok = false;
+    for( uint32_t w = 0; w < 4; w++ ) set[w] |= negate ? ~acc[w] : acc[w];
 }
 
-inline void val::set( const val& key, const val& v )
+template<size_t N>
+constexpr void val::CtProg<N>::escape( const char * p, uint32_t& i, uint32_t end, uint64_t * set, bool in_bracket )
 {
-    switch( k ) 
+    // i is just past the '\\'; same rules as Regex::Parser::escape()
+    auto hex = [&]( uint32_t digit_cnt, uint32_t& x )
     {
-        case kind::LIST:        
-        {
-            u.l->l[int64_t(key)] = v;
-            break;
-        }
-
-        case kind::MAP:        
+        x = 0;
+        for( uint32_t k = 0; k < digit_cnt; k++ )
         {
-            u.m->m[std::string(key)] = v;
-            break;
+            char d = (i < end) ? p[i++] : '\0';
+            if ( d >= '0' && d <= '9' )      x = x*16 + uint32_t( d - '0' );
+            else if ( d >= 'a' && d <= 'f' ) x = x*16 + uint32_t( d - 'a' + 10 );
+            else if ( d >= 'A' && d <= 'F' ) x = x*16 + uint32_t( d - 'A' + 10 );
+            else                             return false;
         }
+        return true;
+    };
+    auto is_alpha = []( char c ) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); };
 
-        case kind::CUSTOM:      
-        {
-            u.c->set( key, v );
+    if ( i >= end ) {
+        ok = false;
+        return;
+    }
+    char ch = p[i++];
+    uint32_t x = 0;
+    switch( ch )
+    {
+        case 'd': for( uint32_t b = '0'; b <= '9'; b++ ) CtInst::add( set, b );                                             break;
+        case 'D': for( uint32_t b = 0; b < 256; b++ ) if ( b < '0' || b > '9' ) CtInst::add( set, b );                      break;
+        case 'w': for( uint32_t b = 0; b < 256; b++ ) if ( Regex::is_word( uint8_t( b ) ) ) CtInst::add( set, b );         break;
+        case 'W': for( uint32_t b = 0; b < 256; b++ ) if ( !Regex::is_word( uint8_t( b ) ) ) CtInst::add( set, b );        break;
+        case 's': for( uint32_t b = 0; b < 256; b++ ) if ( b == ' ' || (b >= '\t' && b <= '\r') ) CtInst::add( set, b );   break;
+        case 'S': for( uint32_t b = 0; b < 256; b++ ) if ( b != ' ' && (b < '\t' || b > '\r') ) CtInst::add( set, b );     break;
+        case 'f': CtInst::add( set, '\f' );                                                                                 break;
+        case 'n': CtInst::add( set, '\n' );                                                                                 break;
+        case 'r': CtInst::add( set, '\r' );                                                                                 break;
+        case 't': CtInst::add( set, '\t' );                                                                                 break;
+        case 'v': CtInst::add( set, '\v' );                                                                                 break;
+        case '0': CtInst::add( set, 0 );                                                                                    break;
+        case 'b': if ( in_bracket ) CtInst::add( set, '\b' ); else ok = false;                                              break;
+        case 'x': if ( hex( 2, x ) ) CtInst::add( set, x ); else ok = false;                                                break;
+        case 'u': if ( hex( 4, x ) && x <= 0xff ) CtInst::add( set, x ); else ok = false;                                   break;
+        case 'c':
+            if ( i < end && is_alpha( p[i] ) ) CtInst::add( set, uint8_t( p[i++] ) % 32 ); else ok = false;
             break;
-        }
 
         default:
-        {
-            csdie( "can't call set() on a " + kind_to_str(k) + " val" );  
+            if ( is_alpha( ch ) || (ch >= '0' && ch <= '9') ) ok = false;     // backreference or something else we don't do
+            else CtInst::add( set, uint8_t( ch ) );
             break;
-        }
     }
 }
 
-inline val val::run( val options ) const
+template<size_t N>
+constexpr void val::CtProg<N>::class_name( const char * p, uint32_t& i, uint32_t end, uint64_t * set )
 {
-    csassert( options == "", "run() supports no options yet" );
-    std::string cmd = *this;
-    return std::system( cmd.c_str() );
+    // i is just past "[:"; C locale, like Regex::Parser::class_name()
+    uint32_t name = i;
+    while( i < end && p[i] != ':' ) i++;
+    if ( i+1 >= end || p[i+1] != ']' ) {
+        ok = false;
+        return;
+    }
+    auto is = [&]( const char * n )
+    {
+        uint32_t k = 0;
+        while( n[k] != '\0' && name+k < i && p[name+k] == n[k] ) k++;
+        return n[k] == '\0' && name+k == i;
+    };
+    uint32_t which = is( "alnum" ) ? 1 : is( "alpha" ) ? 2 : is( "blank" ) ? 3 : is( "cntrl" ) ? 4 : (is( "digit" ) || is( "d" )) ? 5 :
+                     is( "graph" ) ? 6 : is( "lower" ) ? 7 : is( "print" ) ? 8 : is( "punct" ) ? 9 : (is( "space" ) || is( "s" )) ? 10 :
+                     is( "upper" ) ? 11 : is( "xdigit" ) ? 12 : is( "w" ) ? 13 : 0;
+    i += 2;
+    if ( which == 0 ) {
+        ok = false;
+        return;
+    }
+    for( uint32_t b = 0; b < 256; b++ )
+    {
+        bool digit = b >= '0' && b <= '9';
+        bool lower = b >= 'a' && b <= 'z';
+        bool upper = b >= 'A' && b <= 'Z';
+        bool graph = b > ' ' && b < 0x7f;
+        bool in = (which == 1)  ? (digit || lower || upper)             : (which == 2)  ? (lower || upper) :
+                  (which == 3)  ? (b == ' ' || b == '\t')               : (which == 4)  ? (b < ' ' || b == 0x7f) :
+                  (which == 5)  ? digit                                 : (which == 6)  ? graph :
+                  (which == 7)  ? lower                                 : (which == 8)  ? (graph || b == ' ') :
+                  (which == 9)  ? (graph && !digit && !lower && !upper) : (which == 10) ? (b == ' ' || (b >= '\t' && b <= '\r')) :
+                  (which == 11) ? upper                                 : (which == 12) ? (digit || (b >= 'a' && b <= 'f') || (b >= 'A' && b <= 'F')) :
+                                  Regex::is_word( uint8_t( b ) );
+        if ( in ) CtInst::add( set, b );
+    }
 }
 
-inline val val::path_dir( void ) const
+template<size_t N>
+constexpr void val::CtProg<N>::analyze( void )
 {
-    csassert( k == kind::STR, "path_dir() must be called on a STR val" );
-    size_t pos = u.s->s.find_last_of( "/\\" );
-    return val( u.s->s.substr( 0, pos ) );
-}
+    // stamp table rows go to SPLITs and repeated SETs; the first-byte set comes from everything 
+    // reachable from the start without consuming, treating every ASSERT as true
+    for( uint32_t pc = 0; pc < size; pc++ )
+    {
+        bool repeated = inst[pc].o == Regex::op::SET && (inst[pc].x != 1 || inst[pc].y != 1);
+        if ( inst[pc].o == Regex::op::SPLIT || repeated ) inst[pc].memo = memo_cnt++;
+    }
 
-inline val val::path_no_dir( void ) const
-{
-    csassert( k == kind::STR, "path_no_dir() must be called on a STR val" );
-    size_t pos = u.s->s.find_last_of( "/\\" );
-    return val( u.s->s.substr( pos+1 ) );
+    bool seen[N ? N : 1] = {};
+    uint32_t stack[N ? N : 1] = {};
+    uint32_t top = 0;
+    stack[top++] = 0;
+    seen[0] = true;
+    auto push = [&]( uint32_t pc ) 
+    {
+        if ( seen[pc] ) return;
+        seen[pc] = true;
+        stack[top++] = pc;
+    };
+    while( top > 0 )
+    {
+        const CtInst& in = inst[stack[--top]];
+        uint32_t pc = stack[top];
+        switch( in.o )
+        {
+            case Regex::op::SET:
+                for( uint32_t w = 0; w < 4; w++ ) first[w] |= in.set[w];
+                if ( in.x == 0 ) push( pc+1 );
+                break;
+
+            case Regex::op::SPLIT:  push( in.x ); push( in.y );         break;
+            case Regex::op::JMP:    push( in.x );                       break;
+            case Regex::op::MATCH:  nullable = true;                    break;
+            default:                push( pc+1 );                       break;
+        }
+    }
+    for( uint32_t b = 0; b < 256; b++ ) if ( CtInst::has( first, uint8_t( b ) ) ) first_cnt++;
 }
 
-inline val val::path_no_ext( void ) const
+template<typename Pat>
+struct val::CtRegex
 {
-    csassert( k == kind::STR, "path_no_dir() must be called on a STR val" );
-    size_t pos = u.s->s.find_last_of( "/\\." );
-    char c = u.s->s.at( pos );
-    return (c == '.') ? val( u.s->s.substr( 0, pos-1 ) ) : *this;
-}
+    static constexpr CtProg<CtProg<0>( Pat::str ).size> prog{ Pat::str };
+    static_assert( prog.ok, "compile-time regex is malformed or uses backreferences, lookahead or collating elements" );
+    static constexpr uint32_t   G = prog.group_cnt;
+    static constexpr uint32_t   M = prog.memo_cnt;
 
-inline int val::path_stat( struct stat& ss ) const
-{
-    csassert( k == kind::STR, "path_stat() must be called on a STR val" );
-    return stat( std::string( *this ).c_str(), &ss );
-}
+    struct Ctx
+    {
+        const char *            s;
+        size_t                  len;
+        size_t                  start    = 0;           // of the current attempt
+        int64_t                 must_end = -1;
+        bool                    not_null = false;
+        bool                    overflow = false;       // gave up; use the automaton
+        int64_t                 caps[2*G];
+        uint32_t *              stamps   = nullptr;     // M rows of len+1
+        uint32_t                stamp    = 0;
+        size_t                  fail_lo[M ? M : 1];     // repeated SET at any position in [fail_lo, fail_hi] is known to fail
+        size_t                  fail_hi[M ? M : 1];
+
+        Ctx( const char * _s, size_t _len ) : s( _s ), len( _len ) {}
+        void reset( void );                             // before each match or search
+    };
 
-inline bool val::path_exists( void ) const
-{
-    struct stat ss;
-    return path_stat( ss ) == 0;
-}
+    template<uint32_t PC> static bool step( Ctx& c, size_t i, uint32_t depth );
+    static bool at( Ctx& c, size_t start, int64_t must_end, bool not_null );
+    static bool find( Ctx& c, size_t pos );
+    static bool match( const char * s, size_t len, val& matches );
+    static bool replace( const char * s, size_t len, const std::string& fmt, uint64_t max, std::string& out );
+};
 
-inline bool val::path_is_file( void ) const
+inline uint32_t * val::ct_stamps( size_t n, uint32_t& stamp )
 {
-    struct stat ss;
-    return path_stat( ss ) == 0 && S_ISREG( ss.st_mode );
+    // one table per thread shared by all patterns; each match or search takes a new stamp, so old entries never match
+    static thread_local std::vector<uint32_t> stamps;
+    static thread_local uint32_t              last = 0;
+    if ( stamps.size() < n ) stamps.resize( n, 0 );
+    if ( ++last == 0 ) {
+        std::fill( stamps.begin(), stamps.end(), 0 );
+        last = 1;
+    }
+    stamp = last;
+    return stamps.data();
 }
 
-inline bool val::path_is_link( void ) const
+template<typename Pat>
+inline void val::CtRegex<Pat>::Ctx::reset( void )
 {
-    struct stat ss;
-    return path_stat( ss ) == 0 && S_ISLNK( ss.st_mode );
+    for( uint32_t g = 0; g < 2*G; g++ ) caps[g] = -1;
+    if constexpr ( M != 0 ) {
+        stamps = ct_stamps( M * (len+1), stamp );
+        for( uint32_t m = 0; m < M; m++ )
+        {
+            fail_lo[m] = 1;
+            fail_hi[m] = 0;
+        }
+    }
 }
 
-inline bool val::path_is_fifo( void ) const
+template<typename Pat>
+template<uint32_t PC>
+inline bool val::CtRegex<Pat>::step( Ctx& c, size_t i, uint32_t depth )
 {
-    struct stat ss;
-    return path_stat( ss ) == 0 && S_ISFIFO( ss.st_mode );
-}
+    constexpr CtInst in = prog.inst[PC];
+    if ( depth > CT_DEPTH_MAX ) c.overflow = true;
+    if ( c.overflow ) return false;
+    if constexpr ( in.memo != CtInst::NO_MEMO ) {
+        uint32_t& stamp = c.stamps[in.memo * (c.len+1) + i];
+        if ( stamp == c.stamp ) return false;
+        stamp = c.stamp;
+    }
 
-inline bool val::path_is_socket( void ) const
-{
-    struct stat ss;
-    return path_stat( ss ) == 0 && S_ISSOCK( ss.st_mode );
-}
+    if constexpr ( in.o == Regex::op::SET && in.x == 1 && in.y == 1 ) {
+        return i < c.len && CtInst::has( in.set, uint8_t( c.s[i] ) ) && step<PC+1>( c, i+1, depth+1 );
+
+    } else if constexpr ( in.o == Regex::op::SET ) {
+        // repeated SET: find the run, then try the continuation at each allowed length
+        if ( i >= c.fail_lo[in.memo] && i <= c.fail_hi[in.memo] ) return false;
+        size_t n = 0;
+        size_t n_max = c.len - i;
+        if constexpr ( in.y != Regex::REPEAT_INF ) n_max = std::min( n_max, size_t( in.y ) );
+        while( n < n_max && CtInst::has( in.set, uint8_t( c.s[i+n] ) ) ) n++;
+        if ( n < in.x ) return false;
+        if constexpr ( in.greedy ) {
+            for( size_t k = n; ; k-- )
+            {
+                if ( step<PC+1>( c, i+k, depth+1 ) ) return true;
+                if ( k == in.x || c.overflow ) break;
+            }
+        } else {
+            for( size_t k = in.x; k <= n && !c.overflow; k++ )
+            {
+                if ( step<PC+1>( c, i+k, depth+1 ) ) return true;
+            }
+        }
+        if constexpr ( in.y == Regex::REPEAT_INF ) {
+            // starting later in the same run tries a subset of the same continuations
+            c.fail_lo[in.memo] = i;
+            c.fail_hi[in.memo] = i + n;
+        }
+        return false;
 
-inline bool val::path_is_dir( void ) const
-{
-    struct stat ss;
-    return path_stat( ss ) == 0 && S_ISDIR( ss.st_mode );
+    } else if constexpr ( in.o == Regex::op::SPLIT ) {
+        return step<in.x>( c, i, depth+1 ) || step<in.y>( c, i, depth+1 );
+
+    } else if constexpr ( in.o == Regex::op::JMP ) {
+        return step<in.x>( c, i, depth+1 );
+
+    } else if constexpr ( in.o == Regex::op::SAVE ) {
+        int64_t old = c.caps[in.x];
+        c.caps[in.x] = int64_t( i );
+        if ( step<PC+1>( c, i, depth+1 ) ) return true;
+        c.caps[in.x] = old;
+        return false;
+
+    } else if constexpr ( in.o == Regex::op::ASSERT ) {
+        bool prev_word = i > 0 && Regex::is_word( uint8_t( c.s[i-1] ) );
+        bool next_word = i < c.len && Regex::is_word( uint8_t( c.s[i] ) );
+        return Regex::holds( in.c, i == 0, prev_word, i == c.len, next_word ) && step<PC+1>( c, i, depth+1 );
+
+    } else {
+        return !(c.not_null && i == c.start) && (c.must_end < 0 || int64_t( i ) == c.must_end);
+    }
 }
 
-inline time_t val::path_time_modified( void ) const
+template<typename Pat>
+inline bool val::CtRegex<Pat>::at( Ctx& c, size_t start, int64_t must_end, bool not_null )
 {
-    struct stat ss;
-    int r = path_stat( ss );
-    csassert( r == 0, "can't ss " + std::string( *this ) );
-    return ss.st_mtime;
+    c.reset();
+    c.start    = start;
+    c.must_end = must_end;
+    c.not_null = not_null;
+    return step<0>( c, start, 0 );
 }
 
-inline time_t val::path_time_accessed( void ) const
+template<typename Pat>
+inline bool val::CtRegex<Pat>::find( Ctx& c, size_t pos )
 {
-    struct stat ss;
-    int r = path_stat( ss );
-    csassert( r == 0, "can't ss " + std::string( *this ) );
-    return ss.st_atime;
+    // a failure at some (instruction, position) doesn't depend on where the attempt started, so the stamps carry over
+    c.reset();
+    c.must_end = -1;
+    c.not_null = false;
+    for( size_t start = pos; start <= c.len; start++ )
+    {
+        if constexpr ( !prog.nullable ) {
+            if constexpr ( prog.first_cnt == 1 ) {
+                uint32_t b = 0;
+                while( !CtInst::has( prog.first, uint8_t( b ) ) ) b++;
+                const void * next = memchr( c.s + start, int( b ), c.len - start );
+                if ( next == nullptr ) return false;
+                start = size_t( static_cast<const char *>( next ) - c.s );
+            } else {
+                while( start < c.len && !CtInst::has( prog.first, uint8_t( c.s[start] ) ) ) start++;
+                if ( start == c.len ) return false;
+            }
+        }
+        c.start = start;
+        if ( step<0>( c, start, 0 ) ) return true;
+        if ( c.overflow ) return false;
+    }
+    return false;
 }
 
-//--------------------------------------------------------------------------------------
-//--------------------------------------------------------------------------------------
-//
-// FILE I/O
-//
-//--------------------------------------------------------------------------------------
-//--------------------------------------------------------------------------------------
-val val::json_read( std::string file_name )
+template<typename Pat>
+inline bool val::CtRegex<Pat>::match( const char * s, size_t len, val& matches )
 {
-    //------------------------------------------------------------
-    // Map in .json file
-    //------------------------------------------------------------
-    line_num = 1;
-    can_skip_comments = false; // no comments in .json files
-
-    const char * json;
-    const char * json_end;
-    csassert( file_read( file_name, json, json_end ), "unable to read in " + file_name );
-
-    //------------------------------------------------------------
-    // Parse a map.
-    //------------------------------------------------------------
-    val map;
-    csassert( parse_json_map( map, json, json_end ), "unable to parse top-level map: " + surrounding_lines( json, json_end ) );
-    return map;
+    // returns false if the automaton should be used instead
+    if ( len > CT_TEXT_MAX ) return false;
+    Ctx c( s, len );
+    if ( !at( c, 0, int64_t( len ), false ) ) {
+        matches = val();
+        return !c.overflow;
+    }
+    matches = list();
+    for( uint32_t g = 0; g < G; g++ )
+    {
+        matches.push( (c.caps[2*g] >= 0 && c.caps[2*g+1] >= 0) ? std::string( s + c.caps[2*g], size_t( c.caps[2*g+1] - c.caps[2*g] ) ) : std::string() );
+    }
+    return true;
 }
 
-val val::json_decode( void * buffer, size_t buffer_len )
+template<typename Pat>
+inline bool val::CtRegex<Pat>::replace( const char * s, size_t len, const std::string& fmt, uint64_t max, std::string& out )
 {
-    val map;
-    const char * json = reinterpret_cast<const char *>( buffer );
-    const char * json_end = json + buffer_len;
-    csassert( parse_json_map( map, json, json_end ), "unable to parse top-level map: " + surrounding_lines( json, json_end ) );
-    return map;
+    // returns false if the automaton should be used instead
+    if ( len > CT_TEXT_MAX ) return false;
+    Ctx c( s, len );
+    out = Regex::replace_matches( s, len, fmt, max, G,
+        [&]( size_t pos ) -> const int64_t * { return find( c, pos ) ? c.caps : nullptr; },
+        [&]( size_t pos ) -> const int64_t * { return at( c, pos, -1, true ) ? c.caps : nullptr; } );
+    return !c.overflow;
 }
 
-void val::json_write( std::string name )
+template<typename Pat>
+inline val val::ct_match( void ) const
 {
-    (void)name;
-    csdie( "json_write() not yet implemented" );
+    std::string s_tmp;
+    const std::string& s = (k == kind::STR) ? u.s->s : (s_tmp = std::string( *this ));
+    val matches;
+    if ( CtRegex<Pat>::match( s.data(), s.size(), matches ) ) return matches;
+    return match( Pat::str, "d" );
 }
 
-bool val::file_read( std::string file_path, const char *& start, const char *& end )
+template<typename Pat>
+inline val val::ct_replace( const val& fmt, uint64_t max ) const
 {
-    const char * fname = file_path.c_str();
-    int fd = open( fname, O_RDONLY );
-    if ( fd < 0 ) std::cout << "file_read() error reading " << file_path << ": " << strerror( errno ) << "\n";
-    csassert( fd >= 0, "could not open file " + file_path + " - open() error: " + strerror( errno ) );
-
-    struct stat file_stat;
-    int status = fstat( fd, &file_stat );
-    if ( status < 0 ) {
-        close( fd );
-        csassert( 0, "could not stat file " + std::string(fname) + " - stat() error: " + strerror( errno ) );
-    }
-    size_t size = file_stat.st_size;
-
-    // let mmap() choose an addr and make the region read-only
-    void * addr = mmap( 0, size, PROT_READ, MAP_FILE|MAP_SHARED, fd, 0 );
-    csassert( addr != MAP_FAILED, "file_read() mmap() call failed" );
-    start = reinterpret_cast<const char *>( addr );
-    end = start + size;
-    return true;
+    std::string s_tmp;
+    const std::string& s = (k == kind::STR) ? u.s->s : (s_tmp = std::string( *this ));
+    std::string out;
+    if ( CtRegex<Pat>::replace( s.data(), s.size(), std::string( fmt ), max, out ) ) return out;
+    return replace_all( Pat::str, fmt, "d", max );
 }
 
+#if __cplusplus >= 202002L
+template<val::fixed_string P> inline val val::match( void ) const                                      { return ct_match<CtPattern<P>>(); }
+template<val::fixed_string P> inline val val::replace( const val& fmt ) const                          { return ct_replace<CtPattern<P>>( fmt, uint64_t( -1 ) ); }
+template<val::fixed_string P> inline val val::replace_all( const val& fmt, uint64_t max ) const        { return ct_replace<CtPattern<P>>( fmt, max ); }
+#else
+template<const char * P> inline val val::match( void ) const                                           { return ct_match<CtPattern<P>>(); }
+template<const char * P> inline val val::replace( const val& fmt ) const                               { return ct_replace<CtPattern<P>>( fmt, uint64_t( -1 ) ); }
+template<const char * P> inline val val::replace_all( const val& fmt, uint64_t max ) const             { return ct_replace<CtPattern<P>>( fmt, max ); }
+#endif
+
 //--------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------
 //
@@ -2051,11 +9076,11 @@ inline bool val::parse_json_expr( val& v, const char *& xxx, const char * xxx_en
     } else {
         std::string id;
         if ( !parse_id( id, xxx, xxx_end ) ) goto error;
-        if ( id == "False" ) {
+        if ( id == "false" || id == "False" ) {
             v = val( false );
-        } else if ( id == "True" ) {
+        } else if ( id == "true" || id == "True" ) {
             v = val( true );
-        } else if ( id == "Null" ) {
+        } else if ( id == "null" || id == "Null" ) {
             v = val();
         } else {
             goto error;
@@ -2127,4 +9152,237 @@ error:
     return false;
 }
 
+inline bool val::parse_json_key( std::string_view& key, std::string& tmp, const char *& xxx, const char * xxx_end )
+{
+    // common case of no escapes returns a view into the buffer rather than allocating
+    skip_whitespace( xxx, xxx_end );
+    csassert( xxx != xxx_end && *xxx == '"', "expected map key string: " + surrounding_lines( xxx, xxx_end ) );
+    const char * start = xxx + 1;
+    const char * end = start;
+    while( end != xxx_end && *end != '"' && *end != '\\' ) end++;
+    if ( end != xxx_end && *end == '"' ) {
+        key = std::string_view( start, end - start );
+        xxx = end + 1;
+        return true;
+    }
+    if ( !parse_string( tmp, xxx, xxx_end ) ) return false;
+    key = tmp;
+    return true;
+}
+
+inline bool val::parse_json_null( const char *& xxx, const char * xxx_end )
+{
+    if ( xxx_end - xxx >= 4 && (memcmp( xxx, "null", 4 ) == 0 || memcmp( xxx, "Null", 4 ) == 0) ) {
+        xxx += 4;
+        return true;
+    }
+    return false;
+}
+
+inline bool val::skip_json_expr( const char *& xxx, const char * xxx_end )
+{
+    skip_whitespace( xxx, xxx_end );
+    csassert( xxx != xxx_end, "premature end of file" );
+    if ( *xxx == '{' || *xxx == '[' ) {
+        // skip to matching bracket, minding strings
+        uint64_t depth = 0;
+        do
+        {
+            csassert( xxx != xxx_end, "premature end of file" );
+            char ch = *xxx++;
+            if ( ch == '{' || ch == '[' ) {
+                depth++;
+            } else if ( ch == '}' || ch == ']' ) {
+                depth--;
+            } else if ( ch == '"' ) {
+                for( ;; )
+                {
+                    csassert( xxx != xxx_end, "no terminating \" for string" );
+                    ch = *xxx++;
+                    if ( ch == '"' ) break;
+                    if ( ch == '\\' && xxx != xxx_end ) xxx++;
+                }
+            } else if ( ch == '\n' ) {
+                line_num++;
+            }
+        } while( depth != 0 );
+        return true;
+    } 
+
+    std::string s;
+    if ( *xxx == '"' ) return parse_string( s, xxx, xxx_end );
+    if ( *xxx == '-' || (*xxx >= '0' && *xxx <= '9') ) {
+        double r;
+        return parse_real64( r, xxx, xxx_end );
+    }
+    return parse_id( s, xxx, xxx_end );
+}
+
+template<typename T> 
+void val::json_decode_into( const void * buffer, size_t buffer_len, T& out )
+{
+    const char * json = reinterpret_cast<const char *>( buffer );
+    const char * json_end = json + buffer_len;
+    line_num = 1;
+    csassert( parse_json_typed( out, json, json_end ), "unable to parse json: " + surrounding_lines( json, json_end ) );
+}
+
+template<typename T> 
+inline bool val::parse_json_typed( T& o, const char *& xxx, const char * xxx_end )
+{
+    skip_whitespace( xxx, xxx_end );
+    csassert( xxx != xxx_end, "premature end of file" );
+    if ( !std::is_same<T, val>::value && parse_json_null( xxx, xxx_end ) ) return true;   // leaves o as is
+
+    if constexpr ( std::is_same<T, val>::value ) {
+        return parse_json_expr( o, xxx, xxx_end );
+
+    } else if constexpr ( std::is_same<T, bool>::value ) {
+        std::string id;
+        if ( !parse_id( id, xxx, xxx_end ) ) return false;
+        csassert( id == "true" || id == "True" || id == "false" || id == "False", "expected bool: " + surrounding_lines( xxx, xxx_end ) );
+        o = id[0] == 't' || id[0] == 'T';
+        return true;
+
+    } else if constexpr ( std::is_integral<T>::value ) {
+        // digits are accumulated as a magnitude, so every value of every integer type can be range-checked
+        const char * start = xxx;
+        bool is_neg = *xxx == '-';
+        if ( is_neg ) xxx++;
+        uint64_t mag = 0;
+        bool vld = false;
+        bool overflow = false;
+        for( ; xxx != xxx_end && *xxx >= '0' && *xxx <= '9'; xxx++ )
+        {
+            uint64_t d = uint64_t( *xxx - '0' );
+            overflow = overflow || mag > (UINT64_MAX - d) / 10;
+            mag = mag*10 + d;
+            vld = true;
+        }
+        csassert( vld, "unable to parse int" + surrounding_lines( xxx, xxx_end ) );
+        if ( xxx != xxx_end && (*xxx == '.' || *xxx == 'e' || *xxx == 'E') ) {
+            // written as a real; checked before converting, because an out-of-range conversion is undefined
+            double r;
+            xxx = start;
+            if ( !parse_real64( r, xxx, xxx_end ) ) return false;
+            double hi = std::ldexp( 1.0, std::numeric_limits<T>::digits );
+            csassert( (std::is_signed<T>::value ? r >= -hi : r > -1.0) && r < hi, "value out of range for integer: " + surrounding_lines( start, xxx_end ) );
+            o = T( r );
+            return true;
+        }
+        uint64_t max = uint64_t( std::numeric_limits<T>::max() );
+        bool in_range = !overflow && ((is_neg && mag != 0) ? (std::is_signed<T>::value && mag <= max+1) : mag <= max);
+        csassert( in_range, "value out of range for integer: " + surrounding_lines( start, xxx_end ) );
+        o = (is_neg && mag != 0) ? T( -int64_t( mag - 1 ) - 1 ) : T( mag );
+        return true;
+
+    } else if constexpr ( std::is_floating_point<T>::value ) {
+        double r;
+        if ( !parse_real64( r, xxx, xxx_end ) ) return false;
+        o = T( r );
+        return true;
+
+    } else if constexpr ( std::is_same<T, std::string>::value ) {
+        return parse_string( o, xxx, xxx_end );
+
+    } else if constexpr ( is_vector<T>::value ) {
+        o.clear();
+        if ( !expect_char( '[', xxx, xxx_end ) ) return false;
+        for( bool is_first = true; ; is_first = false ) 
+        {
+            skip_whitespace( xxx, xxx_end );
+            csassert( xxx != xxx_end, "premature end of file" );
+            if ( *xxx == ']' ) {
+                xxx++;
+                return true;
+            }
+            if ( !is_first && !expect_char( ',', xxx, xxx_end ) ) return false;
+            typename T::value_type x{};                         // not o.back(), which is a proxy for std::vector<bool>
+            if ( !parse_json_typed( x, xxx, xxx_end ) ) return false;
+            o.push_back( std::move( x ) );
+        }
+
+    } else {
+        if ( !expect_char( '{', xxx, xxx_end ) ) return false;
+        std::string tmp;
+        for( bool is_first = true; ; is_first = false ) 
+        {
+            skip_whitespace( xxx, xxx_end );
+            csassert( xxx != xxx_end, "premature end of file" );
+            if ( *xxx == '}' ) {
+                xxx++;
+                return true;
+            }
+            if ( !is_first && !expect_char( ',', xxx, xxx_end ) ) return false;
+
+            std::string_view key;
+            if ( !parse_json_key( key, tmp, xxx, xxx_end ) ) return false;
+            if ( !expect_char( ':', xxx, xxx_end, true ) ) return false;
+
+            bool found = false;
+            bool ok    = true;
+            json_schema<T>::fields( o, [&]( const char * name, auto& field ) 
+            {
+                if ( !found && key == name ) {
+                    found = true;
+                    ok = parse_json_typed( field, xxx, xxx_end );
+                }
+            } );
+            if ( !found ) ok = skip_json_expr( xxx, xxx_end );         // not described, so ignore it
+            if ( !ok ) return false;
+        }
+    }
+}
+
+template<typename T> 
+std::string val::json_encode_from( const T& in )
+{
+    Writer w;
+    json_encode_typed( w, in );
+    return std::move( w.buff );
+}
+
+template<typename T> 
+inline void val::json_encode_typed( Writer& w, const T& o )
+{
+    if constexpr ( std::is_same<T, val>::value ) {
+        o.json_encode_expr( w );
+
+    } else if constexpr ( std::is_same<T, bool>::value ) {
+        if ( o ) w.put( "true", 4 ); else w.put( "false", 5 );
+
+    } else if constexpr ( std::is_integral<T>::value ) {
+        std::string i_s = std::is_signed<T>::value ? std::to_string( int64_t( o ) ) : std::to_string( uint64_t( o ) );
+        w.put( i_s.data(), i_s.length() );
+
+    } else if constexpr ( std::is_floating_point<T>::value ) {
+        json_put_real64( w, double( o ) );
+
+    } else if constexpr ( std::is_same<T, std::string>::value ) {
+        json_put_string( w, o.data(), o.length() );
+
+    } else if constexpr ( is_vector<T>::value ) {
+        w.put( '[' );
+        for( size_t i = 0; i < o.size(); i++ )
+        {
+            if ( i != 0 ) w.put( ',' );
+            json_encode_typed( w, o[i] );
+        }
+        w.put( ']' );
+
+    } else {
+        bool is_first = true;
+        w.put( '{' );
+        json_schema<T>::fields( o, [&]( const char * name, const auto& field ) 
+        {
+            if ( !is_first ) w.put( ',' );
+            is_first = false;
+            json_put_string( w, name, strlen( name ) );
+            w.put( ':' );
+            json_encode_typed( w, field );
+        } );
+        w.put( '}' );
+    }
+}
+
 #endif // __cs_h
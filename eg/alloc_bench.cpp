@@ -0,0 +1,88 @@
+// eg/alloc_bench.cpp
+//
+// Throughput of val control-block churn as threads are added, plus blocks
+// handed through a CHANNEL and freed on another thread.
+// Build once normally and once with -DCS_NO_BLOCK_CACHE to compare.
+//
+// usage: alloc_bench [iter_cnt [max_thr_cnt]]
+//
+#include "cs.h"
+#include <chrono>
+
+using std::cout;
+
+static double now( void )
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// each iteration allocates and frees a handful of STR, LIST and MAP blocks
+static val churn( const val& thr_i, const val& args )
+{
+    (void)thr_i;
+    int64_t iter_cnt = args.get( 0 );
+    int64_t sum = 0;
+    for( int64_t i = 0; i < iter_cnt; i++ )
+    {
+        val l = val::list();
+        l.push( "name" );
+        l.push( "some string too long for SSO" );
+        val m = val::map();
+        m.set( "l", l );
+        m.set( "x", i );
+        sum += int64_t( m.size() + l.size() );
+    }
+    return sum;
+}
+
+static val producer( const val& args )
+{
+    val ch = args.get( 0 );
+    int64_t iter_cnt = args.get( 1 );
+    for( int64_t i = 0; i < iter_cnt; i++ )
+    {
+        val l = val::list();
+        l.push( "some string too long for SSO" );
+        ch.send( l );
+    }
+    ch.close();
+    return 0;
+}
+
+static val consumer( const val& args )
+{
+    val ch = args.get( 0 );
+    int64_t cnt = 0;
+    for( ;; )
+    {
+        val l = ch.recv_many( 256 );
+        if ( l.size() == 0 ) break;
+        cnt += int64_t( l.size() );
+    }
+    return cnt;
+}
+
+int main( int argc, const char * argv[] )
+{
+    int64_t iter_cnt    = (argc > 1) ? std::atoi( argv[1] ) : 200000;
+    int64_t max_thr_cnt = (argc > 2) ? std::atoi( argv[2] ) : std::max( 1U, std::thread::hardware_concurrency() );
+
+    for( int64_t thr_cnt = 1; thr_cnt <= max_thr_cnt; thr_cnt *= 2 )
+    {
+        double start = now();
+        val::threads( thr_cnt, churn, val{ iter_cnt } ).join();
+        double secs = now() - start;
+        cout << std::setw( 4 ) << thr_cnt << " threads: " << std::fixed << std::setprecision( 2 )
+             << std::setw( 8 ) << (double( thr_cnt * iter_cnt ) / secs / 1e6) << " M iter/s\n";
+    }
+
+    double start = now();
+    val ch = val::channel( 1024 );
+    val p = val::thread( producer, val{ ch, iter_cnt } );
+    val c = val::thread( consumer, val{ ch } );
+    p.join();
+    csassert( int64_t( c.join() ) == iter_cnt, "consumer lost items" );
+    double secs = now() - start;
+    cout << "cross-thread: " << std::fixed << std::setprecision( 2 ) << (double( iter_cnt ) / secs / 1e6) << " M iter/s\n";
+    return 0;
+}
@@ -0,0 +1,79 @@
+// eg/codec_bench.cpp
+//
+// Decode throughput of the binary codecs vs. json_decode() on the same data.
+//
+// usage: codec_bench [record_cnt [iter_cnt]]
+//
+#include "cs.h"
+#include <chrono>
+
+using std::cout;
+
+static double now( void )
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static void report( std::string name, size_t byte_cnt, int64_t iter_cnt, double secs )
+{
+    cout << std::setw( 8 ) << name << ": " << std::setw( 10 ) << byte_cnt << " bytes  " 
+         << std::fixed << std::setprecision( 1 ) << std::setw( 8 ) << (double( byte_cnt ) * iter_cnt / secs / 1e6) << " MB/s  " 
+         << std::setw( 8 ) << (secs / iter_cnt * 1e3) << " ms/decode\n";
+}
+
+int main( int argc, const char * argv[] )
+{
+    int64_t record_cnt = (argc > 1) ? std::atoi( argv[1] ) : 100000;
+    int64_t iter_cnt   = (argc > 2) ? std::atoi( argv[2] ) : 5;
+
+    // same data as a JSON string and as a val
+    std::string json = "{ \"records\": [";
+    val records = val::list();
+    for( int64_t i = 0; i < record_cnt; i++ )
+    {
+        std::string name = "record_" + std::to_string( i );
+        double      x    = double( i ) * 0.25;
+        json += std::string( (i == 0) ? "" : "," ) + "{ \"id\": " + std::to_string( i ) + ", \"name\": \"" + name + 
+                "\", \"x\": " + std::to_string( x ) + ", \"tags\": [\"a\", \"b\", \"c\"] }";
+        val r = val::map();
+        r.set( "id", double( i ) );     // json_decode() returns all numbers as FLT
+        r.set( "name", name );
+        r.set( "x", x );
+        r.set( "tags", val{ "a", "b", "c" } );
+        records.push( r );
+    }
+    json += "] }";
+    val top = val::map();
+    top.set( "records", records );
+
+    // int64 limits survive every codec
+    for( int64_t x : { INT64_MIN, INT64_MIN+1, int64_t( -1 ), int64_t( 0 ), INT64_MAX } )
+    {
+        val l{ x };
+        std::string b = l.bin_encode(), m = l.msgpack_encode(), c = l.cbor_encode();
+        csassert( int64_t( val::bin_decode( b.data(), b.length() ).get( 0 ) ) == x, "bin int64 round trip" );
+        csassert( int64_t( val::msgpack_decode( m.data(), m.length() ).get( 0 ) ) == x, "msgpack int64 round trip" );
+        csassert( int64_t( val::cbor_decode( c.data(), c.length() ).get( 0 ) ) == x, "cbor int64 round trip" );
+    }
+
+    std::string bin     = top.bin_encode();
+    std::string msgpack = top.msgpack_encode();
+    std::string cbor    = top.cbor_encode();
+
+    double t = now();
+    for( int64_t i = 0; i < iter_cnt; i++ ) csassert( val::json_decode( &json[0], json.length() ).get( "records" ).size() == uint64_t( record_cnt ), "bad json" );
+    report( "json", json.length(), iter_cnt, now() - t );
+
+    t = now();
+    for( int64_t i = 0; i < iter_cnt; i++ ) csassert( val::bin_decode( bin.data(), bin.length() ).get( "records" ).size() == uint64_t( record_cnt ), "bad bin" );
+    report( "bin", bin.length(), iter_cnt, now() - t );
+
+    t = now();
+    for( int64_t i = 0; i < iter_cnt; i++ ) csassert( val::msgpack_decode( msgpack.data(), msgpack.length() ).get( "records" ).size() == uint64_t( record_cnt ), "bad msgpack" );
+    report( "msgpack", msgpack.length(), iter_cnt, now() - t );
+
+    t = now();
+    for( int64_t i = 0; i < iter_cnt; i++ ) csassert( val::cbor_decode( cbor.data(), cbor.length() ).get( "records" ).size() == uint64_t( record_cnt ), "bad cbor" );
+    report( "cbor", cbor.length(), iter_cnt, now() - t );
+    return 0;
+}
@@ -0,0 +1,65 @@
+// eg/lines_bench.cpp
+//
+// Line-at-a-time reading of a log file with std::getline() on an ifstream
+// vs. FILE lines(), which hands out views into its read buffer.
+//
+// usage: lines_bench [line_cnt]
+//
+#include "cs.h"
+#include <chrono>
+#include <fstream>
+
+using std::cout;
+
+static double now( void )
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static void report( std::string name, size_t byte_cnt, double secs )
+{
+    cout << std::setw( 20 ) << name << ": " << std::fixed << std::setprecision( 1 )
+         << std::setw( 8 ) << (double( byte_cnt ) / secs / 1e6) << " MB/s\n";
+}
+
+int main( int argc, const char * argv[] )
+{
+    int64_t line_cnt = (argc > 1) ? std::atoi( argv[1] ) : 2000000;
+
+    val tmp = val::file( "" );
+    for( int64_t i = 0; i < line_cnt; i++ )
+    {
+        tmp.write( "2024-01-01 12:00:" + std::to_string( i % 60 ) + " user=user" + std::to_string( i ) +
+                   ((i % 100 == 0) ? " status=ERROR\n" : " status=ok\n") );
+    }
+    std::string path = "/tmp/lines_bench.log";
+    {
+        val f = val::file( path, "c" );
+        tmp.seek( 0 );
+        f.write( tmp.read() );
+    }
+
+    // count lines holding ERROR; both passes read a warm page cache
+    double start = now();
+    std::ifstream in( path );
+    std::string line;
+    int64_t std_cnt = 0;
+    size_t byte_cnt = 0;
+    while( std::getline( in, line ) )
+    {
+        byte_cnt += line.size() + 1;
+        if ( line.find( "ERROR" ) != std::string::npos ) std_cnt++;
+    }
+    report( "std::getline", byte_cnt, now() - start );
+
+    start = now();
+    int64_t cnt = 0;
+    for( std::string_view l : val::file( path, "r" ).lines() )
+    {
+        if ( l.find( "ERROR" ) != std::string_view::npos ) cnt++;
+    }
+    report( "lines()", byte_cnt, now() - start );
+    csassert( cnt == std_cnt, "line counts differ" );
+    unlink( path.c_str() );
+    return 0;
+}
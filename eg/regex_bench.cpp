@@ -0,0 +1,87 @@
+// eg/regex_bench.cpp
+//
+// replace_all() and match() throughput of the default std::regex engine vs. the
+// automaton engine selected with the 'd' option vs. compile-time patterns.
+//
+// usage: regex_bench [line_cnt]
+//
+#include "cs.h"
+#include <chrono>
+
+using std::cout;
+
+static double now( void )
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static void report( std::string name, size_t byte_cnt, double secs )
+{
+    cout << std::setw( 28 ) << name << ": " << std::fixed << std::setprecision( 1 )
+         << std::setw( 8 ) << (double( byte_cnt ) / secs / 1e6) << " MB/s\n";
+}
+
+int main( int argc, const char * argv[] )
+{
+    int64_t line_cnt = (argc > 1) ? std::atoi( argv[1] ) : 100000;
+
+    std::string log;
+    for( int64_t i = 0; i < line_cnt; i++ )
+    {
+        log += "2024-01-01 12:00:" + std::to_string( i % 60 ) + " user=user" + std::to_string( i ) +
+               " ip=10.0." + std::to_string( (i / 256) % 256 ) + "." + std::to_string( i % 256 ) + " status=ok\n";
+    }
+    val text = log;
+
+    struct Case { const char * name; const char * re; const char * fmt; };
+    Case cases[] = {
+        { "scrub ips",          "ip=[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+",     "ip=X" },
+        { "swap key=value",     "([a-z]+)=([a-z0-9]+)",                     "$2=$1" },
+        { "rare literal",       "user=user99999[0-9]",                      "-" },
+        { "word boundary",      "\\bok\\b",                                 "OK" },
+    };
+    for( const Case& c : cases )
+    {
+        for( const char * options : { "", "d" } )
+        {
+            double start = now();
+            val out = text.replace_all( c.re, c.fmt, options );
+            double secs = now() - start;
+            report( std::string( c.name ) + ((*options == 'd') ? " (d)" : " (std)"), log.size(), secs );
+        }
+    }
+
+    // full-string match of every line
+    val lines = val::list();
+    for( int64_t i = 0; i < line_cnt; i += 10 ) lines.push( "user" + std::to_string( i ) + "@host" + std::to_string( i % 7 ) + ".example.com" );
+    for( const char * options : { "", "d" } )
+    {
+        double start = now();
+        int64_t matched = 0;
+        size_t byte_cnt = 0;
+        for( uint64_t i = 0; i < lines.size(); i++ )
+        {
+            const val& line = lines.get( i );
+            byte_cnt += line.size();
+            if ( line.match( "([a-z0-9]+)@([a-z0-9.]+)\\.com", options ).defined() ) matched++;
+        }
+        double secs = now() - start;
+        csassert( matched == int64_t( lines.size() ), "not all lines matched" );
+        report( std::string( "match emails" ) + ((*options == 'd') ? " (d)" : " (std)"), byte_cnt, secs );
+    }
+
+    static constexpr char email[] = "([a-z0-9]+)@([a-z0-9.]+)\\.com";
+    double start = now();
+    int64_t matched = 0;
+    size_t byte_cnt = 0;
+    for( uint64_t i = 0; i < lines.size(); i++ )
+    {
+        const val& line = lines.get( i );
+        byte_cnt += line.size();
+        if ( line.match<email>().defined() ) matched++;
+    }
+    double secs = now() - start;
+    csassert( matched == int64_t( lines.size() ), "not all lines matched" );
+    report( "match emails (ct)", byte_cnt, secs );
+    return 0;
+}